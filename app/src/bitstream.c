@@ -0,0 +1,283 @@
+/**
+ * @file bitstream.c
+ * @brief Incremental parser for iCE40 configuration bitstreams
+ *
+ * An iCE40 bitstream is an optional 0xFF 0x00 ... 0x00 0xFF comment
+ * block, the sync word 7E AA 99 7E and a sequence of commands. Each
+ * command byte holds an opcode in the upper and an argument length in
+ * the lower nibble, followed by the big-endian argument. CRAM and BRAM
+ * data commands are followed by bank width * height / 8 bytes of data.
+ * The image ends with the wakeup command.
+ *
+ * A warm boot applet (icemulti) instead is a table of short headers,
+ * each ending with the reboot command after a boot address, padded with
+ * zeros up to the images it boots. The images follow at those addresses
+ * in the same file, so the table alone does not tell where the data
+ * ends: the parser skips to the last image booted within the payload
+ * and parses that one up to its wakeup command.
+ *
+ * The parser only checks the structure, it does not decode frames, so
+ * its cost per byte is a few comparisons.
+ */
+
+#include "bitstream.h"
+
+#include <errno.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/util.h>
+
+LOG_MODULE_REGISTER(bitstream);
+
+/* Preambles and comments longer than this are taken for garbage */
+#define COMMENT_MAX                    4096
+
+/* Opcodes */
+#define OP_CONTROL                     0x0
+#define OP_BANK                        0x1
+#define OP_CRC                         0x2
+#define OP_BOOT_ADDR                   0x4
+#define OP_OSC                         0x5
+#define OP_WIDTH                       0x6
+#define OP_HEIGHT                      0x7
+#define OP_OFFSET                      0x8
+#define OP_FLAGS                       0x9
+
+/* OP_CONTROL arguments */
+#define CTRL_CRAM_DATA                 0x01
+#define CTRL_BRAM_DATA                 0x03
+#define CTRL_CRC_RESET                 0x05
+#define CTRL_WAKEUP                    0x06
+#define CTRL_REBOOT                    0x08
+
+/* OP_BOOT_ADDR carries the SPI read opcode above the flash address */
+#define BOOT_ADDR_MASK                 0xFFFFFF
+
+static const uint8_t sync_word[] = {0x7E, 0xAA, 0x99, 0x7E};
+
+void bitstream_init(struct bitstream_parser *p, uint32_t base,
+		    uint32_t size)
+{
+	*p = (struct bitstream_parser){
+		.state = BITSTREAM_PREAMBLE,
+		.base = base,
+		.size = size,
+		.image_first = UINT32_MAX,
+	};
+}
+
+/**
+ * @brief Note the image a warm boot applet header boots
+ */
+static int reboot(struct bitstream_parser *p)
+{
+	uint32_t off = p->boot_addr - p->base;
+
+	/* Applets booted by an applet are not followed */
+	if (p->last_image) {
+		return -EBADMSG;
+	}
+
+	/* Images elsewhere in flash are not part of this write */
+	if (p->boot_addr >= p->base && off > p->pos && off < p->size) {
+		p->image_first = MIN(p->image_first, off);
+		p->image_last = MAX(p->image_last, off);
+	}
+
+	p->state = BITSTREAM_APPLET;
+	return 0;
+}
+
+/**
+ * @brief Leave the applet headers for the last image they boot, if any
+ */
+static void applet_end(struct bitstream_parser *p)
+{
+	if (!p->image_last) {
+		p->state = BITSTREAM_DONE;
+		return;
+	}
+
+	p->data_left = p->image_last - p->pos;
+	p->state = BITSTREAM_SKIP;
+}
+
+/**
+ * @brief Act on a command whose argument is complete
+ */
+static int execute(struct bitstream_parser *p)
+{
+	switch (p->cmd >> 4) {
+	case OP_CONTROL:
+		switch (p->arg) {
+		case CTRL_CRAM_DATA:
+		case CTRL_BRAM_DATA:
+			if (!p->bank_width || !p->bank_height) {
+				return -EBADMSG;
+			}
+			p->data_left = p->bank_width * p->bank_height / 8;
+			p->header_done = true;
+			p->state = p->data_left ? BITSTREAM_DATA :
+						  BITSTREAM_COMMAND;
+			return 0;
+		case CTRL_WAKEUP:
+			p->header_done = true;
+			p->state = BITSTREAM_DONE;
+			return 0;
+		case CTRL_REBOOT:
+			p->header_done = true;
+			return reboot(p);
+		default:
+			/* CRC reset; 0x00 is the padding after data */
+			p->state = BITSTREAM_COMMAND;
+			return 0;
+		}
+	case OP_BOOT_ADDR:
+		p->boot_addr = p->arg & BOOT_ADDR_MASK;
+		break;
+	case OP_WIDTH:
+		p->bank_width = p->arg + 1;
+		break;
+	case OP_HEIGHT:
+		p->bank_height = p->arg;
+		break;
+	default:
+		break;
+	}
+
+	p->state = BITSTREAM_COMMAND;
+	return 0;
+}
+
+/**
+ * @brief Start a command from its command byte
+ */
+static int start_command(struct bitstream_parser *p, uint8_t cmd)
+{
+	switch (cmd >> 4) {
+	case OP_CONTROL:
+	case OP_BANK:
+	case OP_CRC:
+	case OP_BOOT_ADDR:
+	case OP_OSC:
+	case OP_WIDTH:
+	case OP_HEIGHT:
+	case OP_OFFSET:
+	case OP_FLAGS:
+		break;
+	default:
+		return -EBADMSG;
+	}
+
+	if ((cmd & 0x0F) > sizeof(p->arg)) {
+		return -EBADMSG;
+	}
+
+	p->cmd = cmd;
+	p->arg = 0;
+	p->arg_left = cmd & 0x0F;
+	p->state = BITSTREAM_ARGUMENT;
+
+	return p->arg_left ? 0 : execute(p);
+}
+
+/**
+ * @brief Consume one byte outside of bulk data
+ */
+static int parse_byte(struct bitstream_parser *p, uint8_t b)
+{
+	switch (p->state) {
+	case BITSTREAM_PREAMBLE:
+		if (b == 0xFF) {
+			return p->pos - p->origin < COMMENT_MAX ? 0 : -EBADMSG;
+		}
+		if (b == 0x00 && p->pos > p->origin) {
+			p->state = BITSTREAM_COMMENT;
+			p->match = 0;
+			return 0;
+		}
+		if (b == sync_word[0]) {
+			p->state = BITSTREAM_SYNC;
+			p->match = 1;
+			return 0;
+		}
+		return -EBADMSG;
+	case BITSTREAM_COMMENT:
+		/* Ends with 0x00 0xFF */
+		if (p->match && b == 0xFF) {
+			p->state = BITSTREAM_PREAMBLE;
+		}
+		p->match = b == 0x00;
+		return p->pos - p->origin < COMMENT_MAX ? 0 : -EBADMSG;
+	case BITSTREAM_SYNC:
+		if (b != sync_word[p->match]) {
+			return -EBADMSG;
+		}
+		if (++p->match == sizeof(sync_word)) {
+			p->state = BITSTREAM_COMMAND;
+		}
+		return 0;
+	case BITSTREAM_COMMAND:
+		return start_command(p, b);
+	case BITSTREAM_ARGUMENT:
+		p->arg = (p->arg << 8) | b;
+		return --p->arg_left ? 0 : execute(p);
+	case BITSTREAM_APPLET:
+		/* Zero padding up to the next header */
+		if (b == sync_word[0]) {
+			p->state = BITSTREAM_SYNC;
+			p->match = 1;
+		}
+		return 0;
+	default:
+		return -EBADMSG;
+	}
+}
+
+int bitstream_feed(struct bitstream_parser *p, const uint8_t *buf,
+		   size_t len)
+{
+	size_t i = 0;
+	int err;
+
+	while (i < len && p->state != BITSTREAM_DONE) {
+		if (p->state == BITSTREAM_DATA || p->state == BITSTREAM_SKIP) {
+			size_t n = MIN(len - i, p->data_left);
+
+			i += n;
+			p->pos += n;
+			p->data_left -= n;
+			if (p->data_left == 0 && p->state == BITSTREAM_SKIP) {
+				p->origin = p->pos;
+				p->last_image = true;
+				p->state = BITSTREAM_PREAMBLE;
+			} else if (p->data_left == 0) {
+				p->state = BITSTREAM_COMMAND;
+			}
+			continue;
+		}
+
+		/* The header table ends where its first image starts */
+		if (p->state == BITSTREAM_APPLET &&
+		    (p->pos == p->image_first ||
+		     (buf[i] != 0x00 && buf[i] != sync_word[0]))) {
+			applet_end(p);
+			continue;
+		}
+
+		err = parse_byte(p, buf[i]);
+		if (err) {
+			LOG_ERR("Invalid bitstream at offset %u", p->pos);
+			return err;
+		}
+
+		i++;
+		p->pos++;
+	}
+
+	/* An applet booting nothing within the payload may fill it */
+	if (p->state == BITSTREAM_APPLET && p->pos == p->size) {
+		applet_end(p);
+	}
+
+	return i;
+}
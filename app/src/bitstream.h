@@ -0,0 +1,131 @@
+/**
+ * @file bitstream.h
+ * @brief Incremental parser for iCE40 configuration bitstreams
+ */
+
+#ifndef BITSTREAM_H
+#define BITSTREAM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Parser position within the bitstream
+ */
+enum bitstream_state {
+	BITSTREAM_PREAMBLE,
+	BITSTREAM_COMMENT,
+	BITSTREAM_SYNC,
+	BITSTREAM_COMMAND,
+	BITSTREAM_ARGUMENT,
+	BITSTREAM_DATA,
+	/* Between the headers of a warm boot applet */
+	BITSTREAM_APPLET,
+	/* Stored unparsed up to the last image the applet boots */
+	BITSTREAM_SKIP,
+	BITSTREAM_DONE,
+};
+
+/**
+ * @brief State of a bitstream being parsed
+ */
+struct bitstream_parser {
+	enum bitstream_state state;
+	/* Bytes consumed so far */
+	uint32_t pos;
+	/* Flash address of the first byte and size of the payload */
+	uint32_t base;
+	uint32_t size;
+	/* Offset of the image being parsed */
+	uint32_t origin;
+	uint8_t cmd;
+	uint8_t arg_left;
+	uint32_t arg;
+	/* Bytes of sync word matched, or comment terminator progress */
+	uint8_t match;
+	uint32_t data_left;
+	uint32_t bank_width;
+	uint32_t bank_height;
+	/* Last warm boot address */
+	uint32_t boot_addr;
+	/*
+	 * Offsets of the first and the last image within the payload that
+	 * a warm boot applet boots; UINT32_MAX and 0 if none
+	 */
+	uint32_t image_first;
+	uint32_t image_last;
+	/* Parsing the last image booted by an applet */
+	bool last_image;
+	/* Everything up to the first configuration data checked out */
+	bool header_done;
+};
+
+/**
+ * @brief Start parsing a new bitstream
+ *
+ * The payload placement only matters for warm boot applets, whose boot
+ * addresses are absolute flash addresses.
+ *
+ * @param p Parser state
+ * @param base Flash address the payload is written to
+ * @param size Number of bytes in the payload
+ */
+void bitstream_init(struct bitstream_parser *p, uint32_t base,
+		    uint32_t size);
+
+/**
+ * @brief Parse the next bytes of a bitstream
+ *
+ * Parsing stops at the wakeup command; anything after it is padding that
+ * the FPGA never reads. A warm boot applet (the reboot command) instead
+ * extends to the last image it boots within the payload, which is parsed
+ * up to its wakeup command; images in between are taken as they are. An
+ * applet booting nothing within the payload ends with its last header.
+ *
+ * @param p Parser state
+ * @param buf Next bytes of the stream
+ * @param len Number of bytes in @p buf
+ * @return Number of leading bytes of @p buf that belong to the bitstream,
+ *         -EBADMSG if the data is not a valid iCE40 bitstream
+ */
+int bitstream_feed(struct bitstream_parser *p, const uint8_t *buf,
+		   size_t len);
+
+/**
+ * @brief Check whether the end of the bitstream was reached
+ *
+ * @param p Parser state
+ * @return true once the wakeup command was parsed, or the end of a warm
+ *         boot applet was reached
+ */
+static inline bool bitstream_done(const struct bitstream_parser *p)
+{
+	return p->state == BITSTREAM_DONE;
+}
+
+/**
+ * @brief Check whether the bitstream header was accepted
+ *
+ * @param p Parser state
+ * @return true once the preamble, the sync word and the commands up to
+ *         the first configuration data (or the end) were parsed
+ */
+static inline bool bitstream_header_done(const struct bitstream_parser *p)
+{
+	return p->header_done;
+}
+
+/**
+ * @brief Get the length of the bitstream parsed so far
+ *
+ * @param p Parser state
+ * @return Bytes up to and including the last parsed byte; the full
+ *         image length once bitstream_done() is true
+ */
+static inline uint32_t bitstream_length(const struct bitstream_parser *p)
+{
+	return p->pos;
+}
+
+#endif /* BITSTREAM_H */
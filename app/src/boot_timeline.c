@@ -0,0 +1,40 @@
+/**
+ * @file boot_timeline.c
+ * @brief Timestamps of the startup stages, reported to the host
+ */
+
+#include "boot_timeline.h"
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/util.h>
+
+LOG_MODULE_REGISTER(boot_timeline);
+
+static atomic_t stamps[BOOT_STAGE_COUNT];
+
+void boot_timeline_mark(enum boot_stage stage)
+{
+	uint32_t now;
+
+	if (stage >= BOOT_STAGE_COUNT) {
+		return;
+	}
+
+	/* Never record 0, it means the stage is still pending */
+	now = MAX((uint32_t)k_ticks_to_us_floor64(k_uptime_ticks()), 1U);
+
+	if (atomic_cas(&stamps[stage], 0, now)) {
+		LOG_INF("Boot stage %d after %u us", stage, now);
+	}
+}
+
+uint32_t boot_timeline_get(enum boot_stage stage)
+{
+	if (stage >= BOOT_STAGE_COUNT) {
+		return 0;
+	}
+
+	return (uint32_t)atomic_get(&stamps[stage]);
+}
@@ -0,0 +1,41 @@
+/**
+ * @file boot_timeline.h
+ * @brief Timestamps of the startup stages, reported to the host
+ */
+
+#ifndef BOOT_TIMELINE_H
+#define BOOT_TIMELINE_H
+
+#include <stdint.h>
+
+/**
+ * @brief Startup stages, in the order they usually complete
+ */
+enum boot_stage {
+	/** USB stack enabled, device visible to the host */
+	BOOT_STAGE_USB_ENABLED,
+	/** Host selected a configuration */
+	BOOT_STAGE_USB_CONFIGURED,
+	/** All flash targets reset and identified */
+	BOOT_STAGE_FLASH_READY,
+	BOOT_STAGE_COUNT,
+};
+
+/**
+ * @brief Record that a stage completed
+ *
+ * Only the first call per stage is kept. Safe to call from any context.
+ *
+ * @param stage Stage that completed
+ */
+void boot_timeline_mark(enum boot_stage stage);
+
+/**
+ * @brief Get the time at which a stage completed
+ *
+ * @param stage Stage to query
+ * @return Microseconds since boot, or 0 if the stage did not complete yet
+ */
+uint32_t boot_timeline_get(enum boot_stage stage);
+
+#endif /* BOOT_TIMELINE_H */
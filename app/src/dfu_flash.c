@@ -0,0 +1,226 @@
+/**
+ * @file dfu_flash.c
+ * @brief USB DFU download of FPGA images to the target flash
+ *
+ * The DFU image "ice40" is the flash of the selected targets, starting at
+ * address 0. Downloaded blocks go through the page pool like HID writes;
+ * the flash ahead of each block is erased a 64KB block at a time, so the
+ * rest of the last block is erased too. Uploads read the flash of the
+ * lowest selected target.
+ */
+
+#include "dfu_flash.h"
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/reboot.h>
+#include <zephyr/sys/util.h>
+#include <zephyr/usb/class/usbd_dfu.h>
+
+#include "flash_worker.h"
+#include "page_pool.h"
+#include "sector_index.h"
+#include "usbd_init.h"
+
+LOG_MODULE_REGISTER(dfu_flash);
+
+/* How long the download path may wait for a free page buffer */
+#define PAGE_ALLOC_TIMEOUT_MS          100
+/* How long the end of a download may wait for queued jobs */
+#define FLUSH_TIMEOUT_MS               10000
+
+BUILD_ASSERT(CONFIG_USBD_DFU_TRANSFER_SIZE % W25Q16_PAGE_SIZE == 0,
+	     "DFU transfer size must be a multiple of the flash page size");
+
+/* Download in progress; only used from the DFU class context */
+static struct {
+	uint32_t erased_to;
+	uint32_t bytes;
+	int64_t started;
+	bool completed;
+} dl;
+
+static void dfu_switch_handler(struct k_work *work);
+
+static K_WORK_DEFINE(dfu_switch_work, dfu_switch_handler);
+static struct usbd_context *runtime_ctx;
+
+/**
+ * @brief Erase the flash up to @p end ahead of the data
+ *
+ * Whole 64KB blocks are erased where possible; sectors next to the index
+ * region are erased one by one.
+ */
+static int erase_ahead(uint32_t end)
+{
+	uint32_t size;
+	int err;
+
+	while (dl.erased_to < end) {
+		size = W25Q16_BLOCK_SIZE;
+		if (dl.erased_to % W25Q16_BLOCK_SIZE ||
+		    sector_index_reserved(dl.erased_to, W25Q16_BLOCK_SIZE)) {
+			size = W25Q16_SECTOR_SIZE;
+		}
+
+		err = flash_worker_queue_range(size == W25Q16_BLOCK_SIZE ?
+						       FLASH_JOB_ERASE_64K :
+						       FLASH_JOB_ERASE_4K,
+					       dl.erased_to, size,
+					       K_MSEC(PAGE_ALLOC_TIMEOUT_MS));
+		if (err) {
+			return err;
+		}
+
+		dl.erased_to += size;
+	}
+
+	return 0;
+}
+
+static int image_write(void *const priv, const uint32_t block,
+		       const uint16_t size,
+		       const uint8_t buf[static CONFIG_USBD_DFU_TRANSFER_SIZE])
+{
+	uint32_t addr = block * CONFIG_USBD_DFU_TRANSFER_SIZE;
+	struct flash_job *job;
+	int err;
+
+	ARG_UNUSED(priv);
+
+	if (size == 0) {
+		/* Zero-length download ends the transfer */
+		err = flash_worker_flush(K_MSEC(FLUSH_TIMEOUT_MS));
+		return err ? err : flash_worker_last_error();
+	}
+
+	if (addr + size > W25Q16_SIZE || sector_index_reserved(addr, size)) {
+		return -EACCES;
+	}
+
+	/* Fail the download as soon as a queued job failed */
+	err = flash_worker_last_error();
+	if (err) {
+		return err;
+	}
+
+	err = erase_ahead(addr + size);
+	if (err) {
+		return err;
+	}
+
+	for (uint32_t off = 0; off < size; off += W25Q16_PAGE_SIZE) {
+		job = page_pool_alloc(K_MSEC(PAGE_ALLOC_TIMEOUT_MS));
+		if (!job) {
+			LOG_ERR("No page buffer for 0x%06X", addr + off);
+			return -ENOMEM;
+		}
+
+		job->op = FLASH_JOB_PROGRAM;
+		job->flags = 0;
+		job->addr = addr + off;
+		job->len = MIN(size - off, W25Q16_PAGE_SIZE);
+		memcpy(job->data, &buf[off], job->len);
+		flash_worker_submit(job);
+	}
+
+	dl.bytes += size;
+	return 0;
+}
+
+static int image_read(void *const priv, const uint32_t block,
+		      const uint16_t size,
+		      uint8_t buf[static CONFIG_USBD_DFU_TRANSFER_SIZE])
+{
+	uint32_t addr = block * CONFIG_USBD_DFU_TRANSFER_SIZE;
+	uint16_t len;
+	int err;
+
+	ARG_UNUSED(priv);
+
+	if (addr >= W25Q16_SIZE) {
+		return 0;
+	}
+
+	len = MIN(size, W25Q16_SIZE - addr);
+	err = flash_worker_read(find_lsb_set(flash_worker_selected()) - 1,
+				addr, buf, len);
+
+	return err ? err : len;
+}
+
+static bool image_next(void *const priv, const enum usb_dfu_state state,
+		       const enum usb_dfu_state next)
+{
+	ARG_UNUSED(priv);
+
+	if (state == DFU_IDLE && next == DFU_DNLOAD_SYNC) {
+		flash_worker_clear_error();
+		dl.erased_to = 0;
+		dl.bytes = 0;
+		dl.started = k_uptime_get();
+		dl.completed = false;
+	}
+
+	return true;
+}
+
+USBD_DFU_DEFINE_IMG(ice40, "ice40", NULL, image_read, image_write,
+		    image_next);
+
+static void dfu_switch_handler(struct k_work *work)
+{
+	struct usbd_context *dfu_ctx;
+	int err;
+
+	ARG_UNUSED(work);
+
+	LOG_INF("Switching to DFU mode");
+
+	err = usbd_disable(runtime_ctx);
+	if (!err) {
+		err = usbd_shutdown(runtime_ctx);
+	}
+	if (err) {
+		LOG_ERR("Failed to detach runtime device: %d", err);
+		return;
+	}
+
+	dfu_ctx = flasher_usbd_init_dfu(dfu_flash_handle_msg);
+	if (!dfu_ctx) {
+		return;
+	}
+
+	err = usbd_enable(dfu_ctx);
+	if (err) {
+		LOG_ERR("Failed to enable DFU device: %d", err);
+	}
+}
+
+void dfu_flash_handle_msg(struct usbd_context *const ctx,
+			  const struct usbd_msg *const msg)
+{
+	uint32_t ms;
+
+	switch (msg->type) {
+	case USBD_MSG_DFU_APP_DETACH:
+		/* Re-enumerating from the USB stack thread would deadlock */
+		runtime_ctx = ctx;
+		k_work_submit(&dfu_switch_work);
+		break;
+	case USBD_MSG_DFU_DOWNLOAD_COMPLETED:
+		ms = (uint32_t)(k_uptime_get() - dl.started);
+		LOG_INF("DFU download of %u bytes in %u ms", dl.bytes, ms);
+		dl.completed = true;
+		break;
+	case USBD_MSG_RESET:
+		if (dl.completed) {
+			sys_reboot(SYS_REBOOT_COLD);
+		}
+		break;
+	default:
+		break;
+	}
+}
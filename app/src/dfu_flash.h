@@ -0,0 +1,36 @@
+/**
+ * @file dfu_flash.h
+ * @brief USB DFU download of FPGA images to the target flash
+ */
+
+#ifndef DFU_FLASH_H
+#define DFU_FLASH_H
+
+#include <zephyr/usb/usbd.h>
+
+#ifdef CONFIG_FLASHER_DFU
+
+/**
+ * @brief Follow USB device messages that concern DFU
+ *
+ * On a DFU detach request the runtime device is taken down and the DFU
+ * mode device, which only has the DFU interface, is enabled in its place.
+ * The bus reset that follows a completed download reboots the flasher,
+ * which brings it back in runtime mode and reloads the FPGAs.
+ *
+ * @param ctx Context the message was raised for
+ * @param msg USB device message
+ */
+void dfu_flash_handle_msg(struct usbd_context *const ctx,
+			  const struct usbd_msg *const msg);
+
+#else
+
+static inline void dfu_flash_handle_msg(struct usbd_context *const ctx,
+					const struct usbd_msg *const msg)
+{
+}
+
+#endif /* CONFIG_FLASHER_DFU */
+
+#endif /* DFU_FLASH_H */
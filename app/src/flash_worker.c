@@ -0,0 +1,691 @@
+/**
+ * @file flash_worker.c
+ * @brief Executes flash jobs off the USB thread
+ *
+ * Jobs are page-sized buffers taken from the page pool. The receive side
+ * fills them in place and queues them here; once programmed they go
+ * straight back to the pool.
+ *
+ * Each flash target has its own worker thread. In gang mode the same job
+ * is queued to every selected target and returns to the pool once the
+ * last of them is done with it, so one received image is programmed on
+ * all targets in parallel without being copied.
+ *
+ * Program jobs flagged for verification are read back as soon as the
+ * page program completes. The read overlaps with reception of the next
+ * page, so checking integrity adds almost no time to a write.
+ *
+ * Each worker brings its flash out of reset before taking jobs. Commands
+ * arriving earlier simply queue up, so the host can start as soon as
+ * the device enumerates.
+ *
+ * Once idle for CONFIG_FLASHER_SECTOR_INDEX_SYNC_DELAY_MS the worker
+ * rehashes the sectors programmed since the last sync, one sector at a
+ * time so a new job is never delayed by more than one sector read.
+ *
+ * Sectors modified by PATCH are written back from the sector cache once
+ * idle for CONFIG_FLASHER_SECTOR_CACHE_WRITEBACK_DELAY_MS, even if the
+ * flash is never powered down.
+ *
+ * When no job arrives for CONFIG_FLASHER_FLASH_IDLE_POWER_DOWN_MS the
+ * flash is put into deep power-down. The receive side wakes it as soon
+ * as a command arrives, so the release time overlaps with the rest of
+ * the USB transfer instead of delaying the first job.
+ */
+
+#include "flash_worker.h"
+
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/util.h>
+
+#include "boot_timeline.h"
+#include "page_pool.h"
+#include "sector_cache.h"
+#include "sector_index.h"
+
+LOG_MODULE_REGISTER(flash_worker);
+
+/* Mismatch address reported while no verify failure occurred */
+#define NO_MISMATCH                    UINT32_MAX
+
+/* Non-blank address reported while every checked byte was erased */
+#define ALL_BLANK                      UINT32_MAX
+
+BUILD_ASSERT(CONFIG_FLASHER_BLANK_CHECK_BURST % sizeof(uint32_t) == 0,
+	     "Blank check burst must be a multiple of 4");
+
+/**
+ * @brief Per-target worker state
+ */
+struct flash_worker {
+	struct k_msgq queue;
+	struct flash_job *queue_buf[CONFIG_FLASHER_PAGE_POOL_COUNT];
+	/* Serializes flash access between the worker and early wake-ups */
+	struct k_mutex lock;
+	struct k_thread thread;
+	/* Given once the flash was reset and identified */
+	struct k_sem ready;
+	struct flash_config *dev;
+	int target;
+	/* Idle long enough to work on the sector index */
+	bool syncing;
+	uint32_t digest;
+	uint8_t readback[W25Q16_PAGE_SIZE];
+	/* Word aligned so erased flash can be tested a word at a time */
+	uint32_t scan[CONFIG_FLASHER_BLANK_CHECK_BURST / sizeof(uint32_t)];
+};
+
+static K_THREAD_STACK_ARRAY_DEFINE(worker_stacks, FLASH_TARGET_COUNT,
+				   CONFIG_FLASHER_WORKER_STACK_SIZE);
+static struct flash_worker workers[FLASH_TARGET_COUNT];
+
+static atomic_t started;
+static atomic_t ready;
+static atomic_t selected = ATOMIC_INIT(BIT(0));
+static atomic_t pending;
+static atomic_t last_error;
+static atomic_t failed;
+static atomic_t mismatch = ATOMIC_INIT(NO_MISMATCH);
+static atomic_t nonblank = ATOMIC_INIT(ALL_BLANK);
+static atomic_t bytes_done;
+static K_SEM_DEFINE(idle_sem, 0, 1);
+
+int flash_worker_select(uint32_t mask)
+{
+	if (mask == 0 || (mask & ~atomic_get(&started))) {
+		return -EINVAL;
+	}
+
+	if (flash_worker_busy()) {
+		return -EBUSY;
+	}
+
+	atomic_set(&selected, mask);
+	return 0;
+}
+
+uint32_t flash_worker_selected(void)
+{
+	return (uint32_t)atomic_get(&selected);
+}
+
+void flash_worker_submit(struct flash_job *job)
+{
+	uint32_t mask = atomic_get(&selected);
+
+	atomic_set(&job->refs, POPCOUNT(mask));
+	atomic_clear(&job->failed);
+
+	for (int i = 0; i < FLASH_TARGET_COUNT; i++) {
+		if (mask & BIT(i)) {
+			atomic_inc(&pending);
+			/* Never blocks: there are no more jobs than pool entries */
+			(void)k_msgq_put(&workers[i].queue, &job, K_FOREVER);
+		}
+	}
+}
+
+int flash_worker_queue_range(enum flash_job_op op, uint32_t addr,
+			     uint32_t size, k_timeout_t timeout)
+{
+	struct flash_job *job;
+
+	job = page_pool_alloc(timeout);
+	if (!job) {
+		return -ENOMEM;
+	}
+
+	job->op = op;
+	job->flags = 0;
+	job->addr = addr;
+	job->len = 0;
+	job->size = size;
+	flash_worker_submit(job);
+	return 0;
+}
+
+int flash_worker_flush(k_timeout_t timeout)
+{
+	while (flash_worker_busy()) {
+		if (k_sem_take(&idle_sem, timeout)) {
+			return -EAGAIN;
+		}
+	}
+
+	/* Pass the wakeup on to anyone else waiting for idle */
+	k_sem_give(&idle_sem);
+
+	return 0;
+}
+
+bool flash_worker_busy(void)
+{
+	return atomic_get(&pending) != 0;
+}
+
+void flash_worker_wake(void)
+{
+	uint32_t mask = atomic_get(&selected) & atomic_get(&started);
+
+	for (int i = 0; i < FLASH_TARGET_COUNT; i++) {
+		struct flash_worker *w = &workers[i];
+
+		/* If the worker holds the lock it is either busy, and the
+		 * flash is awake, or powering down and will wake the flash
+		 * for the next job.
+		 */
+		if (!(mask & BIT(i)) || k_mutex_lock(&w->lock, K_NO_WAIT)) {
+			continue;
+		}
+
+		(void)flash_release_power_down(w->dev);
+		k_mutex_unlock(&w->lock);
+	}
+}
+
+int flash_worker_last_error(void)
+{
+	return (int)atomic_get(&last_error);
+}
+
+uint32_t flash_worker_failed(void)
+{
+	return (uint32_t)atomic_get(&failed);
+}
+
+uint32_t flash_worker_mismatch(void)
+{
+	return (uint32_t)atomic_get(&mismatch);
+}
+
+uint32_t flash_worker_nonblank(void)
+{
+	return (uint32_t)atomic_get(&nonblank);
+}
+
+void flash_worker_clear_error(void)
+{
+	atomic_set(&last_error, 0);
+	atomic_set(&failed, 0);
+	atomic_set(&mismatch, NO_MISMATCH);
+	atomic_set(&nonblank, ALL_BLANK);
+}
+
+uint32_t flash_worker_digest(int target)
+{
+	if (target < 0 || target >= FLASH_TARGET_COUNT) {
+		return 0;
+	}
+
+	return workers[target].digest;
+}
+
+uint32_t flash_worker_spi_frequency(int target)
+{
+	if (target < 0 || target >= FLASH_TARGET_COUNT ||
+	    !atomic_test_bit(&started, target)) {
+		return 0;
+	}
+
+	return workers[target].dev->dev.config.frequency;
+}
+
+uint32_t flash_worker_bytes_done(void)
+{
+	return (uint32_t)atomic_get(&bytes_done);
+}
+
+/**
+ * @brief Lower an address shared by all targets to @p addr if above it
+ */
+static void report_lowest(atomic_t *target, uint32_t addr)
+{
+	atomic_val_t old;
+
+	do {
+		old = atomic_get(target);
+		if ((uint32_t)old <= addr) {
+			return;
+		}
+	} while (!atomic_cas(target, old, addr));
+}
+
+/**
+ * @brief Record the lowest mismatching address seen on any target
+ */
+static void report_mismatch(uint32_t addr)
+{
+	report_lowest(&mismatch, addr);
+}
+
+/**
+ * @brief Compare flash contents against a job buffer
+ *
+ * @return 0 if equal, -EIO on mismatch, other negative errno on failure
+ */
+static int verify_job(struct flash_worker *w, struct flash_job *job)
+{
+	int err;
+
+	err = flash_read(w->dev, job->addr, w->readback, job->len);
+	if (err) {
+		return err;
+	}
+
+	for (uint16_t i = 0; i < job->len; i++) {
+		if (w->readback[i] != job->data[i]) {
+			report_mismatch(job->addr + i);
+			LOG_ERR("Verify mismatch at 0x%06X", job->addr + i);
+			return -EIO;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Erase the 64KB blocks covering a job's range
+ */
+static int erase_range(struct flash_worker *w, struct flash_job *job)
+{
+	int err;
+
+	for (uint32_t off = 0; off < job->size; off += W25Q16_BLOCK_SIZE) {
+		err = flash_block_erase_64k(w->dev, job->addr + off);
+		if (err) {
+			return err;
+		}
+
+		sector_index_erased(w->target, job->addr + off,
+				    W25Q16_BLOCK_SIZE);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Erase the 4KB sectors covering a job's range
+ */
+static int erase_sectors(struct flash_worker *w, struct flash_job *job)
+{
+	int err;
+
+	for (uint32_t off = 0; off < job->size; off += W25Q16_SECTOR_SIZE) {
+		err = flash_sector_erase(w->dev, job->addr + off);
+		if (err) {
+			return err;
+		}
+
+		sector_index_erased(w->target, job->addr + off,
+				    W25Q16_SECTOR_SIZE);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Bring the sector index fully up to date
+ */
+static int sync_index(struct flash_worker *w)
+{
+	int err;
+
+	do {
+		err = sector_index_sync_step(w->target, w->dev, w->readback);
+	} while (err > 0);
+
+	return err;
+}
+
+/**
+ * @brief Compute the CRC-32 of a job's range
+ */
+static int digest_range(struct flash_worker *w, struct flash_job *job)
+{
+	uint32_t crc = 0;
+	int err;
+
+	for (uint32_t off = 0; off < job->size; off += sizeof(w->readback)) {
+		size_t chunk = MIN(job->size - off, sizeof(w->readback));
+
+		err = flash_read(w->dev, job->addr + off, w->readback, chunk);
+		if (err) {
+			return err;
+		}
+
+		crc = crc32_ieee_update(crc, w->readback, chunk);
+	}
+
+	w->digest = crc;
+	return 0;
+}
+
+/**
+ * @brief Find the first byte of a job's range that is not erased
+ *
+ * Stops early once any target has found a non-blank byte below the part
+ * still to be scanned.
+ */
+static int blank_check(struct flash_worker *w, struct flash_job *job)
+{
+	const uint8_t *bytes = (const uint8_t *)w->scan;
+	uint32_t off = 0;
+	size_t chunk;
+	size_t i;
+	int err;
+
+	while (off < job->size &&
+	       flash_worker_nonblank() > job->addr + off) {
+		chunk = MIN(job->size - off, sizeof(w->scan));
+
+		err = flash_read(w->dev, job->addr + off, (uint8_t *)w->scan,
+				 chunk);
+		if (err) {
+			return err;
+		}
+
+		for (i = 0; i < chunk / sizeof(uint32_t); i++) {
+			if (w->scan[i] != UINT32_MAX) {
+				break;
+			}
+		}
+
+		for (i *= sizeof(uint32_t); i < chunk; i++) {
+			if (bytes[i] != 0xFF) {
+				report_lowest(&nonblank, job->addr + off + i);
+				return 0;
+			}
+		}
+
+		off += chunk;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Run a single job against the flash
+ *
+ * @param w Worker owning the target flash
+ * @param job Job to execute
+ * @return 0 on success, negative errno on failure
+ */
+static int run_job(struct flash_worker *w, struct flash_job *job)
+{
+	int err;
+
+	/* Other jobs must see, and must not be undone by, cached writes */
+	if (job->op != FLASH_JOB_PATCH) {
+		err = sector_cache_flush(w->target, w->dev);
+		if (err) {
+			return err;
+		}
+	}
+
+	switch (job->op) {
+	case FLASH_JOB_PROGRAM:
+		err = flash_page_program(w->dev, job->addr, job->data,
+					 job->len);
+		sector_index_programmed(w->target, job->addr, job->len);
+		if (err || !(job->flags & FLASH_JOB_FLAG_VERIFY)) {
+			return err;
+		}
+		return verify_job(w, job);
+	case FLASH_JOB_VERIFY:
+		return verify_job(w, job);
+	case FLASH_JOB_ERASE_64K:
+		return erase_range(w, job);
+	case FLASH_JOB_ERASE_4K:
+		return erase_sectors(w, job);
+	case FLASH_JOB_DIGEST:
+		return digest_range(w, job);
+	case FLASH_JOB_INDEX_SYNC:
+		return sync_index(w);
+	case FLASH_JOB_BLANK_CHECK:
+		return blank_check(w, job);
+	case FLASH_JOB_PATCH:
+		return sector_cache_write(w->target, w->dev, job->addr,
+					  job->data, job->len);
+	case FLASH_JOB_CACHE_FLUSH:
+		/* Written back above */
+		return 0;
+	case FLASH_JOB_ERASE_CHIP:
+		err = flash_chip_erase(w->dev);
+		break;
+	default:
+		return -ENOTSUP;
+	}
+
+	if (!err) {
+		sector_index_erased(w->target, 0, W25Q16_SIZE);
+	}
+
+	return err;
+}
+
+/**
+ * @brief Drop one target's reference to a finished job
+ */
+static void job_done(struct flash_job *job)
+{
+	if (atomic_dec(&job->refs) == 1) {
+		if (job->op == FLASH_JOB_PROGRAM && !atomic_get(&job->failed)) {
+			atomic_add(&bytes_done, job->len);
+		}
+		page_pool_free(job);
+	}
+
+	if (atomic_dec(&pending) == 1) {
+		k_sem_give(&idle_sem);
+	}
+}
+
+/**
+ * @brief How long to wait for a job before doing idle work
+ */
+static k_timeout_t idle_timeout(struct flash_worker *w)
+{
+	if (sector_cache_dirty(w->target)) {
+		return SECTOR_CACHE_WRITEBACK_DELAY;
+	}
+
+	if (sector_index_pending(w->target)) {
+		return w->syncing ? K_NO_WAIT : SECTOR_INDEX_SYNC_DELAY;
+	}
+
+	if (CONFIG_FLASHER_FLASH_IDLE_POWER_DOWN_MS == 0 ||
+	    w->dev->powered_down) {
+		return K_FOREVER;
+	}
+
+	return K_MSEC(CONFIG_FLASHER_FLASH_IDLE_POWER_DOWN_MS);
+}
+
+/**
+ * @brief Work done when no job arrived in time
+ */
+static void idle_work(struct flash_worker *w)
+{
+	int err;
+
+	k_mutex_lock(&w->lock, K_FOREVER);
+
+	if (sector_cache_dirty(w->target)) {
+		w->syncing = false;
+		err = flash_release_power_down(w->dev);
+		if (!err) {
+			err = sector_cache_flush(w->target, w->dev);
+		}
+		if (err) {
+			LOG_ERR("Target %d cache write-back failed: %d",
+				w->target, err);
+			atomic_set(&last_error, err);
+			atomic_or(&failed, BIT(w->target));
+		}
+	} else if (sector_index_pending(w->target)) {
+		w->syncing = true;
+		err = flash_release_power_down(w->dev);
+		if (!err) {
+			err = sector_index_sync_step(w->target, w->dev,
+						     w->readback);
+		}
+		if (err < 0) {
+			LOG_ERR("Target %d index sync failed: %d", w->target,
+				err);
+			/* Retry after the next idle delay, not right away */
+			w->syncing = false;
+		}
+	} else {
+		w->syncing = false;
+		(void)flash_power_down(w->dev);
+	}
+
+	k_mutex_unlock(&w->lock);
+}
+
+/**
+ * @brief Reset and identify the flash of a target
+ */
+static void bring_up(struct flash_worker *w, int target)
+{
+	int err;
+
+	k_mutex_lock(&w->lock, K_FOREVER);
+	err = flash_reset(w->dev);
+	if (!err) {
+		err = flash_read_id(w->dev);
+	}
+	if (!err) {
+		err = flash_quad_setup(w->dev);
+	}
+	if (!err) {
+		err = sector_index_load(target, w->dev, w->readback);
+	}
+	k_mutex_unlock(&w->lock);
+
+	if (err) {
+		LOG_ERR("Target %d flash bring-up failed: %d", target, err);
+	}
+
+	if ((atomic_or(&ready, BIT(target)) | BIT(target)) ==
+	    BIT_MASK(FLASH_TARGET_COUNT)) {
+		boot_timeline_mark(BOOT_STAGE_FLASH_READY);
+	}
+	k_sem_give(&w->ready);
+}
+
+static void worker_entry(void *p1, void *p2, void *p3)
+{
+	struct flash_worker *w = p1;
+	int target = (int)(uintptr_t)p2;
+
+	ARG_UNUSED(p3);
+
+	bring_up(w, target);
+
+	while (1) {
+		struct flash_job *job;
+		int err;
+
+		if (k_msgq_get(&w->queue, &job, idle_timeout(w))) {
+			idle_work(w);
+			continue;
+		}
+		w->syncing = false;
+
+		k_mutex_lock(&w->lock, K_FOREVER);
+		err = flash_release_power_down(w->dev);
+		if (!err) {
+			err = run_job(w, job);
+		}
+		k_mutex_unlock(&w->lock);
+
+		if (err) {
+			LOG_ERR("Target %d job %d at 0x%06X failed: %d", target,
+				job->op, job->addr, err);
+			atomic_set(&last_error, err);
+			atomic_or(&failed, BIT(target));
+			atomic_set(&job->failed, 1);
+		}
+
+		job_done(job);
+	}
+}
+
+int flash_worker_start(int target, struct flash_config *dev)
+{
+	struct flash_worker *w;
+	char name[sizeof("flash_worker") + 2];
+
+	if (target < 0 || target >= FLASH_TARGET_COUNT) {
+		return -EINVAL;
+	}
+
+	if (atomic_test_and_set_bit(&started, target)) {
+		return -EALREADY;
+	}
+
+	w = &workers[target];
+	w->dev = dev;
+	w->target = target;
+	dev->target = target;
+	k_msgq_init(&w->queue, (char *)w->queue_buf, sizeof(struct flash_job *),
+		    ARRAY_SIZE(w->queue_buf));
+	k_mutex_init(&w->lock);
+	k_sem_init(&w->ready, 0, 1);
+
+	k_thread_create(&w->thread, worker_stacks[target],
+			K_THREAD_STACK_SIZEOF(worker_stacks[target]),
+			worker_entry, w, (void *)(uintptr_t)target, NULL,
+			CONFIG_FLASHER_WORKER_PRIORITY, 0, K_NO_WAIT);
+	snprintk(name, sizeof(name), "flash_worker%d", target);
+	k_thread_name_set(&w->thread, name);
+
+	LOG_DBG("Flash worker %d started", target);
+	return 0;
+}
+
+int flash_worker_wait_ready(int target, k_timeout_t timeout)
+{
+	struct flash_worker *w;
+
+	if (target < 0 || target >= FLASH_TARGET_COUNT ||
+	    !atomic_test_bit(&started, target)) {
+		return -EINVAL;
+	}
+
+	w = &workers[target];
+	if (k_sem_take(&w->ready, timeout)) {
+		return -EAGAIN;
+	}
+
+	/* Leave the flag set for later callers */
+	k_sem_give(&w->ready);
+	return 0;
+}
+
+int flash_worker_read(int target, uint32_t addr, uint8_t *buf, size_t len)
+{
+	struct flash_worker *w;
+	int err;
+
+	if (target < 0 || target >= FLASH_TARGET_COUNT ||
+	    !atomic_test_bit(&started, target)) {
+		return -EINVAL;
+	}
+
+	w = &workers[target];
+	k_mutex_lock(&w->lock, K_FOREVER);
+	err = flash_release_power_down(w->dev);
+	if (!err) {
+		err = sector_cache_flush(target, w->dev);
+	}
+	if (!err) {
+		err = flash_read(w->dev, addr, buf, len);
+	}
+	k_mutex_unlock(&w->lock);
+
+	return err;
+}
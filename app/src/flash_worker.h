@@ -0,0 +1,227 @@
+/**
+ * @file flash_worker.h
+ * @brief Flash worker thread and its page buffer jobs
+ */
+
+#ifndef FLASH_WORKER_H
+#define FLASH_WORKER_H
+
+#include <stdint.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/atomic.h>
+
+#include "w25q16_hal.h"
+
+/** Number of flash targets wired to this board */
+#if DT_NODE_HAS_STATUS(DT_NODELABEL(w25q16_b), okay)
+#define FLASH_TARGET_COUNT 2
+#else
+#define FLASH_TARGET_COUNT 1
+#endif
+
+/**
+ * @brief Operations executed by the flash worker
+ */
+enum flash_job_op {
+	FLASH_JOB_PROGRAM,
+	FLASH_JOB_VERIFY,
+	FLASH_JOB_ERASE_64K,
+	FLASH_JOB_ERASE_4K,
+	FLASH_JOB_ERASE_CHIP,
+	FLASH_JOB_DIGEST,
+	FLASH_JOB_INDEX_SYNC,
+	FLASH_JOB_BLANK_CHECK,
+	FLASH_JOB_PATCH,
+	FLASH_JOB_CACHE_FLUSH,
+};
+
+/** Read back and compare a page right after programming it */
+#define FLASH_JOB_FLAG_VERIFY BIT(0)
+
+/**
+ * @brief Unit of work for the flash worker
+ *
+ * For program and verify jobs the receive side fills @p data in place
+ * and the buffer is handed to the SPI driver without further copies.
+ * Patch jobs carry data for any address and go through the sector cache,
+ * which is written back by a cache flush job, before any other job and
+ * before the flash is powered down.
+ * Range jobs (erase, digest, blank check) cover @p size bytes and leave
+ * @p data unused.
+ * Index sync jobs bring the sector index up to date and carry no range.
+ */
+struct flash_job {
+	/** Targets that still have to process the job */
+	atomic_t refs;
+	/** Set by any target that failed to process the job */
+	atomic_t failed;
+	enum flash_job_op op;
+	uint8_t flags;
+	uint32_t addr;
+	uint16_t len;
+	uint32_t size;
+	uint8_t data[W25Q16_PAGE_SIZE];
+};
+
+/**
+ * @brief Choose the targets that subsequent jobs are queued to
+ *
+ * Selecting more than one target enables gang mode: every job is
+ * executed on each selected target in parallel.
+ *
+ * @param mask Bit mask of started targets
+ * @return 0 on success, -EINVAL for unknown targets, -EBUSY while jobs
+ *         are outstanding
+ */
+int flash_worker_select(uint32_t mask);
+
+/**
+ * @brief Get the mask of currently selected targets
+ *
+ * @return Bit mask of targets
+ */
+uint32_t flash_worker_selected(void);
+
+/**
+ * @brief Queue a job for execution on all selected targets
+ *
+ * Ownership passes to the workers; the last one to finish frees the job.
+ *
+ * @param job Job obtained from page_pool_alloc()
+ */
+void flash_worker_submit(struct flash_job *job);
+
+/**
+ * @brief Queue a job that does not carry data
+ *
+ * @param op Range operation (erase, digest or blank check)
+ * @param addr Flash address of the range
+ * @param size Size of the range in bytes
+ * @param timeout How long to wait for a free job
+ * @return 0 on success, -ENOMEM if no job became available
+ */
+int flash_worker_queue_range(enum flash_job_op op, uint32_t addr,
+			     uint32_t size, k_timeout_t timeout);
+
+/**
+ * @brief Wait until all queued jobs have been executed
+ *
+ * Any number of threads may wait at the same time.
+ *
+ * @param timeout How long to wait
+ * @return 0 once idle, -EAGAIN on timeout
+ */
+int flash_worker_flush(k_timeout_t timeout);
+
+/**
+ * @brief Check whether jobs are queued or executing
+ *
+ * @return true if the worker has outstanding work
+ */
+bool flash_worker_busy(void);
+
+/**
+ * @brief Bring the flash out of power-down ahead of upcoming jobs
+ *
+ * Safe to call from the USB stack context; returns immediately if the
+ * worker currently owns the flash.
+ */
+void flash_worker_wake(void);
+
+/**
+ * @brief Get the result of the most recent failed job
+ *
+ * @return 0 if no job failed, negative errno otherwise
+ */
+int flash_worker_last_error(void);
+
+/**
+ * @brief Get the targets on which a job failed
+ *
+ * @return Bit mask of targets
+ */
+uint32_t flash_worker_failed(void);
+
+/**
+ * @brief Get the lowest address at which verification failed
+ *
+ * @return Flash address, or UINT32_MAX if no mismatch was found
+ */
+uint32_t flash_worker_mismatch(void);
+
+/**
+ * @brief Get the lowest address found non-blank by blank check jobs
+ *
+ * @return Flash address, or UINT32_MAX if every checked byte was 0xFF
+ */
+uint32_t flash_worker_nonblank(void);
+
+/**
+ * @brief Forget errors, mismatches and blank check results recorded by
+ *        previous jobs
+ */
+void flash_worker_clear_error(void);
+
+/**
+ * @brief Get the result of the last digest job on a target
+ *
+ * @param target Target index
+ * @return CRC-32 (IEEE) of the digested range
+ */
+uint32_t flash_worker_digest(int target);
+
+/**
+ * @brief Get the SPI clock a target's flash is driven with
+ *
+ * @param target Target index
+ * @return Frequency in Hz, or 0 if the worker was not started
+ */
+uint32_t flash_worker_spi_frequency(int target);
+
+/**
+ * @brief Get the number of bytes programmed since boot
+ *
+ * In gang mode a page counts once all selected targets processed it.
+ * Pages that failed on any target are not counted.
+ *
+ * @return Byte count
+ */
+uint32_t flash_worker_bytes_done(void);
+
+/**
+ * @brief Start the worker thread of a flash target
+ *
+ * The worker first resets and identifies the flash, then executes jobs.
+ * Jobs may be queued right away; they run once the flash is ready.
+ *
+ * @param target Target index, below FLASH_TARGET_COUNT
+ * @param dev Flash device the worker operates on
+ * @return 0 on success, negative errno on failure
+ */
+int flash_worker_start(int target, struct flash_config *dev);
+
+/**
+ * @brief Wait until a target's flash has been brought up
+ *
+ * @param target Target index
+ * @param timeout How long to wait
+ * @return 0 once ready, -EAGAIN on timeout, -EINVAL if not started
+ */
+int flash_worker_wait_ready(int target, k_timeout_t timeout);
+
+/**
+ * @brief Read a target's flash outside of the job queue
+ *
+ * Waits for the job in progress, if any, and writes back the sector cache.
+ * Meant for host reads while the queue is idle.
+ *
+ * @param target Target index
+ * @param addr Flash address
+ * @param buf Destination buffer
+ * @param len Number of bytes to read
+ * @return 0 on success, negative errno on failure
+ */
+int flash_worker_read(int target, uint32_t addr, uint8_t *buf, size_t len);
+
+#endif /* FLASH_WORKER_H */
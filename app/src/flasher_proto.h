@@ -0,0 +1,227 @@
+/**
+ * @file flasher_proto.h
+ * @brief Wire format of the reports exchanged over the HID interface
+ *
+ * Every OUT report starts with a command byte followed by little-endian
+ * arguments. WRITE and VERIFY commands are followed by raw data reports
+ * carrying exactly the announced number of bytes (the last report may be
+ * padded). Status is polled with a GET_REPORT request.
+ *
+ * If a stream fails (flash error, no page buffer, bad bitstream), the
+ * device keeps the STREAMING state and discards the rest of the announced
+ * data, so none of it is mistaken for commands. The first failure of a
+ * rejected command or stream is latched into the status error field: it
+ * is shown until the host reads an IDLE status, and every report is
+ * refused until then. Hosts check the status after each command before
+ * sending its data.
+ *
+ * Commands are accepted as soon as the device is configured, even while
+ * the flash is still being brought up; they run once it is ready. The
+ * status report carries the boot timeline (0 = stage still pending).
+ *
+ * With FLASHER_WRITE_IMAGE the device parses the data as an iCE40
+ * bitstream. On WRITE it holds the data back until the header, up to
+ * the first configuration data, has been parsed, so a malformed header
+ * aborts the stream before anything is erased; the header must fit in
+ * FLASHER_CAPS_WINDOW - 1 pages. The device then erases each 4KB sector
+ * just before first programming it; the address must be sector aligned.
+ * Bytes after the wakeup command are padding: they are accepted but
+ * neither programmed nor verified. A warm boot applet ends with the last
+ * image it boots within the written range instead, so the images of a
+ * multi-image file are stored with it. The status reports the image
+ * length once parsed.
+ *
+ * The INDEX reply holds one little-endian CRC-32 (IEEE) per 4KB sector,
+ * starting at the requested sector, for the lowest selected target.
+ * Sectors of the region reserved for the index itself read as 0 and
+ * cannot be written or erased by the host; ERASE_CHIP is refused while
+ * the region exists.
+ *
+ * READ returns the flash of the lowest selected target. With
+ * FLASHER_READ_RLE each reply report is run-length encoded on its own
+ * (see readback.h); the offset still counts flash bytes.
+ *
+ * BLANK_CHECK scans a range on all selected targets. Once the device is
+ * idle the status reports the lowest address holding anything but 0xFF,
+ * or UINT32_MAX if the whole range is erased.
+ *
+ * PATCH is followed by data like WRITE, but the range may start and end
+ * anywhere and the flash need not be erased: the device merges the bytes
+ * into a RAM copy of each sector. Modified sectors are written back on
+ * FLUSH, before any other command touches the flash, when the cache runs
+ * out of lines, and when the flash goes idle.
+ *
+ * TRACE returns the SPI transactions recorded by the flash HAL, oldest
+ * first, as FLASHER_TRACE_RECORD_SIZE records; the offset counts record
+ * bytes. With FLASHER_TRACE_CLEAR it discards them instead.
+ *
+ * A feature GET_REPORT returns the capability report instead of the
+ * status: what this firmware and board support, so the host can pick the
+ * fastest path per device. Hosts treat a stalled request as version 0
+ * firmware with 64-byte reports over SET_REPORT and no codecs.
+ *
+ * A SCRIPT command uploads a batch of FLASHER_OP_* steps the same way and
+ * runs it on the device. When a step needs data the device shows the
+ * STREAMING state and the host sends exactly that step's bytes.
+ */
+
+#ifndef FLASHER_PROTO_H
+#define FLASHER_PROTO_H
+
+/*
+ * Report sizes come from the devicetree (in-report-size, out-report-size)
+ * and are 64 bytes on full-speed boards; high-speed boards may use up to
+ * 1024. Commands never need more than the minimum.
+ */
+#define FLASHER_REPORT_SIZE_MIN         64
+
+/*
+ * Bumped whenever commands, report layouts or their meaning change.
+ * 0: no capability report (a stalled feature GET_REPORT).
+ * 1: capability report, commands up to FLUSH; the next command clears
+ *    the status error.
+ * 2: TRACE, status error latched until read while idle.
+ */
+#define FLASHER_PROTOCOL_VERSION        2
+
+/* Commands (OUT report byte 0) */
+#define FLASHER_CMD_ERASE_CHIP          0x01
+#define FLASHER_CMD_ERASE_64K           0x02
+#define FLASHER_CMD_WRITE               0x03
+#define FLASHER_CMD_VERIFY              0x04
+#define FLASHER_CMD_SELECT              0x05
+#define FLASHER_CMD_SCRIPT              0x06
+#define FLASHER_CMD_BOOT                0x07 /* Reload the selected FPGAs */
+#define FLASHER_CMD_INDEX               0x08 /* Read the sector hash index */
+#define FLASHER_CMD_READ                0x09 /* Read flash contents */
+#define FLASHER_CMD_BLANK_CHECK         0x0A /* Find the first non-erased byte */
+#define FLASHER_CMD_PATCH               0x0B /* Write bytes at any address */
+#define FLASHER_CMD_FLUSH               0x0C /* Write back patched sectors */
+#define FLASHER_CMD_TRACE               0x0D /* Download the SPI trace */
+
+/* Command argument offsets */
+#define FLASHER_ARG_ADDR                1 /* uint32, flash address */
+#define FLASHER_ARG_LEN                 5 /* uint32, byte or block count */
+#define FLASHER_ARG_MASK                1 /* uint32, SELECT target mask */
+#define FLASHER_ARG_FLAGS               9 /* uint8, WRITE flags (optional) */
+#define FLASHER_ARG_SECTOR              1 /* uint32, INDEX first sector */
+#define FLASHER_ARG_SECTORS             5 /* uint32, INDEX count, 0 = all */
+
+/* WRITE flags */
+#define FLASHER_WRITE_VERIFY            0x01 /* Read back each page */
+#define FLASHER_WRITE_IMAGE             0x02 /* Data is an iCE40 bitstream */
+
+/* READ flags */
+#define FLASHER_READ_RLE                0x01 /* Run-length encode the data */
+
+/* TRACE flags */
+#define FLASHER_TRACE_CLEAR             0x01 /* Discard instead of returning */
+
+/* SPI trace record layout */
+#define FLASHER_TRACE_START             0 /* uint32, us since boot */
+#define FLASHER_TRACE_END               4 /* uint32, us at completion */
+#define FLASHER_TRACE_ADDR              8 /* uint32, UINT32_MAX if none */
+#define FLASHER_TRACE_LEN               12 /* uint16, bytes clocked */
+#define FLASHER_TRACE_OPCODE            14 /* uint8, first byte sent */
+#define FLASHER_TRACE_FLAGS             15 /* uint8, target | FAILED */
+#define FLASHER_TRACE_RECORD_SIZE       16
+
+#define FLASHER_TRACE_TARGET_MASK       0x0F
+#define FLASHER_TRACE_FAILED            0x80 /* SPI driver error */
+
+/* Status report layout */
+#define FLASHER_STATUS_STATE            0 /* uint8, FLASHER_STATE_* */
+#define FLASHER_STATUS_ERROR            1 /* int32, last errno (0 = ok) */
+#define FLASHER_STATUS_DONE             5 /* uint32, bytes programmed */
+#define FLASHER_STATUS_POOL_TOTAL       9 /* uint8, page buffers in pool */
+#define FLASHER_STATUS_POOL_PEAK        10 /* uint8, page buffers high-water */
+#define FLASHER_STATUS_POOL_WAITS       11 /* uint16, allocations that waited */
+#define FLASHER_STATUS_SELECTED         13 /* uint8, selected target mask */
+#define FLASHER_STATUS_FAILED           14 /* uint8, failed target mask */
+#define FLASHER_STATUS_MISMATCH         15 /* uint32, first verify mismatch */
+#define FLASHER_STATUS_SCRIPT_STATE     19 /* uint8, FLASHER_SCRIPT_* */
+#define FLASHER_STATUS_SCRIPT_PC        20 /* uint16, offset of current step */
+#define FLASHER_STATUS_SCRIPT_ERROR     22 /* int32, script result */
+#define FLASHER_STATUS_DIGEST           26 /* uint32 per target, CRC-32 */
+#define FLASHER_STATUS_BOOT_USB         34 /* uint32, us until USB enabled */
+#define FLASHER_STATUS_BOOT_CONFIGURED  38 /* uint32, us until configured */
+#define FLASHER_STATUS_BOOT_FLASH       42 /* uint32, us until flash ready */
+#define FLASHER_STATUS_FPGA_STATE       46 /* uint8 per target, FLASHER_FPGA_* */
+#define FLASHER_STATUS_FPGA_TIME        48 /* uint32 per target, us to CDONE */
+#define FLASHER_STATUS_IMAGE_LEN        56 /* uint32, last parsed image */
+#define FLASHER_STATUS_NONBLANK         60 /* uint32, first non-blank addr */
+#define FLASHER_STATUS_SIZE             64
+
+/* Capability report layout (feature report) */
+#define FLASHER_CAPS_VERSION            0 /* uint16, FLASHER_PROTOCOL_VERSION */
+#define FLASHER_CAPS_IN_SIZE            2 /* uint16, IN report bytes */
+#define FLASHER_CAPS_OUT_SIZE           4 /* uint16, OUT report bytes */
+#define FLASHER_CAPS_TRANSPORTS         6 /* uint8, FLASHER_TRANSPORT_* */
+#define FLASHER_CAPS_CODECS             7 /* uint8, FLASHER_CODEC_* */
+#define FLASHER_CAPS_WINDOW             8 /* uint8, page buffers in pool */
+#define FLASHER_CAPS_TARGETS            9 /* uint8, flash targets */
+#define FLASHER_CAPS_FEATURES           10 /* uint16, FLASHER_FEATURE_* */
+#define FLASHER_CAPS_FLASH_SIZE         12 /* uint32, bytes */
+#define FLASHER_CAPS_PAGE_SIZE          16 /* uint16, bytes */
+#define FLASHER_CAPS_SECTOR_SIZE        18 /* uint32, bytes */
+#define FLASHER_CAPS_BLOCK_SIZE         22 /* uint32, bytes */
+#define FLASHER_CAPS_SPI_FREQ           26 /* uint32 per target, Hz */
+#define FLASHER_CAPS_SIZE               64
+
+/* Transports, besides HID commands which are always available */
+#define FLASHER_TRANSPORT_HID_INT_OUT   0x01 /* OUT reports on interrupt pipe */
+#define FLASHER_TRANSPORT_MSC           0x02 /* Drag-and-drop mass storage */
+#define FLASHER_TRANSPORT_DFU           0x04 /* USB DFU image "ice40" */
+
+/* Codecs */
+#define FLASHER_CODEC_READ_RLE          0x01 /* FLASHER_READ_RLE */
+
+/* Optional features */
+#define FLASHER_FEATURE_INDEX           0x0001 /* INDEX has real hashes */
+#define FLASHER_FEATURE_PATCH           0x0002 /* PATCH and FLUSH */
+#define FLASHER_FEATURE_TRACE           0x0004 /* TRACE */
+
+/* Device states */
+#define FLASHER_STATE_IDLE              0x00
+#define FLASHER_STATE_BUSY              0x01
+#define FLASHER_STATE_STREAMING         0x02
+#define FLASHER_STATE_REPLY             0x03
+
+/*
+ * Reply report layout. Commands that return data (INDEX, READ) queue a
+ * reply; once the device is idle, each GET_REPORT returns the next part
+ * of it instead of the status until the reply is complete.
+ */
+#define FLASHER_REPLY_STATE             0 /* uint8, FLASHER_STATE_REPLY */
+#define FLASHER_REPLY_CMD               1 /* uint8, command that asked */
+#define FLASHER_REPLY_OFFSET            2 /* uint32, source offset of part */
+#define FLASHER_REPLY_LEN               6 /* uint16, data bytes in report */
+#define FLASHER_REPLY_DATA              8
+
+/* FPGA configuration states */
+#define FLASHER_FPGA_UNKNOWN            0x00
+#define FLASHER_FPGA_IN_RESET           0x01
+#define FLASHER_FPGA_CONFIGURING        0x02
+#define FLASHER_FPGA_DONE               0x03
+#define FLASHER_FPGA_TIMEOUT            0x04
+#define FLASHER_FPGA_NO_CDONE           0x05
+
+/* Script states */
+#define FLASHER_SCRIPT_IDLE             0x00
+#define FLASHER_SCRIPT_RUNNING          0x01
+#define FLASHER_SCRIPT_DONE             0x02
+#define FLASHER_SCRIPT_FAILED           0x03
+
+/*
+ * Script steps. Each is an opcode byte followed by little-endian
+ * arguments; steps run in order on the selected targets.
+ */
+#define FLASHER_OP_END                  0x00 /* - */
+#define FLASHER_OP_ERASE                0x01 /* addr32 len32 (64KB aligned) */
+#define FLASHER_OP_WRITE                0x02 /* addr32 len32 flags8 */
+#define FLASHER_OP_DIGEST               0x03 /* addr32 len32 */
+#define FLASHER_OP_RESET                0x04 /* ms16, 0 = hold in reset */
+#define FLASHER_OP_WAIT_CDONE           0x05 /* timeout_ms16 */
+#define FLASHER_OP_SELECT               0x06 /* mask8 */
+
+#endif /* FLASHER_PROTO_H */
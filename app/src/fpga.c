@@ -0,0 +1,248 @@
+/**
+ * @file fpga.c
+ * @brief Control of the iCE40 targets attached to the configuration flashes
+ *
+ * Every release of CRESET_B starts a configuration measurement. Where the
+ * board routes CDONE back, its rising edge is timestamped in the GPIO
+ * interrupt, and a timer marks the timeout, so neither depends on how
+ * often the host or a script polls for it.
+ */
+
+#include "fpga.h"
+
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+
+#include "flash_worker.h"
+
+LOG_MODULE_REGISTER(fpga);
+
+/* Device tree node labels */
+#define RESET_PIN_NODE DT_NODELABEL(crst)
+#define RESET_PIN_B_NODE DT_NODELABEL(crst_b)
+#define CDONE_PIN_NODE DT_NODELABEL(cdone)
+#define CDONE_PIN_B_NODE DT_NODELABEL(cdone_b)
+
+static const struct gpio_dt_spec reset_pins[FLASH_TARGET_COUNT] = {
+	GPIO_DT_SPEC_GET(RESET_PIN_NODE, gpios),
+#if FLASH_TARGET_COUNT > 1
+	GPIO_DT_SPEC_GET(RESET_PIN_B_NODE, gpios),
+#endif
+};
+
+/* Boards without CDONE leave the port NULL */
+static const struct gpio_dt_spec cdone_pins[FLASH_TARGET_COUNT] = {
+	GPIO_DT_SPEC_GET_OR(CDONE_PIN_NODE, gpios, {0}),
+#if FLASH_TARGET_COUNT > 1
+	GPIO_DT_SPEC_GET_OR(CDONE_PIN_B_NODE, gpios, {0}),
+#endif
+};
+
+/**
+ * @brief Configuration measurement of one target
+ */
+struct fpga_target {
+	struct gpio_callback cdone_cb;
+	struct k_sem cdone_sem;
+	struct k_timer timeout_timer;
+	/* FPGA_BOOT_* */
+	atomic_t state;
+	/* Uptime in ticks when reset was released, never wraps */
+	int64_t released_at;
+	uint32_t elapsed_us;
+};
+
+static struct fpga_target targets[FLASH_TARGET_COUNT];
+
+/**
+ * @brief Time since reset was released, in us
+ */
+static uint32_t since_release(const struct fpga_target *t, int64_t now)
+{
+	return (uint32_t)MIN(k_ticks_to_us_floor64(now - t->released_at),
+			     UINT32_MAX);
+}
+
+static void cdone_handler(const struct device *port, struct gpio_callback *cb,
+			  uint32_t pins)
+{
+	struct fpga_target *t = CONTAINER_OF(cb, struct fpga_target, cdone_cb);
+	int64_t now = k_uptime_ticks();
+
+	ARG_UNUSED(port);
+	ARG_UNUSED(pins);
+
+	if (atomic_cas(&t->state, FPGA_BOOT_CONFIGURING, FPGA_BOOT_DONE)) {
+		k_timer_stop(&t->timeout_timer);
+		t->elapsed_us = since_release(t, now);
+		k_sem_give(&t->cdone_sem);
+	}
+}
+
+static void timeout_handler(struct k_timer *timer)
+{
+	struct fpga_target *t = CONTAINER_OF(timer, struct fpga_target,
+					     timeout_timer);
+	int64_t now = k_uptime_ticks();
+
+	/* The CDONE interrupt may have won the race */
+	if (atomic_cas(&t->state, FPGA_BOOT_CONFIGURING, FPGA_BOOT_TIMEOUT)) {
+		t->elapsed_us = since_release(t, now);
+		LOG_WRN("Target %d: no CDONE after %u us",
+			(int)(t - targets), t->elapsed_us);
+	}
+}
+
+/**
+ * @brief Set up the CDONE input and its interrupt
+ */
+static int init_cdone(int target)
+{
+	const struct gpio_dt_spec *pin = &cdone_pins[target];
+	struct fpga_target *t = &targets[target];
+	int err;
+
+	k_sem_init(&t->cdone_sem, 0, 1);
+	k_timer_init(&t->timeout_timer, timeout_handler, NULL);
+
+	if (!pin->port) {
+		atomic_set(&t->state, FPGA_BOOT_UNSUPPORTED);
+		return 0;
+	}
+
+	/* fpga_init() leaves the target in reset */
+	atomic_set(&t->state, FPGA_BOOT_IN_RESET);
+
+	err = gpio_pin_configure_dt(pin, GPIO_INPUT);
+	if (err) {
+		LOG_ERR("Failed to configure CDONE pin %d: %d", target, err);
+		return err;
+	}
+
+	gpio_init_callback(&t->cdone_cb, cdone_handler, BIT(pin->pin));
+	err = gpio_add_callback_dt(pin, &t->cdone_cb);
+	if (err) {
+		return err;
+	}
+
+	return gpio_pin_interrupt_configure_dt(pin, GPIO_INT_EDGE_TO_ACTIVE);
+}
+
+int fpga_init(int target)
+{
+	int err;
+
+	if (target < 0 || target >= FLASH_TARGET_COUNT) {
+		return -EINVAL;
+	}
+
+	err = gpio_pin_configure_dt(&reset_pins[target], GPIO_OUTPUT_ACTIVE);
+	if (err) {
+		LOG_ERR("Failed to configure reset pin %d: %d", target, err);
+		return err;
+	}
+
+	err = init_cdone(target);
+	if (err) {
+		return err;
+	}
+
+	LOG_DBG("Reset pin %d configured successfully", target);
+	return 0;
+}
+
+int fpga_set_reset(int target, bool asserted)
+{
+	struct fpga_target *t;
+
+	if (target < 0 || target >= FLASH_TARGET_COUNT) {
+		return -EINVAL;
+	}
+
+	t = &targets[target];
+	if (!cdone_pins[target].port) {
+		return gpio_pin_set_dt(&reset_pins[target], asserted ? 1 : 0);
+	}
+
+	if (asserted) {
+		k_timer_stop(&t->timeout_timer);
+		atomic_set(&t->state, FPGA_BOOT_IN_RESET);
+		return gpio_pin_set_dt(&reset_pins[target], 1);
+	}
+
+	if (atomic_get(&t->state) != FPGA_BOOT_IN_RESET) {
+		/* Not held in reset, so this release starts nothing */
+		return gpio_pin_set_dt(&reset_pins[target], 0);
+	}
+
+	/* Arm the measurement before CDONE can possibly rise */
+	k_sem_reset(&t->cdone_sem);
+	t->released_at = k_uptime_ticks();
+	atomic_set(&t->state, FPGA_BOOT_CONFIGURING);
+	k_timer_start(&t->timeout_timer, K_MSEC(CONFIG_FLASHER_CDONE_TIMEOUT_MS),
+		      K_NO_WAIT);
+
+	return gpio_pin_set_dt(&reset_pins[target], 0);
+}
+
+int fpga_wait_cdone(int target, k_timeout_t timeout)
+{
+	struct fpga_target *t;
+
+	if (target < 0 || target >= FLASH_TARGET_COUNT) {
+		return -EINVAL;
+	}
+
+	if (!cdone_pins[target].port) {
+		return -ENOTSUP;
+	}
+
+	t = &targets[target];
+	if (gpio_pin_get_dt(&cdone_pins[target]) > 0) {
+		return 0;
+	}
+
+	if (k_sem_take(&t->cdone_sem, timeout)) {
+		return -EAGAIN;
+	}
+
+	/* Leave the event for other waiters */
+	k_sem_give(&t->cdone_sem);
+	return 0;
+}
+
+int fpga_get_boot(int target, uint32_t *elapsed_us)
+{
+	struct fpga_target *t;
+	int state;
+
+	if (target < 0 || target >= FLASH_TARGET_COUNT) {
+		return -EINVAL;
+	}
+
+	t = &targets[target];
+	state = (int)atomic_get(&t->state);
+	if (state == FPGA_BOOT_CONFIGURING) {
+		*elapsed_us = since_release(t, k_uptime_ticks());
+	} else {
+		*elapsed_us = t->elapsed_us;
+	}
+
+	return state;
+}
+
+int fpga_boot(int target)
+{
+	int err;
+
+	err = fpga_set_reset(target, true);
+	if (err) {
+		return err;
+	}
+
+	/* CRESET_B needs a 200 ns low pulse */
+	k_busy_wait(1);
+
+	return fpga_set_reset(target, false);
+}
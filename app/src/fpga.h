@@ -0,0 +1,85 @@
+/**
+ * @file fpga.h
+ * @brief Control of the iCE40 targets attached to the configuration flashes
+ */
+
+#ifndef FPGA_H
+#define FPGA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <zephyr/kernel.h>
+
+/**
+ * @brief Configuration progress of a target
+ */
+enum fpga_boot_state {
+	/** Not reset since boot, nothing measured */
+	FPGA_BOOT_UNKNOWN,
+	/** Held in reset */
+	FPGA_BOOT_IN_RESET,
+	/** Released from reset, waiting for CDONE */
+	FPGA_BOOT_CONFIGURING,
+	/** CDONE rose after release */
+	FPGA_BOOT_DONE,
+	/** CDONE did not rise within CONFIG_FLASHER_CDONE_TIMEOUT_MS */
+	FPGA_BOOT_TIMEOUT,
+	/** The board does not route CDONE */
+	FPGA_BOOT_UNSUPPORTED,
+};
+
+/**
+ * @brief Configure the reset and CDONE pins of a target
+ *
+ * The target is held in reset.
+ *
+ * @param target Target index, below FLASH_TARGET_COUNT
+ * @return 0 on success, negative errno on failure
+ */
+int fpga_init(int target);
+
+/**
+ * @brief Assert or release CRESET_B of a target
+ *
+ * While held in reset the FPGA leaves the configuration flash alone.
+ * Releasing a target that was held in reset starts measuring the time
+ * until CDONE rises.
+ *
+ * @param target Target index
+ * @param asserted true to hold the FPGA in reset
+ * @return 0 on success, negative errno on failure
+ */
+int fpga_set_reset(int target, bool asserted);
+
+/**
+ * @brief Wait for a target to finish loading its configuration
+ *
+ * @param target Target index
+ * @param timeout How long to wait for CDONE
+ * @return 0 once configured, -EAGAIN on timeout, -ENOTSUP if the board
+ *         does not route CDONE
+ */
+int fpga_wait_cdone(int target, k_timeout_t timeout);
+
+/**
+ * @brief Pulse CRESET_B to make a target reload its configuration
+ *
+ * Returns right after releasing reset; use fpga_get_boot() or
+ * fpga_wait_cdone() for the outcome.
+ *
+ * @param target Target index
+ * @return 0 on success, negative errno on failure
+ */
+int fpga_boot(int target);
+
+/**
+ * @brief Get the outcome of the last configuration of a target
+ *
+ * @param target Target index
+ * @param elapsed_us Time from reset release until CDONE, the timeout, or
+ *        now while still configuring; 0 if nothing was measured
+ * @return FPGA_BOOT_* state, or -EINVAL for an unknown target
+ */
+int fpga_get_boot(int target, uint32_t *elapsed_us);
+
+#endif /* FPGA_H */
@@ -4,9 +4,21 @@
 #include <zephyr/logging/log.h>
 #include <zephyr/usb/class/usbd_hid.h>
 
+#include "flasher_proto.h"
+#include "log_limit.h"
+#include "protocol.h"
+
 LOG_MODULE_REGISTER(hid_device);
 
-#define REPORT_SIZE_BYTES 64
+/* Two-byte little-endian item data */
+#define U16_LE(x) (uint8_t)((x) & 0xFF), (uint8_t)((x) >> 8)
+
+BUILD_ASSERT(HID_IN_REPORT_SIZE >= FLASHER_STATUS_SIZE,
+             "in-report-size too small for the status report");
+BUILD_ASSERT(HID_OUT_REPORT_SIZE >= FLASHER_REPORT_SIZE_MIN,
+             "out-report-size too small for command reports");
+BUILD_ASSERT(HID_IN_REPORT_SIZE <= 1024 && HID_OUT_REPORT_SIZE <= 1024,
+             "HID reports are limited to one high-speed packet");
 
 /* HID Report Descriptor for vendor-defined interface */
 static const uint8_t hid_report_desc[] = {
@@ -19,7 +31,7 @@ static const uint8_t hid_report_desc[] = {
     0x15, 0x00,              /*   LOGICAL_MINIMUM (0) */
     0x26, 0xFF, 0x00,        /*   LOGICAL_MAXIMUM (255) */
     0x75, 0x08,              /*   REPORT_SIZE (8 bits) */
-    0x95, REPORT_SIZE_BYTES, /*   REPORT_COUNT (64 bytes) */
+    0x96, U16_LE(HID_OUT_REPORT_SIZE), /*   REPORT_COUNT (out-report-size) */
     0x91, 0x02,              /*   OUTPUT (Data,Var,Abs) */
 
     /* IN report: device -> host */
@@ -27,9 +39,17 @@ static const uint8_t hid_report_desc[] = {
     0x15, 0x00,              /*   LOGICAL_MINIMUM (0) */
     0x26, 0xFF, 0x00,        /*   LOGICAL_MAXIMUM (255) */
     0x75, 0x08,              /*   REPORT_SIZE (8 bits) */
-    0x95, REPORT_SIZE_BYTES, /*   REPORT_COUNT (64 bytes) */
+    0x96, U16_LE(HID_IN_REPORT_SIZE),  /*   REPORT_COUNT (in-report-size) */
     0x81, 0x02,              /*   INPUT (Data,Var,Abs) */
 
+    /* Feature report: capabilities, device -> host */
+    0x09, 0x04,              /*   USAGE (Vendor Usage 4) */
+    0x15, 0x00,              /*   LOGICAL_MINIMUM (0) */
+    0x26, 0xFF, 0x00,        /*   LOGICAL_MAXIMUM (255) */
+    0x75, 0x08,              /*   REPORT_SIZE (8 bits) */
+    0x96, U16_LE(FLASHER_CAPS_SIZE), /*   REPORT_COUNT (caps size) */
+    0xB1, 0x02,              /*   FEATURE (Data,Var,Abs) */
+
     0xC0 /* END_COLLECTION */
 };
 
@@ -48,7 +68,12 @@ static int hid_get_report(const struct device *dev, const uint8_t type,
                           const uint8_t id, const uint16_t len,
                           uint8_t *const buf) {
   LOG_DBG("Get Report: Type %u ID %u Len %u", type, id, len);
-  return 0;
+
+  if (type == HID_REPORT_TYPE_FEATURE) {
+    return protocol_get_caps(buf, len);
+  }
+
+  return protocol_get_status(buf, len);
 }
 
 /**
@@ -57,19 +82,44 @@ static int hid_get_report(const struct device *dev, const uint8_t type,
 static int hid_set_report(const struct device *dev, const uint8_t type,
                           const uint8_t id, const uint16_t len,
                           const uint8_t *const buf) {
-  LOG_INF("Set Report: Type %u ID %u Len %u", type, id, len);
-  LOG_HEXDUMP_INF(buf, len, "HID OUT data:");
-  return 0;
+  /* Called for every report of a data stream */
+  LOG_LIMITED(LOG_INF, "Set Report: Type %u ID %u Len %u", type, id, len);
+  LOG_HEXDUMP_DBG(buf, len, "HID OUT data:");
+
+  /* The capability report is read-only */
+  if (type == HID_REPORT_TYPE_FEATURE) {
+    return -ENOTSUP;
+  }
+
+  return protocol_handle_report(buf, len);
+}
+
+/**
+ * @brief Handle reports received on the interrupt OUT endpoint
+ *
+ * Only used when the devicetree gives the interface an out-report-size;
+ * otherwise the host sends OUT reports through SET_REPORT.
+ */
+static void hid_output_report(const struct device *dev, const uint16_t len,
+                              const uint8_t *const buf) {
+  int err;
+
+  /* The host learns of it from the status, where the error is latched */
+  err = protocol_handle_report(buf, len);
+  if (err) {
+    LOG_LIMITED(LOG_WRN, "Output report rejected: %d", err);
+  }
 }
 
 static const struct hid_device_ops hid_ops = {
     .iface_ready = hid_iface_ready,
     .get_report = hid_get_report,
     .set_report = hid_set_report,
+    .output_report = hid_output_report,
 };
 
 int hid_device_init(void) {
-  const struct device *hid_dev = DEVICE_DT_GET(DT_NODELABEL(hid_dev_0));
+  const struct device *hid_dev = DEVICE_DT_GET(HID_NODE);
   int err;
 
   if (!device_is_ready(hid_dev)) {
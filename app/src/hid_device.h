@@ -6,8 +6,19 @@
 #ifndef HID_DEVICE_H
 #define HID_DEVICE_H
 
+#include <zephyr/devicetree.h>
 #include <zephyr/usb/class/usbd_hid.h>
 
+#define HID_NODE DT_NODELABEL(hid_dev_0)
+
+/* Report sizes follow the devicetree; OUT defaults to the IN size */
+#define HID_IN_REPORT_SIZE DT_PROP(HID_NODE, in_report_size)
+#define HID_OUT_REPORT_SIZE                                                    \
+  DT_PROP_OR(HID_NODE, out_report_size, HID_IN_REPORT_SIZE)
+
+/* OUT reports use the interrupt pipe, not SET_REPORT */
+#define HID_HAS_INT_OUT DT_NODE_HAS_PROP(HID_NODE, out_report_size)
+
 /**
  * @brief Initialize and register the HID device
  * 
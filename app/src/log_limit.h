@@ -0,0 +1,46 @@
+/**
+ * @file log_limit.h
+ * @brief Rate-limited logging for messages on the USB data path
+ */
+
+#ifndef LOG_LIMIT_H
+#define LOG_LIMIT_H
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+
+#if defined(CONFIG_LOG) && CONFIG_FLASHER_LOG_RATE_LIMIT_MS > 0
+
+/**
+ * @brief Log through @p _log at most once per rate limit interval
+ *
+ * Each call site is limited on its own. Messages dropped in between are
+ * counted, and the count is logged before the next one that goes out.
+ *
+ * @param _log Logging macro, e.g. LOG_WRN
+ */
+#define LOG_LIMITED(_log, ...)                                               \
+	do {                                                                 \
+		static int64_t _next_ms;                                     \
+		static uint32_t _dropped;                                    \
+		int64_t _now = k_uptime_get();                               \
+									     \
+		if (_now < _next_ms) {                                       \
+			_dropped++;                                          \
+			break;                                               \
+		}                                                            \
+		_next_ms = _now + CONFIG_FLASHER_LOG_RATE_LIMIT_MS;          \
+		if (_dropped) {                                              \
+			_log("%u similar messages dropped", _dropped);       \
+			_dropped = 0;                                        \
+		}                                                            \
+		_log(__VA_ARGS__);                                           \
+	} while (0)
+
+#else
+
+#define LOG_LIMITED(_log, ...) _log(__VA_ARGS__)
+
+#endif
+
+#endif /* LOG_LIMIT_H */
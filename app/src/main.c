@@ -1,18 +1,22 @@
 #include <zephyr/device.h>
-#include <zephyr/drivers/gpio.h>
 #include <zephyr/kernel.h>
 #include <zephyr/logging/log.h>
 #include <zephyr/usb/usbd.h>
 
+#include "boot_timeline.h"
+#include "dfu_flash.h"
+#include "flash_worker.h"
+#include "fpga.h"
 #include "hid_device.h"
+#include "msc_volume.h"
 #include "usbd_init.h"
 #include "w25q16_hal.h"
 
 LOG_MODULE_REGISTER(main);
 
 /* Device tree node labels */
-#define RESET_PIN_NODE DT_NODELABEL(crst)
 #define FLASH_NODE DT_NODELABEL(w25q16)
+#define FLASH_B_NODE DT_NODELABEL(w25q16_b)
 
 /* SPI operation configuration */
 #define SPI_OP_CONFIG (SPI_OP_MODE_MASTER | SPI_WORD_SET(8))
@@ -26,45 +30,73 @@ LOG_MODULE_REGISTER(main);
 #endif
 
 /* Static device configurations */
-static struct gpio_dt_spec reset_pin = GPIO_DT_SPEC_GET(RESET_PIN_NODE, gpios);
-static struct flash_config flash_dev = {
-    .dev = SPI_DT_SPEC_GET(FLASH_NODE, SPI_OP_CONFIG),
+static struct flash_config flash_devs[FLASH_TARGET_COUNT] = {
+    {.dev = SPI_DT_SPEC_GET(FLASH_NODE, SPI_OP_CONFIG)},
+#if FLASH_TARGET_COUNT > 1
+    {.dev = SPI_DT_SPEC_GET(FLASH_B_NODE, SPI_OP_CONFIG)},
+#endif
 };
 
 /**
- * @brief Initialize the FPGA reset pin
+ * @brief Release a target's FPGA once its flash is ready and idle
+ *
+ * The flash itself is brought up by the worker thread, concurrently with
+ * USB enumeration. Host jobs queued meanwhile run first: the FPGA reads
+ * the flash as SPI master and must not do so while it is being written.
  *
- * @return 0 on success, negative errno on failure
+ * @param target Target to release
+ * @param reset_at Uptime in ms at which reset was asserted
  */
-static int init_reset_pin(void) {
+static void release_fpga(int target, int64_t reset_at) {
   int err;
 
-  err = gpio_pin_configure_dt(&reset_pin, GPIO_OUTPUT_ACTIVE);
+  err = flash_worker_wait_ready(target, K_FOREVER);
   if (err) {
-    LOG_ERR("Failed to configure reset pin: %d", err);
-    return err;
+    LOG_ERR("Flash %d not ready: %d", target, err);
+    return;
   }
 
-  LOG_DBG("Reset pin configured successfully");
-  return 0;
+  /* Keep the reset pulse at least RESET_PULSE_MS long */
+  k_sleep(K_TIMEOUT_ABS_MS(reset_at + RESET_PULSE_MS));
+  (void)flash_worker_flush(K_FOREVER);
+  fpga_set_reset(target, false);
+
+  LOG_INF("Flash device initialized");
 }
 
 /**
- * @brief Perform FPGA reset sequence and initialize flash
+ * @brief Check that a released target configured itself
+ *
+ * @param target Target to check
  */
-static void init_flash_device(void) {
-  /* Assert reset */
-  gpio_pin_set_dt(&reset_pin, 1);
-  k_msleep(RESET_PULSE_MS);
+static void verify_fpga(int target) {
+  uint32_t elapsed_us;
+  int err;
 
-  /* Initialize flash communication */
-  flash_reset(&flash_dev);
-  flash_read_id(&flash_dev);
+  err = fpga_wait_cdone(target, K_MSEC(CONFIG_FLASHER_CDONE_TIMEOUT_MS));
+  if (err == -ENOTSUP) {
+    return;
+  }
 
-  /* Release reset */
-  gpio_pin_set_dt(&reset_pin, 0);
+  fpga_get_boot(target, &elapsed_us);
+  if (err) {
+    LOG_WRN("FPGA %d did not configure: %d", target, err);
+    return;
+  }
 
-  LOG_INF("Flash device initialized");
+  LOG_INF("FPGA %d configured in %u us", target, elapsed_us);
+}
+
+/**
+ * @brief Record USB milestones in the boot timeline
+ */
+static void usbd_msg_cb(struct usbd_context *const ctx,
+                        const struct usbd_msg *const msg) {
+  if (msg->type == USBD_MSG_CONFIGURATION) {
+    boot_timeline_mark(BOOT_STAGE_USB_CONFIGURED);
+  }
+
+  dfu_flash_handle_msg(ctx, msg);
 }
 
 /**
@@ -76,7 +108,7 @@ static struct usbd_context *init_usb_device(void) {
   struct usbd_context *usbd_ctx;
   int err;
 
-  usbd_ctx = flasher_usbd_init_device(NULL);
+  usbd_ctx = flasher_usbd_init_device(usbd_msg_cb);
   if (!usbd_ctx) {
     LOG_ERR("Failed to initialize USB device");
     return NULL;
@@ -88,11 +120,13 @@ static struct usbd_context *init_usb_device(void) {
     return NULL;
   }
 
+  boot_timeline_mark(BOOT_STAGE_USB_ENABLED);
   LOG_INF("USB device enabled");
   return usbd_ctx;
 }
 
 int main(void) {
+  int64_t reset_at;
   int err;
 
   LOG_INF("ICE40 Flasher starting...");
@@ -104,19 +138,43 @@ int main(void) {
     return err;
   }
 
+  /*
+   * Hold the FPGAs in reset and let the workers bring up their flashes
+   * while the host enumerates us. Commands queue until the flash is ready,
+   * and the FPGAs stay in reset until they have been executed.
+   */
+  for (int i = 0; i < FLASH_TARGET_COUNT; i++) {
+    err = fpga_init(i);
+    if (err) {
+      return err;
+    }
+
+    err = flash_worker_start(i, &flash_devs[i]);
+    if (err) {
+      LOG_ERR("Flash worker %d start failed: %d", i, err);
+      return err;
+    }
+  }
+  reset_at = k_uptime_get();
+
+  err = msc_volume_init();
+  if (err) {
+    LOG_ERR("Mass storage volume initialization failed: %d", err);
+    return err;
+  }
+
   /* Initialize and enable USB */
   if (!init_usb_device()) {
     return -EIO;
   }
 
-  /* Initialize reset pin */
-  err = init_reset_pin();
-  if (err) {
-    return err;
+  for (int i = 0; i < FLASH_TARGET_COUNT; i++) {
+    release_fpga(i, reset_at);
   }
 
-  /* Initialize flash device */
-  init_flash_device();
+  for (int i = 0; i < FLASH_TARGET_COUNT; i++) {
+    verify_fpga(i);
+  }
 
   LOG_INF("System ready - HID interface active");
 
@@ -0,0 +1,540 @@
+/**
+ * @file msc_volume.c
+ * @brief Virtual FAT volume for drag-and-drop programming over USB MSC
+ *
+ * The volume is a FAT12 file system with 4KB clusters. Boot sector, FAT
+ * and root directory live in RAM; the data area is large enough for a
+ * UF2 file covering the whole flash, followed by one cluster holding
+ * STATUS.TXT.
+ *
+ * Only UF2 blocks written to the data area are acted on. Each carries
+ * its own flash address, block number and block count, so where the
+ * host places the file, in which order it writes it, and whatever else
+ * it stores on the volume (indexing data, resource forks) do not matter.
+ * Other data is dropped and the data area reads as zeros.
+ */
+
+#include "msc_volume.h"
+
+#include <errno.h>
+#include <string.h>
+#include <zephyr/drivers/disk.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/storage/disk_access.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+#include "flash_worker.h"
+#include "fpga.h"
+#include "page_pool.h"
+#include "sector_index.h"
+
+LOG_MODULE_REGISTER(msc_volume);
+
+/* How long the write path may wait for a free page buffer */
+#define PAGE_ALLOC_TIMEOUT_MS          100
+/* How long finishing a transfer may wait for queued jobs */
+#define FLUSH_TIMEOUT_MS               10000
+
+/* UF2 block layout, see https://github.com/microsoft/uf2 */
+#define UF2_MAGIC_START0               0x0A324655
+#define UF2_MAGIC_START1               0x9E5D5157
+#define UF2_MAGIC_END                  0x0AB16F30
+#define UF2_OFF_MAGIC_START0           0
+#define UF2_OFF_MAGIC_START1           4
+#define UF2_OFF_FLAGS                  8
+#define UF2_OFF_ADDR                   12
+#define UF2_OFF_PAYLOAD_SIZE           16
+#define UF2_OFF_BLOCK_NO               20
+#define UF2_OFF_NUM_BLOCKS             24
+#define UF2_OFF_DATA                   32
+#define UF2_OFF_MAGIC_END              508
+#define UF2_FLAG_NOT_MAIN_FLASH        0x00000001
+
+/* One flash page per block, as uf2conv.py and flasher.py write them */
+#define UF2_PAYLOAD_SIZE               W25Q16_PAGE_SIZE
+#define UF2_MAX_BLOCKS                 (W25Q16_SIZE / UF2_PAYLOAD_SIZE)
+
+/* Volume geometry */
+#define VOL_SECTOR_SIZE                512
+#define VOL_SECTORS_PER_CLUSTER        (W25Q16_SECTOR_SIZE / VOL_SECTOR_SIZE)
+#define VOL_FIRST_CLUSTER              2
+#define VOL_DATA_CLUSTERS                                                    \
+	(UF2_MAX_BLOCKS * VOL_SECTOR_SIZE / W25Q16_SECTOR_SIZE)
+#define VOL_STATUS_CLUSTER             (VOL_FIRST_CLUSTER + VOL_DATA_CLUSTERS)
+#define VOL_CLUSTERS                   (VOL_DATA_CLUSTERS + 1)
+#define VOL_FAT_COUNT                  2
+#define VOL_FAT_SECTORS                                                      \
+	DIV_ROUND_UP((VOL_FIRST_CLUSTER + VOL_CLUSTERS) * 3 / 2 + 1,         \
+		     VOL_SECTOR_SIZE)
+#define VOL_ROOT_ENTRIES               16
+
+/* Volume layout, in sectors */
+#define VOL_LBA_FAT                    1
+#define VOL_LBA_ROOT                                                         \
+	(VOL_LBA_FAT + VOL_FAT_COUNT * VOL_FAT_SECTORS)
+#define VOL_ROOT_SECTORS                                                     \
+	(VOL_ROOT_ENTRIES * DIR_ENTRY_SIZE / VOL_SECTOR_SIZE)
+#define VOL_LBA_DATA                   (VOL_LBA_ROOT + VOL_ROOT_SECTORS)
+#define VOL_LBA_STATUS                                                       \
+	(VOL_LBA_DATA + VOL_DATA_CLUSTERS * VOL_SECTORS_PER_CLUSTER)
+#define VOL_SECTORS                    (VOL_LBA_STATUS + VOL_SECTORS_PER_CLUSTER)
+
+/* FAT12 entry values */
+#define FAT12_MEDIA                    0xFF8
+#define FAT12_EOC                      0xFFF
+
+/* Directory entry layout */
+#define DIR_ENTRY_SIZE                 32
+#define DIR_NAME                       0
+#define DIR_NAME_LEN                   11
+#define DIR_ATTR                       11
+#define DIR_CLUSTER                    26
+#define DIR_SIZE                       28
+#define DIR_ATTR_READ_ONLY             0x01
+#define DIR_ATTR_VOLUME                0x08
+
+/* STATUS.TXT is padded to a fixed size so its entry never changes */
+#define STATUS_FILE_SIZE               256
+
+BUILD_ASSERT(VOL_CLUSTERS < 4085, "Volume too large for FAT12");
+BUILD_ASSERT(VOL_SECTORS <= UINT16_MAX, "Volume too large for FAT12");
+BUILD_ASSERT(W25Q16_SECTOR_SIZE % VOL_SECTOR_SIZE == 0 &&
+	     UF2_OFF_DATA + UF2_PAYLOAD_SIZE <= UF2_OFF_MAGIC_END,
+	     "Flash geometry does not map onto volume sectors");
+
+static uint8_t fat[VOL_FAT_SECTORS * VOL_SECTOR_SIZE];
+static uint8_t root[VOL_ROOT_SECTORS * VOL_SECTOR_SIZE];
+
+/* UF2 blocks and flash sectors touched by the transfer in progress */
+static ATOMIC_DEFINE(received, UF2_MAX_BLOCKS);
+static ATOMIC_DEFINE(erased, W25Q16_SIZE / W25Q16_SECTOR_SIZE);
+
+/* Transfer in progress; only used from the mass storage thread */
+static struct {
+	/* Block count of the file, 0 while no transfer is in progress */
+	uint32_t num_blocks;
+	uint32_t blocks;
+	uint32_t bytes;
+	/* First failure; the rest of the file is received but dropped */
+	int result;
+	int64_t started;
+} xfer;
+
+/* Outcome of the last finished transfer, shown in STATUS.TXT */
+static struct {
+	bool valid;
+	int result;
+	uint32_t blocks;
+	uint32_t bytes;
+	uint32_t ms;
+} last;
+
+static void fat12_set(uint32_t cluster, uint16_t value)
+{
+	uint32_t off = cluster * 3 / 2;
+
+	if (cluster & 1) {
+		fat[off] = (fat[off] & 0x0F) | (value << 4);
+		fat[off + 1] = value >> 4;
+	} else {
+		fat[off] = value;
+		fat[off + 1] = (fat[off + 1] & 0xF0) | ((value >> 8) & 0x0F);
+	}
+}
+
+static void dir_entry_set(uint8_t *entry, const char *name, uint8_t attr,
+			  uint16_t cluster, uint32_t size)
+{
+	memcpy(&entry[DIR_NAME], name, DIR_NAME_LEN);
+	entry[DIR_ATTR] = attr;
+	sys_put_le16(cluster, &entry[DIR_CLUSTER]);
+	sys_put_le32(size, &entry[DIR_SIZE]);
+}
+
+/**
+ * @brief Build an empty volume holding only STATUS.TXT
+ */
+static void volume_format(void)
+{
+	memset(fat, 0, sizeof(fat));
+	fat12_set(0, FAT12_MEDIA);
+	fat12_set(1, FAT12_EOC);
+	fat12_set(VOL_STATUS_CLUSTER, FAT12_EOC);
+
+	memset(root, 0, sizeof(root));
+	dir_entry_set(&root[0], "ICE40FLASH ", DIR_ATTR_VOLUME, 0, 0);
+	dir_entry_set(&root[DIR_ENTRY_SIZE], "STATUS  TXT", DIR_ATTR_READ_ONLY,
+		      VOL_STATUS_CLUSTER, STATUS_FILE_SIZE);
+}
+
+static void fill_boot_sector(uint8_t *buf)
+{
+	static const uint8_t jump[] = {0xEB, 0x3C, 0x90};
+
+	memset(buf, 0, VOL_SECTOR_SIZE);
+	memcpy(&buf[0], jump, sizeof(jump));
+	memcpy(&buf[3], "MSWIN4.1", 8);
+	sys_put_le16(VOL_SECTOR_SIZE, &buf[11]);
+	buf[13] = VOL_SECTORS_PER_CLUSTER;
+	sys_put_le16(VOL_LBA_FAT, &buf[14]);
+	buf[16] = VOL_FAT_COUNT;
+	sys_put_le16(VOL_ROOT_ENTRIES, &buf[17]);
+	sys_put_le16(VOL_SECTORS, &buf[19]);
+	buf[21] = FAT12_MEDIA & 0xFF;
+	sys_put_le16(VOL_FAT_SECTORS, &buf[22]);
+	sys_put_le16(1, &buf[24]);
+	sys_put_le16(1, &buf[26]);
+	buf[36] = 0x80;
+	buf[38] = 0x29;
+	sys_put_le32(0x1CE40F1A, &buf[39]);
+	memcpy(&buf[43], "ICE40FLASH ", DIR_NAME_LEN);
+	memcpy(&buf[54], "FAT12   ", 8);
+	buf[510] = 0x55;
+	buf[511] = 0xAA;
+}
+
+static void fill_status(uint8_t *buf)
+{
+	int n;
+
+	if (!last.valid) {
+		n = snprintk((char *)buf, STATUS_FILE_SIZE,
+			     "Result: none\r\nCopy a .uf2 file to program.\r\n");
+	} else {
+		n = snprintk((char *)buf, STATUS_FILE_SIZE,
+			     "Result: %s (%d)\r\nBlocks: %u\r\nBytes: %u\r\n"
+			     "Time: %u ms\r\nSpeed: %u KiB/s\r\n",
+			     last.result ? "FAILED" : "OK", last.result,
+			     last.blocks, last.bytes, last.ms,
+			     (uint32_t)(last.bytes * 1000ULL / 1024 /
+					MAX(last.ms, 1)));
+	}
+
+	n = MIN(n, STATUS_FILE_SIZE - 2);
+	memset(&buf[n], ' ', STATUS_FILE_SIZE - 2 - n);
+	buf[STATUS_FILE_SIZE - 2] = '\r';
+	buf[STATUS_FILE_SIZE - 1] = '\n';
+	memset(&buf[STATUS_FILE_SIZE], 0, VOL_SECTOR_SIZE - STATUS_FILE_SIZE);
+}
+
+/**
+ * @brief Forget the blocks of the current transfer
+ */
+static void transfer_reset(void)
+{
+	memset(received, 0, sizeof(received));
+	memset(erased, 0, sizeof(erased));
+	memset(&xfer, 0, sizeof(xfer));
+}
+
+/**
+ * @brief Flush a complete transfer and reload the FPGAs
+ *
+ * The volume is emptied afterwards, whatever the outcome, so the next
+ * file starts from the same state.
+ */
+static void transfer_finish(void)
+{
+	uint32_t mask = flash_worker_selected();
+	int result = xfer.result;
+
+	if (!result) {
+		result = flash_worker_flush(K_MSEC(FLUSH_TIMEOUT_MS));
+	}
+	if (!result) {
+		result = flash_worker_last_error();
+	}
+
+	last.valid = true;
+	last.result = result;
+	last.blocks = xfer.num_blocks;
+	last.bytes = xfer.bytes;
+	last.ms = (uint32_t)(k_uptime_get() - xfer.started);
+
+	if (result) {
+		LOG_ERR("UF2 programming failed: %d", result);
+	} else {
+		LOG_INF("UF2: %u bytes in %u ms", xfer.bytes, last.ms);
+		for (int i = 0; i < FLASH_TARGET_COUNT; i++) {
+			if (mask & BIT(i)) {
+				fpga_boot(i);
+			}
+		}
+	}
+
+	transfer_reset();
+	volume_format();
+}
+
+static bool page_blank(const uint8_t *data)
+{
+	for (size_t i = 0; i < W25Q16_PAGE_SIZE; i++) {
+		if (data[i] != 0xFF) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * @brief Queue the payload of one UF2 block for programming
+ *
+ * Erases the flash sector first if this transfer has not touched it yet.
+ * A page left at 0xFF is skipped, it is already erased.
+ */
+static int program_page(uint32_t addr, uint32_t size, const uint8_t *data)
+{
+	uint32_t sector = addr / W25Q16_SECTOR_SIZE;
+	struct flash_job *job;
+	int err;
+
+	if (size != UF2_PAYLOAD_SIZE || addr % W25Q16_PAGE_SIZE ||
+	    addr + (uint64_t)size > W25Q16_SIZE) {
+		LOG_ERR("Unsupported UF2 block at 0x%08X, %u bytes", addr, size);
+		return -EINVAL;
+	}
+
+	if (sector_index_reserved(addr, size)) {
+		return -EACCES;
+	}
+
+	if (!atomic_test_and_set_bit(erased, sector)) {
+		err = flash_worker_queue_range(FLASH_JOB_ERASE_4K,
+					       sector * W25Q16_SECTOR_SIZE,
+					       W25Q16_SECTOR_SIZE,
+					       K_MSEC(PAGE_ALLOC_TIMEOUT_MS));
+		if (err) {
+			return err;
+		}
+	}
+
+	if (!page_blank(data)) {
+		job = page_pool_alloc(K_MSEC(PAGE_ALLOC_TIMEOUT_MS));
+		if (!job) {
+			LOG_ERR("No page buffer for 0x%06X", addr);
+			return -ENOMEM;
+		}
+
+		job->op = FLASH_JOB_PROGRAM;
+		job->flags = 0;
+		job->addr = addr;
+		job->len = W25Q16_PAGE_SIZE;
+		memcpy(job->data, data, W25Q16_PAGE_SIZE);
+		flash_worker_submit(job);
+	}
+
+	xfer.bytes += size;
+	return 0;
+}
+
+/**
+ * @brief Act on a block written to the data area
+ *
+ * Anything but a UF2 block is host metadata or a file of another kind
+ * and is dropped. The transfer ends once every block of the file
+ * arrived; a failed one still receives the rest of the file, so its
+ * blocks do not start a new transfer half way. Failures are reported in
+ * STATUS.TXT rather than to the host, whose retries would restart it.
+ */
+static void write_data(const uint8_t *buf)
+{
+	uint32_t flags = sys_get_le32(&buf[UF2_OFF_FLAGS]);
+	uint32_t addr = sys_get_le32(&buf[UF2_OFF_ADDR]);
+	uint32_t size = sys_get_le32(&buf[UF2_OFF_PAYLOAD_SIZE]);
+	uint32_t no = sys_get_le32(&buf[UF2_OFF_BLOCK_NO]);
+	uint32_t count = sys_get_le32(&buf[UF2_OFF_NUM_BLOCKS]);
+
+	if (sys_get_le32(&buf[UF2_OFF_MAGIC_START0]) != UF2_MAGIC_START0 ||
+	    sys_get_le32(&buf[UF2_OFF_MAGIC_START1]) != UF2_MAGIC_START1 ||
+	    sys_get_le32(&buf[UF2_OFF_MAGIC_END]) != UF2_MAGIC_END) {
+		return;
+	}
+
+	if (count == 0 || count > UF2_MAX_BLOCKS || no >= count) {
+		LOG_ERR("Bad UF2 block %u of %u", no, count);
+		return;
+	}
+
+	/* Another file, or the same one copied again */
+	if (xfer.num_blocks &&
+	    (count != xfer.num_blocks || atomic_test_bit(received, no))) {
+		LOG_WRN("UF2 transfer restarted after %u of %u blocks",
+			xfer.blocks, xfer.num_blocks);
+		transfer_reset();
+	}
+
+	if (xfer.num_blocks == 0) {
+		flash_worker_clear_error();
+		xfer.num_blocks = count;
+		xfer.started = k_uptime_get();
+	}
+
+	atomic_set_bit(received, no);
+	xfer.blocks++;
+
+	if (!xfer.result && !(flags & UF2_FLAG_NOT_MAIN_FLASH)) {
+		xfer.result = program_page(addr, size, &buf[UF2_OFF_DATA]);
+	}
+
+	if (xfer.blocks == xfer.num_blocks) {
+		transfer_finish();
+	}
+}
+
+static int read_sector(uint32_t lba, uint8_t *buf)
+{
+	if (lba == 0) {
+		fill_boot_sector(buf);
+	} else if (lba < VOL_LBA_ROOT) {
+		memcpy(buf,
+		       &fat[((lba - VOL_LBA_FAT) % VOL_FAT_SECTORS) *
+			    VOL_SECTOR_SIZE],
+		       VOL_SECTOR_SIZE);
+	} else if (lba < VOL_LBA_DATA) {
+		memcpy(buf, &root[(lba - VOL_LBA_ROOT) * VOL_SECTOR_SIZE],
+		       VOL_SECTOR_SIZE);
+	} else if (lba == VOL_LBA_STATUS) {
+		fill_status(buf);
+	} else {
+		memset(buf, 0, VOL_SECTOR_SIZE);
+	}
+
+	return 0;
+}
+
+static int write_sector(uint32_t lba, const uint8_t *buf)
+{
+	if (lba == 0 || lba >= VOL_LBA_STATUS) {
+		/* Boot sector and STATUS.TXT are generated */
+		return 0;
+	}
+
+	if (lba < VOL_LBA_ROOT) {
+		memcpy(&fat[((lba - VOL_LBA_FAT) % VOL_FAT_SECTORS) *
+			    VOL_SECTOR_SIZE],
+		       buf, VOL_SECTOR_SIZE);
+		return 0;
+	}
+
+	if (lba < VOL_LBA_DATA) {
+		memcpy(&root[(lba - VOL_LBA_ROOT) * VOL_SECTOR_SIZE], buf,
+		       VOL_SECTOR_SIZE);
+		return 0;
+	}
+
+	write_data(buf);
+	return 0;
+}
+
+static int volume_init(struct disk_info *disk)
+{
+	ARG_UNUSED(disk);
+
+	return 0;
+}
+
+static int volume_status(struct disk_info *disk)
+{
+	ARG_UNUSED(disk);
+
+	return DISK_STATUS_OK;
+}
+
+static int volume_read(struct disk_info *disk, uint8_t *buf, uint32_t start,
+		       uint32_t count)
+{
+	int err;
+
+	ARG_UNUSED(disk);
+
+	if (start + (uint64_t)count > VOL_SECTORS) {
+		return -EINVAL;
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		err = read_sector(start + i, &buf[i * VOL_SECTOR_SIZE]);
+		if (err) {
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static int volume_write(struct disk_info *disk, const uint8_t *buf,
+			uint32_t start, uint32_t count)
+{
+	int err;
+
+	ARG_UNUSED(disk);
+
+	if (start + (uint64_t)count > VOL_SECTORS) {
+		return -EINVAL;
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		err = write_sector(start + i, &buf[i * VOL_SECTOR_SIZE]);
+		if (err) {
+			LOG_ERR("Write of sector %u failed: %d", start + i, err);
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static int volume_ioctl(struct disk_info *disk, uint8_t cmd, void *buf)
+{
+	ARG_UNUSED(disk);
+
+	switch (cmd) {
+	case DISK_IOCTL_GET_SECTOR_COUNT:
+		*(uint32_t *)buf = VOL_SECTORS;
+		return 0;
+	case DISK_IOCTL_GET_SECTOR_SIZE:
+		*(uint32_t *)buf = VOL_SECTOR_SIZE;
+		return 0;
+	case DISK_IOCTL_GET_ERASE_BLOCK_SZ:
+		*(uint32_t *)buf = VOL_SECTORS_PER_CLUSTER;
+		return 0;
+	case DISK_IOCTL_CTRL_SYNC:
+		return flash_worker_flush(K_MSEC(FLUSH_TIMEOUT_MS));
+	case DISK_IOCTL_CTRL_INIT:
+	case DISK_IOCTL_CTRL_DEINIT:
+		return 0;
+	default:
+		return -EINVAL;
+	}
+}
+
+static const struct disk_operations volume_ops = {
+	.init = volume_init,
+	.status = volume_status,
+	.read = volume_read,
+	.write = volume_write,
+	.ioctl = volume_ioctl,
+};
+
+static struct disk_info volume_disk = {
+	.name = MSC_VOLUME_DISK_NAME,
+	.ops = &volume_ops,
+};
+
+int msc_volume_init(void)
+{
+	int err;
+
+	volume_format();
+
+	err = disk_access_register(&volume_disk);
+	if (err) {
+		LOG_ERR("Failed to register disk: %d", err);
+		return err;
+	}
+
+	return 0;
+}
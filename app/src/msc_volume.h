@@ -0,0 +1,39 @@
+/**
+ * @file msc_volume.h
+ * @brief Virtual FAT volume for drag-and-drop programming over USB MSC
+ */
+
+#ifndef MSC_VOLUME_H
+#define MSC_VOLUME_H
+
+/** Name of the disk the mass storage LUN is bound to */
+#define MSC_VOLUME_DISK_NAME "FLASHER"
+
+#ifdef CONFIG_FLASHER_MSC
+
+/**
+ * @brief Register the virtual volume with the disk access subsystem
+ *
+ * A UF2 file copied onto the volume is programmed into the selected
+ * targets as it is written, each block at the flash address it carries.
+ * Each 4KB flash sector is erased just before its first block is
+ * programmed. Once every block of the file arrived, the writes are
+ * flushed, the selected FPGAs reloaded and the volume emptied again.
+ * STATUS.TXT reports the result and timing of the last transfer.
+ *
+ * Must be called before the USB classes are enabled.
+ *
+ * @return 0 on success, negative errno on failure
+ */
+int msc_volume_init(void);
+
+#else
+
+static inline int msc_volume_init(void)
+{
+	return 0;
+}
+
+#endif /* CONFIG_FLASHER_MSC */
+
+#endif /* MSC_VOLUME_H */
@@ -0,0 +1,73 @@
+/**
+ * @file page_pool.c
+ * @brief Fixed pool of page buffers shared by HID receive and flash worker
+ *
+ * The pool is the only source of page buffers, so its size bounds both
+ * the RAM spent on buffering and how far reception can run ahead of
+ * programming.
+ */
+
+#include "page_pool.h"
+
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+
+LOG_MODULE_REGISTER(page_pool);
+
+K_MEM_SLAB_DEFINE_STATIC(page_slab, sizeof(struct flash_job),
+			 CONFIG_FLASHER_PAGE_POOL_COUNT, sizeof(void *));
+
+static atomic_t peak;
+static atomic_t waits;
+static atomic_t misses;
+
+/**
+ * @brief Record the current utilization as the peak if it is higher
+ */
+static void update_peak(void)
+{
+	atomic_val_t used = k_mem_slab_num_used_get(&page_slab);
+	atomic_val_t old;
+
+	do {
+		old = atomic_get(&peak);
+		if (used <= old) {
+			return;
+		}
+	} while (!atomic_cas(&peak, old, used));
+}
+
+struct flash_job *page_pool_alloc(k_timeout_t timeout)
+{
+	struct flash_job *job;
+
+	if (k_mem_slab_alloc(&page_slab, (void **)&job, K_NO_WAIT) == 0) {
+		update_peak();
+		return job;
+	}
+
+	atomic_inc(&waits);
+
+	if (k_mem_slab_alloc(&page_slab, (void **)&job, timeout)) {
+		atomic_inc(&misses);
+		LOG_WRN("Page pool exhausted");
+		return NULL;
+	}
+
+	update_peak();
+	return job;
+}
+
+void page_pool_free(struct flash_job *job)
+{
+	k_mem_slab_free(&page_slab, job);
+}
+
+void page_pool_get_stats(struct page_pool_stats *stats)
+{
+	stats->total = CONFIG_FLASHER_PAGE_POOL_COUNT;
+	stats->used = k_mem_slab_num_used_get(&page_slab);
+	stats->peak = atomic_get(&peak);
+	stats->waits = atomic_get(&waits);
+	stats->misses = atomic_get(&misses);
+}
@@ -0,0 +1,52 @@
+/**
+ * @file page_pool.h
+ * @brief Fixed pool of page buffers shared by HID receive and flash worker
+ */
+
+#ifndef PAGE_POOL_H
+#define PAGE_POOL_H
+
+#include <stdint.h>
+#include <zephyr/kernel.h>
+
+#include "flash_worker.h"
+
+/**
+ * @brief Pool utilization counters
+ */
+struct page_pool_stats {
+	/** Buffers in the pool (CONFIG_FLASHER_PAGE_POOL_COUNT) */
+	uint32_t total;
+	/** Buffers currently allocated */
+	uint32_t used;
+	/** Highest number of buffers allocated at once since boot */
+	uint32_t peak;
+	/** Allocations that had to wait for a buffer to be freed */
+	uint32_t waits;
+	/** Allocations that timed out */
+	uint32_t misses;
+};
+
+/**
+ * @brief Take a page buffer from the pool
+ *
+ * @param timeout How long to wait for a buffer to become free
+ * @return Pointer to the buffer, or NULL if none became available
+ */
+struct flash_job *page_pool_alloc(k_timeout_t timeout);
+
+/**
+ * @brief Return a page buffer to the pool
+ *
+ * @param job Buffer obtained from page_pool_alloc()
+ */
+void page_pool_free(struct flash_job *job);
+
+/**
+ * @brief Read the pool utilization counters
+ *
+ * @param stats Destination for the counters
+ */
+void page_pool_get_stats(struct page_pool_stats *stats);
+
+#endif /* PAGE_POOL_H */
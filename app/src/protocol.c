@@ -0,0 +1,955 @@
+/**
+ * @file protocol.c
+ * @brief Command handling for reports received over HID
+ */
+
+#include "protocol.h"
+
+#include <string.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+#include "bitstream.h"
+#include "boot_timeline.h"
+#include "flash_worker.h"
+#include "flasher_proto.h"
+#include "fpga.h"
+#include "hid_device.h"
+#include "log_limit.h"
+#include "page_pool.h"
+#include "readback.h"
+#include "script.h"
+#include "sector_index.h"
+
+LOG_MODULE_REGISTER(protocol);
+
+/* FPGA states are reported as is */
+BUILD_ASSERT(FPGA_BOOT_DONE == FLASHER_FPGA_DONE &&
+	     FPGA_BOOT_TIMEOUT == FLASHER_FPGA_TIMEOUT &&
+	     FPGA_BOOT_UNSUPPORTED == FLASHER_FPGA_NO_CDONE,
+	     "FPGA state encoding mismatch");
+
+/* How long the receive side may wait for a free page buffer */
+#define PAGE_ALLOC_TIMEOUT_MS          100
+
+/*
+ * Full pages of an image write held back until its header checked out.
+ * One more buffer receives data and one is left for the first erase.
+ */
+#define HOLD_PAGES_MAX                 (CONFIG_FLASHER_PAGE_POOL_COUNT - 2)
+
+BUILD_ASSERT(HOLD_PAGES_MAX >= 1,
+	     "Image writes need CONFIG_FLASHER_PAGE_POOL_COUNT >= 3");
+
+/**
+ * @brief Destination of a data stream
+ */
+enum stream_kind {
+	STREAM_FLASH,
+	STREAM_SCRIPT,
+};
+
+/* State of an ongoing data stream */
+static struct {
+	enum stream_kind kind;
+	enum flash_job_op op;
+	uint8_t flags;
+	uint32_t addr;
+	uint32_t remaining;
+	struct flash_job *job;
+	int result;
+	/* Aborted: the rest of the announced data is discarded */
+	bool draining;
+	/* Parse the data as a bitstream */
+	bool image;
+	/* End of the range erased on behalf of an image write */
+	uint32_t erased_to;
+	/* Pages received before the image header checked out */
+	struct flash_job *held[CONFIG_FLASHER_PAGE_POOL_COUNT];
+	uint8_t held_count;
+	struct bitstream_parser parser;
+} stream;
+
+/* Length of the last complete image */
+static uint32_t image_len;
+
+/*
+ * First failure of a report (rejected command, aborted stream) the host
+ * has not seen yet. Commands are refused until an idle status has
+ * reported it, so hosts polling for idle cannot miss it.
+ */
+static int latched_error;
+
+/**
+ * @brief Produces the data of one reply report
+ *
+ * @param target Target the data comes from
+ * @param offset Source offset to continue at
+ * @param avail Source bytes left in the reply
+ * @param buf Report data area
+ * @param len Size of @p buf
+ * @param out_len Set to the number of bytes written to @p buf
+ * @return Source bytes consumed, or negative errno
+ */
+typedef int (*reply_fill_t)(int target, uint32_t offset, uint32_t avail,
+			    uint8_t *buf, size_t len, size_t *out_len);
+
+/* Data returned over GET_REPORT for the last command */
+static struct {
+	uint8_t cmd;
+	int target;
+	uint32_t base;
+	uint32_t offset;
+	uint32_t total;
+	reply_fill_t fill;
+} reply;
+
+/* Sequence number of the first transaction of a TRACE reply */
+static uint32_t trace_first;
+
+/* Serializes stream state between the USB context and the script runner */
+static K_MUTEX_DEFINE(stream_lock);
+static K_SEM_DEFINE(stream_done, 0, 1);
+
+/**
+ * @brief Mark the stream finished and wake anyone waiting for it
+ */
+static void stream_end(int result)
+{
+	stream.remaining = 0;
+	stream.draining = false;
+	stream.result = result;
+	k_sem_give(&stream_done);
+}
+
+/**
+ * @brief Drop an ongoing write stream
+ *
+ * The host does not learn about the failure before it sent the rest of
+ * the stream, so the remaining data is still expected: it is discarded
+ * by protocol_handle_report() instead of being taken for commands.
+ */
+static void stream_abort(int result)
+{
+	if (stream.job) {
+		page_pool_free(stream.job);
+		stream.job = NULL;
+	}
+
+	for (int i = 0; i < stream.held_count; i++) {
+		page_pool_free(stream.held[i]);
+	}
+	stream.held_count = 0;
+
+	stream.draining = true;
+	stream.result = result;
+	if (!latched_error) {
+		latched_error = result;
+	}
+	k_sem_give(&stream_done);
+}
+
+/**
+ * @brief Store a data report of a script upload
+ */
+static int stream_script(const uint8_t *buf, uint16_t len)
+{
+	size_t avail = MIN(len, stream.remaining);
+	int err;
+
+	err = script_load(stream.addr, buf, avail);
+	if (err) {
+		stream_abort(err);
+		return err;
+	}
+
+	stream.addr += avail;
+	stream.remaining -= avail;
+
+	if (stream.remaining == 0) {
+		stream_end(0);
+		return script_run(stream.addr);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Erase the sector an image write is about to enter
+ */
+static int stream_erase_ahead(uint32_t addr)
+{
+	int err;
+
+	if (stream.op != FLASH_JOB_PROGRAM || addr < stream.erased_to) {
+		return 0;
+	}
+
+	addr = ROUND_DOWN(addr, W25Q16_SECTOR_SIZE);
+	err = flash_worker_queue_range(FLASH_JOB_ERASE_4K, addr,
+				       W25Q16_SECTOR_SIZE,
+				       K_MSEC(PAGE_ALLOC_TIMEOUT_MS));
+	if (!err) {
+		stream.erased_to = addr + W25Q16_SECTOR_SIZE;
+	}
+
+	return err;
+}
+
+/**
+ * @brief Check whether pages must be held back
+ *
+ * An image write erases nothing before the bitstream header checked
+ * out, so a malformed image leaves the flash untouched.
+ */
+static bool stream_holding(void)
+{
+	return stream.image && stream.op == FLASH_JOB_PROGRAM &&
+	       !bitstream_header_done(&stream.parser);
+}
+
+/**
+ * @brief Queue a filled page buffer, erasing its sector first if needed
+ *
+ * The buffer is released on failure.
+ */
+static int stream_submit(struct flash_job *job)
+{
+	int err;
+
+	if (stream_holding()) {
+		if (stream.held_count == HOLD_PAGES_MAX) {
+			LOG_ERR("No image header within %u bytes",
+				(HOLD_PAGES_MAX + 1) * W25Q16_PAGE_SIZE);
+			page_pool_free(job);
+			return -EBADMSG;
+		}
+		stream.held[stream.held_count++] = job;
+		return 0;
+	}
+
+	err = stream.image ? stream_erase_ahead(job->addr) : 0;
+	if (err) {
+		page_pool_free(job);
+		return err;
+	}
+
+	flash_worker_submit(job);
+	return 0;
+}
+
+/**
+ * @brief Queue the partially filled page buffer, if any
+ */
+static int stream_flush(void)
+{
+	struct flash_job *job = stream.job;
+
+	if (!job || !job->len) {
+		return 0;
+	}
+
+	stream.job = NULL;
+	return stream_submit(job);
+}
+
+/**
+ * @brief Queue the pages held back while the image header was parsed
+ */
+static int stream_release(void)
+{
+	int err = 0;
+
+	for (int i = 0; i < stream.held_count; i++) {
+		if (err) {
+			page_pool_free(stream.held[i]);
+		} else {
+			err = stream_submit(stream.held[i]);
+		}
+	}
+	stream.held_count = 0;
+
+	return err;
+}
+
+/**
+ * @brief Work out how much of a report belongs to the image
+ *
+ * @return Bytes to store, or negative errno if the stream must stop
+ */
+static int stream_image(const uint8_t *buf, size_t avail)
+{
+	int keep;
+
+	keep = bitstream_feed(&stream.parser, buf, avail);
+	if (keep < 0) {
+		return keep;
+	}
+
+	if (bitstream_done(&stream.parser)) {
+		image_len = bitstream_length(&stream.parser);
+	} else if (stream.remaining == avail) {
+		LOG_ERR("Image truncated at %u bytes",
+			bitstream_length(&stream.parser));
+		return -EBADMSG;
+	}
+
+	return keep;
+}
+
+/**
+ * @brief Copy a data report into page buffers
+ *
+ * A buffer is submitted as soon as it is full or reaches a page
+ * boundary, so each job maps to exactly one page program or read.
+ */
+static int stream_data(const uint8_t *buf, uint16_t len)
+{
+	size_t avail = MIN(len, stream.remaining);
+	size_t keep = avail;
+	int err;
+
+	if (stream.kind == STREAM_SCRIPT) {
+		return stream_script(buf, len);
+	}
+
+	/* Stop as soon as a target reports a failure or mismatch */
+	if (flash_worker_failed()) {
+		LOG_ERR("Stream aborted at 0x%06X", stream.addr);
+		stream_abort(-EIO);
+		return -EIO;
+	}
+
+	if (stream.image) {
+		err = stream_image(buf, avail);
+		if (err < 0) {
+			stream_abort(err);
+			return err;
+		}
+		keep = err;
+
+		if (stream.held_count && !stream_holding()) {
+			err = stream_release();
+			if (err) {
+				stream_abort(err);
+				return err;
+			}
+		}
+	}
+
+	/* Padding after an image is accepted but not stored */
+	stream.remaining -= avail - keep;
+
+	while (keep) {
+		struct flash_job *job = stream.job;
+		size_t room;
+		size_t chunk;
+
+		if (!job) {
+			job = page_pool_alloc(K_MSEC(PAGE_ALLOC_TIMEOUT_MS));
+			if (!job) {
+				LOG_ERR("No page buffer for 0x%06X", stream.addr);
+				stream_abort(-ENOMEM);
+				return -ENOMEM;
+			}
+			job->op = stream.op;
+			job->flags = stream.flags;
+			job->addr = stream.addr;
+			job->len = 0;
+			stream.job = job;
+		}
+
+		room = W25Q16_PAGE_SIZE - ((job->addr + job->len) %
+					   W25Q16_PAGE_SIZE);
+		chunk = MIN(keep, room);
+
+		memcpy(&job->data[job->len], buf, chunk);
+		job->len += chunk;
+		buf += chunk;
+		keep -= chunk;
+		stream.addr += chunk;
+		stream.remaining -= chunk;
+
+		if (chunk == room) {
+			err = stream_flush();
+			if (err) {
+				stream_abort(err);
+				return err;
+			}
+		}
+	}
+
+	if (stream.remaining == 0) {
+		err = stream_flush();
+		if (err) {
+			stream_abort(err);
+			return err;
+		}
+		stream_end(0);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Arm a stream, with the stream lock held
+ */
+static void stream_arm(enum stream_kind kind, enum flash_job_op op,
+		       uint8_t flags, uint32_t addr, uint32_t len)
+{
+	k_sem_reset(&stream_done);
+	stream.kind = kind;
+	stream.op = op;
+	stream.flags = flags;
+	stream.addr = addr;
+	stream.result = 0;
+	stream.remaining = len;
+	stream.draining = false;
+	stream.image = false;
+	stream.held_count = 0;
+}
+
+int protocol_stream_begin(enum flash_job_op op, uint8_t flags, uint32_t addr,
+			  uint32_t len)
+{
+	int err = 0;
+
+	if (len == 0) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&stream_lock, K_FOREVER);
+	if (stream.remaining) {
+		err = -EBUSY;
+	} else {
+		stream_arm(STREAM_FLASH, op, flags, addr, len);
+	}
+	k_mutex_unlock(&stream_lock);
+
+	return err;
+}
+
+int protocol_stream_wait(k_timeout_t timeout)
+{
+	int err;
+
+	if (k_sem_take(&stream_done, timeout)) {
+		/* Nothing more is coming, so there is nothing to discard */
+		k_mutex_lock(&stream_lock, K_FOREVER);
+		stream_abort(-ETIMEDOUT);
+		stream_end(-ETIMEDOUT);
+		k_mutex_unlock(&stream_lock);
+	}
+
+	k_mutex_lock(&stream_lock, K_FOREVER);
+	err = stream.result;
+	k_mutex_unlock(&stream_lock);
+
+	return err;
+}
+
+/**
+ * @brief Queue data to be returned over GET_REPORT
+ *
+ * @param cmd Command the data answers
+ * @param target Target the data is read from
+ * @param base Offset of the first byte in the source
+ * @param total Number of source bytes to return
+ * @param fill Produces the data of each report
+ */
+static void reply_arm(uint8_t cmd, int target, uint32_t base, uint32_t total,
+		      reply_fill_t fill)
+{
+	reply.cmd = cmd;
+	reply.target = target;
+	reply.base = base;
+	reply.offset = 0;
+	reply.total = total;
+	reply.fill = fill;
+}
+
+/**
+ * @brief Fill a report with the next part of the pending reply
+ *
+ * The offset in the header counts source bytes, so encoded replies can
+ * be placed by the host.
+ */
+static int reply_next(uint8_t *buf, uint16_t len)
+{
+	size_t out_len = 0;
+	int used;
+
+	used = reply.fill(reply.target, reply.base + reply.offset,
+			  reply.total - reply.offset, &buf[FLASHER_REPLY_DATA],
+			  len - FLASHER_REPLY_DATA, &out_len);
+	if (used <= 0) {
+		reply.total = 0;
+		return used ? used : -EIO;
+	}
+
+	buf[FLASHER_REPLY_STATE] = FLASHER_STATE_REPLY;
+	buf[FLASHER_REPLY_CMD] = reply.cmd;
+	sys_put_le32(reply.offset, &buf[FLASHER_REPLY_OFFSET]);
+	sys_put_le16(out_len, &buf[FLASHER_REPLY_LEN]);
+
+	reply.offset += used;
+	if (reply.offset == reply.total) {
+		reply.total = 0;
+	}
+
+	return FLASHER_REPLY_DATA + out_len;
+}
+
+/**
+ * @brief Copy part of the sector index into a reply report
+ */
+static int fill_index(int target, uint32_t offset, uint32_t avail,
+		      uint8_t *buf, size_t len, size_t *out_len)
+{
+	size_t n = MIN(avail, ROUND_DOWN(len, sizeof(uint32_t)));
+	int err;
+
+	err = sector_index_read(target, offset, buf, n);
+	if (err) {
+		return err;
+	}
+
+	*out_len = n;
+	return n;
+}
+
+/**
+ * @brief Lowest selected target, the source of per-target replies
+ */
+static int first_selected(void)
+{
+	return find_lsb_set(flash_worker_selected()) - 1;
+}
+
+/**
+ * @brief Sync the sector index and return part of it
+ */
+static int read_index(uint32_t first, uint32_t count)
+{
+	int err;
+
+	if (count == 0) {
+		count = SECTOR_INDEX_COUNT - MIN(first, SECTOR_INDEX_COUNT);
+	}
+
+	if (count == 0 || first + count > SECTOR_INDEX_COUNT) {
+		return -EINVAL;
+	}
+
+	err = flash_worker_queue_range(FLASH_JOB_INDEX_SYNC, 0, 0,
+				       K_MSEC(PAGE_ALLOC_TIMEOUT_MS));
+	if (err) {
+		return err;
+	}
+
+	reply_arm(FLASHER_CMD_INDEX, first_selected(),
+		  first * sizeof(uint32_t), count * sizeof(uint32_t),
+		  fill_index);
+	return 0;
+}
+
+/**
+ * @brief Return flash contents, optionally run-length encoded
+ */
+static int read_flash(uint32_t addr, uint32_t len, uint8_t flags)
+{
+	if (len == 0 || addr + (uint64_t)len > W25Q16_SIZE) {
+		return -EINVAL;
+	}
+
+	reply_arm(FLASHER_CMD_READ, first_selected(), addr, len,
+		  (flags & FLASHER_READ_RLE) ? readback_rle : readback_raw);
+	return 0;
+}
+
+/**
+ * @brief Encode recorded SPI transactions into a reply report
+ */
+static int fill_trace(int target, uint32_t offset, uint32_t avail,
+		      uint8_t *buf, size_t len, size_t *out_len)
+{
+	size_t n = MIN(avail, ROUND_DOWN(len, FLASHER_TRACE_RECORD_SIZE));
+	uint32_t seq = trace_first + offset / FLASHER_TRACE_RECORD_SIZE;
+	struct flash_trace_entry e;
+	uint8_t *rec;
+	int err;
+
+	for (size_t off = 0; off < n; off += FLASHER_TRACE_RECORD_SIZE) {
+		/* Fails if the ring wrapped since the command */
+		err = flash_trace_get(seq++, &e);
+		if (err) {
+			return err;
+		}
+
+		rec = &buf[off];
+		sys_put_le32(e.start_us, &rec[FLASHER_TRACE_START]);
+		sys_put_le32(e.end_us, &rec[FLASHER_TRACE_END]);
+		sys_put_le32(e.addr, &rec[FLASHER_TRACE_ADDR]);
+		sys_put_le16(e.len, &rec[FLASHER_TRACE_LEN]);
+		rec[FLASHER_TRACE_OPCODE] = e.opcode;
+		rec[FLASHER_TRACE_FLAGS] =
+			(e.target & FLASHER_TRACE_TARGET_MASK) |
+			(e.failed ? FLASHER_TRACE_FAILED : 0);
+	}
+
+	*out_len = n;
+	return n;
+}
+
+/**
+ * @brief Return or discard the SPI transactions recorded so far
+ */
+static int read_trace(uint8_t flags)
+{
+	uint32_t next;
+
+	if (!IS_ENABLED(CONFIG_FLASHER_SPI_TRACE)) {
+		return -ENOTSUP;
+	}
+
+	if (flags & FLASHER_TRACE_CLEAR) {
+		flash_trace_clear();
+		return 0;
+	}
+
+	flash_trace_bounds(&trace_first, &next);
+	if (next != trace_first) {
+		reply_arm(FLASHER_CMD_TRACE, 0, 0,
+			  (next - trace_first) * FLASHER_TRACE_RECORD_SIZE,
+			  fill_trace);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Reload the configuration of every selected FPGA
+ */
+static int boot_selected(void)
+{
+	uint32_t mask = flash_worker_selected();
+	int err;
+
+	/* The FPGA must not read the flash while jobs are writing it */
+	if (flash_worker_busy()) {
+		return -EBUSY;
+	}
+
+	for (int i = 0; i < FLASH_TARGET_COUNT; i++) {
+		if (!(mask & BIT(i))) {
+			continue;
+		}
+
+		err = fpga_boot(i);
+		if (err) {
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Decode and execute a command report
+ */
+static int handle_command(const uint8_t *buf, uint16_t len)
+{
+	uint32_t addr;
+	uint32_t count;
+	uint8_t wflags = 0;
+	uint8_t flags = 0;
+
+	if (len < FLASHER_ARG_LEN + sizeof(uint32_t)) {
+		return -EINVAL;
+	}
+
+	addr = sys_get_le32(&buf[FLASHER_ARG_ADDR]);
+	count = sys_get_le32(&buf[FLASHER_ARG_LEN]);
+
+	flash_worker_clear_error();
+	flash_worker_wake();
+	reply.total = 0;
+
+	switch (buf[0]) {
+	case FLASHER_CMD_ERASE_CHIP:
+		/* It would wipe the saved index too */
+		if (sector_index_reserved(0, W25Q16_SIZE)) {
+			return -EACCES;
+		}
+		return flash_worker_queue_range(FLASH_JOB_ERASE_CHIP, 0, 0,
+						K_MSEC(PAGE_ALLOC_TIMEOUT_MS));
+	case FLASHER_CMD_ERASE_64K:
+		/* The byte count below must not wrap past the checks */
+		if (addr % W25Q16_BLOCK_SIZE || count == 0 ||
+		    count > W25Q16_SIZE / W25Q16_BLOCK_SIZE ||
+		    addr + (uint64_t)count * W25Q16_BLOCK_SIZE > W25Q16_SIZE) {
+			return -EINVAL;
+		}
+		if (sector_index_reserved(addr, count * W25Q16_BLOCK_SIZE)) {
+			return -EACCES;
+		}
+		return flash_worker_queue_range(FLASH_JOB_ERASE_64K, addr,
+						count * W25Q16_BLOCK_SIZE,
+						K_MSEC(PAGE_ALLOC_TIMEOUT_MS));
+	case FLASHER_CMD_WRITE:
+	case FLASHER_CMD_VERIFY:
+		if (count == 0 || addr + (uint64_t)count > W25Q16_SIZE) {
+			return -EINVAL;
+		}
+		if (buf[0] == FLASHER_CMD_WRITE &&
+		    sector_index_reserved(addr, count)) {
+			return -EACCES;
+		}
+		if (len > FLASHER_ARG_FLAGS) {
+			wflags = buf[FLASHER_ARG_FLAGS];
+		}
+		if (wflags & FLASHER_WRITE_VERIFY) {
+			flags |= FLASH_JOB_FLAG_VERIFY;
+		}
+		if ((wflags & FLASHER_WRITE_IMAGE) &&
+		    buf[0] == FLASHER_CMD_WRITE && addr % W25Q16_SECTOR_SIZE) {
+			return -EINVAL;
+		}
+		stream_arm(STREAM_FLASH,
+			   buf[0] == FLASHER_CMD_WRITE ? FLASH_JOB_PROGRAM :
+							 FLASH_JOB_VERIFY,
+			   flags, addr, count);
+		if (wflags & FLASHER_WRITE_IMAGE) {
+			stream.image = true;
+			stream.erased_to = addr;
+			bitstream_init(&stream.parser, addr, count);
+			image_len = 0;
+		}
+		LOG_DBG("Stream of %u bytes at 0x%06X", count, addr);
+		return 0;
+	case FLASHER_CMD_PATCH:
+		if (!IS_ENABLED(CONFIG_FLASHER_SECTOR_CACHE)) {
+			return -ENOTSUP;
+		}
+		if (count == 0 || addr + (uint64_t)count > W25Q16_SIZE) {
+			return -EINVAL;
+		}
+		if (sector_index_reserved(addr, count)) {
+			return -EACCES;
+		}
+		stream_arm(STREAM_FLASH, FLASH_JOB_PATCH, 0, addr, count);
+		return 0;
+	case FLASHER_CMD_FLUSH:
+		return flash_worker_queue_range(FLASH_JOB_CACHE_FLUSH, 0, 0,
+						K_MSEC(PAGE_ALLOC_TIMEOUT_MS));
+	case FLASHER_CMD_SELECT:
+		return flash_worker_select(sys_get_le32(&buf[FLASHER_ARG_MASK]));
+	case FLASHER_CMD_BOOT:
+		return boot_selected();
+	case FLASHER_CMD_BLANK_CHECK:
+		if (count == 0 || addr + (uint64_t)count > W25Q16_SIZE) {
+			return -EINVAL;
+		}
+		return flash_worker_queue_range(FLASH_JOB_BLANK_CHECK, addr,
+						count,
+						K_MSEC(PAGE_ALLOC_TIMEOUT_MS));
+	case FLASHER_CMD_READ:
+		return read_flash(addr, count,
+				  len > FLASHER_ARG_FLAGS ? buf[FLASHER_ARG_FLAGS] : 0);
+	case FLASHER_CMD_TRACE:
+		return read_trace(len > FLASHER_ARG_FLAGS ?
+					  buf[FLASHER_ARG_FLAGS] : 0);
+	case FLASHER_CMD_INDEX:
+		return read_index(sys_get_le32(&buf[FLASHER_ARG_SECTOR]),
+				  sys_get_le32(&buf[FLASHER_ARG_SECTORS]));
+	case FLASHER_CMD_SCRIPT:
+		if (count == 0 || count > CONFIG_FLASHER_SCRIPT_SIZE) {
+			return -EINVAL;
+		}
+		stream_arm(STREAM_SCRIPT, FLASH_JOB_PROGRAM, 0, 0, count);
+		return 0;
+	default:
+		/* A host out of step with the protocol sends many of these */
+		LOG_LIMITED(LOG_WRN, "Unknown command 0x%02X", buf[0]);
+		return -ENOTSUP;
+	}
+}
+
+int protocol_handle_report(const uint8_t *buf, uint16_t len)
+{
+	int err;
+
+	if (!buf || len == 0) {
+		return -EINVAL;
+	}
+
+	k_mutex_lock(&stream_lock, K_FOREVER);
+
+	if (stream.remaining) {
+		uint32_t left = stream.remaining - MIN(len, stream.remaining);
+
+		if (!stream.draining) {
+			err = stream_data(buf, len);
+		}
+		if (stream.draining) {
+			/* Swallow data of an aborted stream, whatever it holds */
+			stream.remaining = left;
+			if (left == 0) {
+				stream.draining = false;
+			}
+			err = stream.result;
+		}
+	} else if (script_running()) {
+		/* Data for the next script step arrived before it was armed */
+		err = -EBUSY;
+	} else if (latched_error) {
+		/*
+		 * Likely data following a rejected WRITE: running it could
+		 * erase or program anything, so wait for the host to notice.
+		 */
+		err = latched_error;
+	} else {
+		err = handle_command(buf, len);
+	}
+
+	if (err && !latched_error) {
+		latched_error = err;
+	}
+
+	k_mutex_unlock(&stream_lock);
+
+	return err;
+}
+
+int protocol_get_status(uint8_t *buf, uint16_t len)
+{
+	struct page_pool_stats pool;
+	struct script_status script;
+	uint8_t state = FLASHER_STATE_IDLE;
+	int err;
+
+	if (len < FLASHER_STATUS_SIZE) {
+		return -ENOMEM;
+	}
+
+	k_mutex_lock(&stream_lock, K_FOREVER);
+	if (reply.total && !flash_worker_busy()) {
+		int ret = reply_next(buf, len);
+
+		k_mutex_unlock(&stream_lock);
+		return ret;
+	}
+
+	if (stream.remaining) {
+		state = FLASHER_STATE_STREAMING;
+	} else if (flash_worker_busy() || script_running()) {
+		state = FLASHER_STATE_BUSY;
+	}
+
+	/* The first failure is the one worth reporting */
+	err = latched_error;
+	if (state == FLASHER_STATE_IDLE) {
+		/* Reported, so commands are accepted again */
+		latched_error = 0;
+	}
+	k_mutex_unlock(&stream_lock);
+
+	if (!err) {
+		err = flash_worker_last_error();
+	}
+
+	buf[FLASHER_STATUS_STATE] = state;
+	sys_put_le32((uint32_t)err, &buf[FLASHER_STATUS_ERROR]);
+	sys_put_le32(flash_worker_bytes_done(), &buf[FLASHER_STATUS_DONE]);
+
+	page_pool_get_stats(&pool);
+	buf[FLASHER_STATUS_POOL_TOTAL] = (uint8_t)pool.total;
+	buf[FLASHER_STATUS_POOL_PEAK] = (uint8_t)pool.peak;
+	sys_put_le16((uint16_t)MIN(pool.waits, UINT16_MAX),
+		     &buf[FLASHER_STATUS_POOL_WAITS]);
+
+	buf[FLASHER_STATUS_SELECTED] = (uint8_t)flash_worker_selected();
+	buf[FLASHER_STATUS_FAILED] = (uint8_t)flash_worker_failed();
+	sys_put_le32(flash_worker_mismatch(), &buf[FLASHER_STATUS_MISMATCH]);
+
+	script_get_status(&script);
+	buf[FLASHER_STATUS_SCRIPT_STATE] = script.state;
+	sys_put_le16(script.pc, &buf[FLASHER_STATUS_SCRIPT_PC]);
+	sys_put_le32((uint32_t)script.error, &buf[FLASHER_STATUS_SCRIPT_ERROR]);
+	for (int i = 0; i < FLASH_TARGET_COUNT; i++) {
+		sys_put_le32(flash_worker_digest(i),
+			     &buf[FLASHER_STATUS_DIGEST + i * sizeof(uint32_t)]);
+	}
+
+	sys_put_le32(boot_timeline_get(BOOT_STAGE_USB_ENABLED),
+		     &buf[FLASHER_STATUS_BOOT_USB]);
+	sys_put_le32(boot_timeline_get(BOOT_STAGE_USB_CONFIGURED),
+		     &buf[FLASHER_STATUS_BOOT_CONFIGURED]);
+	sys_put_le32(boot_timeline_get(BOOT_STAGE_FLASH_READY),
+		     &buf[FLASHER_STATUS_BOOT_FLASH]);
+	sys_put_le32(image_len, &buf[FLASHER_STATUS_IMAGE_LEN]);
+	sys_put_le32(flash_worker_nonblank(), &buf[FLASHER_STATUS_NONBLANK]);
+
+	for (int i = 0; i < FLASH_TARGET_COUNT; i++) {
+		uint32_t elapsed;
+
+		buf[FLASHER_STATUS_FPGA_STATE + i] =
+			(uint8_t)fpga_get_boot(i, &elapsed);
+		sys_put_le32(elapsed,
+			     &buf[FLASHER_STATUS_FPGA_TIME + i * sizeof(uint32_t)]);
+	}
+
+	return FLASHER_STATUS_SIZE;
+}
+
+int protocol_get_caps(uint8_t *buf, uint16_t len)
+{
+	uint8_t transports = 0;
+	uint16_t features = 0;
+
+	if (len < FLASHER_CAPS_SIZE) {
+		return -ENOMEM;
+	}
+
+	memset(buf, 0, FLASHER_CAPS_SIZE);
+
+	if (HID_HAS_INT_OUT) {
+		transports |= FLASHER_TRANSPORT_HID_INT_OUT;
+	}
+	if (IS_ENABLED(CONFIG_FLASHER_MSC)) {
+		transports |= FLASHER_TRANSPORT_MSC;
+	}
+	if (IS_ENABLED(CONFIG_FLASHER_DFU)) {
+		transports |= FLASHER_TRANSPORT_DFU;
+	}
+	if (IS_ENABLED(CONFIG_FLASHER_SECTOR_INDEX)) {
+		features |= FLASHER_FEATURE_INDEX;
+	}
+	if (IS_ENABLED(CONFIG_FLASHER_SECTOR_CACHE)) {
+		features |= FLASHER_FEATURE_PATCH;
+	}
+	if (IS_ENABLED(CONFIG_FLASHER_SPI_TRACE)) {
+		features |= FLASHER_FEATURE_TRACE;
+	}
+
+	sys_put_le16(FLASHER_PROTOCOL_VERSION, &buf[FLASHER_CAPS_VERSION]);
+	sys_put_le16(HID_IN_REPORT_SIZE, &buf[FLASHER_CAPS_IN_SIZE]);
+	sys_put_le16(HID_OUT_REPORT_SIZE, &buf[FLASHER_CAPS_OUT_SIZE]);
+	buf[FLASHER_CAPS_TRANSPORTS] = transports;
+	buf[FLASHER_CAPS_CODECS] = FLASHER_CODEC_READ_RLE;
+	buf[FLASHER_CAPS_WINDOW] = CONFIG_FLASHER_PAGE_POOL_COUNT;
+	buf[FLASHER_CAPS_TARGETS] = FLASH_TARGET_COUNT;
+	sys_put_le16(features, &buf[FLASHER_CAPS_FEATURES]);
+
+	sys_put_le32(W25Q16_SIZE, &buf[FLASHER_CAPS_FLASH_SIZE]);
+	sys_put_le16(W25Q16_PAGE_SIZE, &buf[FLASHER_CAPS_PAGE_SIZE]);
+	sys_put_le32(W25Q16_SECTOR_SIZE, &buf[FLASHER_CAPS_SECTOR_SIZE]);
+	sys_put_le32(W25Q16_BLOCK_SIZE, &buf[FLASHER_CAPS_BLOCK_SIZE]);
+	for (int i = 0; i < FLASH_TARGET_COUNT; i++) {
+		sys_put_le32(flash_worker_spi_frequency(i),
+			     &buf[FLASHER_CAPS_SPI_FREQ + i * sizeof(uint32_t)]);
+	}
+
+	return FLASHER_CAPS_SIZE;
+}
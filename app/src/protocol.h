@@ -0,0 +1,70 @@
+/**
+ * @file protocol.h
+ * @brief Command handling for reports received over HID
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <zephyr/kernel.h>
+
+#include "flash_worker.h"
+
+/**
+ * @brief Handle one OUT report from the host
+ *
+ * Called from the USB stack context. Commands are validated and queued
+ * to the flash worker; data reports of an ongoing write are stored
+ * directly into page buffers.
+ *
+ * @param buf Report contents
+ * @param len Report length in bytes
+ * @return 0 on success, negative errno on failure
+ */
+int protocol_handle_report(const uint8_t *buf, uint16_t len);
+
+/**
+ * @brief Fill a status report for the host
+ *
+ * @param buf Destination buffer
+ * @param len Size of @p buf in bytes
+ * @return Number of bytes written, or negative errno on failure
+ */
+int protocol_get_status(uint8_t *buf, uint16_t len);
+
+/**
+ * @brief Fill the capability report for the host
+ *
+ * @param buf Destination buffer
+ * @param len Size of @p buf in bytes
+ * @return Number of bytes written, or negative errno on failure
+ */
+int protocol_get_caps(uint8_t *buf, uint16_t len);
+
+/**
+ * @brief Expect a data stream from the host on behalf of a script
+ *
+ * The following @p len bytes of OUT reports are routed into page
+ * buffers and queued as @p op jobs, exactly as for a WRITE command.
+ *
+ * @param op FLASH_JOB_PROGRAM or FLASH_JOB_VERIFY
+ * @param flags FLASH_JOB_FLAG_* for each job
+ * @param addr Flash address of the first byte
+ * @param len Number of bytes expected
+ * @return 0 on success, -EBUSY if a stream is already in progress
+ */
+int protocol_stream_begin(enum flash_job_op op, uint8_t flags, uint32_t addr,
+			  uint32_t len);
+
+/**
+ * @brief Wait for the stream started by protocol_stream_begin() to end
+ *
+ * The stream is aborted if it does not complete in time.
+ *
+ * @param timeout How long to wait for the remaining data
+ * @return 0 once all data was queued, negative errno otherwise
+ */
+int protocol_stream_wait(k_timeout_t timeout);
+
+#endif /* PROTOCOL_H */
@@ -0,0 +1,169 @@
+/**
+ * @file readback.c
+ * @brief Flash contents returned to the host, raw or run-length encoded
+ *
+ * Erased flash and unused configuration frames are long runs of 0xFF and
+ * 0x00, so encoding them on the device lets one report stand for several
+ * kilobytes. Reports are filled from GET_REPORT, so the flash read per
+ * report is bounded to keep the control transfer short.
+ */
+
+#include "readback.h"
+
+#include <errno.h>
+#include <zephyr/sys/util.h>
+
+#include "flash_worker.h"
+
+/* Flash bytes encoded into a single report at most */
+#define RLE_SOURCE_MAX                 4096
+
+/* Shortest run worth a 3-byte run token */
+#define RLE_RUN_MIN                    4
+#define RLE_RUN_MAX                    0x8000
+#define RLE_LITERAL_MAX                0x80
+
+/**
+ * @brief Page-sized window onto the flash being encoded
+ */
+struct source {
+	int target;
+	uint32_t end;
+	uint32_t base;
+	bool valid;
+	uint8_t page[W25Q16_PAGE_SIZE];
+};
+
+/* Only used from the USB stack context */
+static struct source src;
+
+static int src_byte(struct source *s, uint32_t addr, uint8_t *b)
+{
+	int err;
+
+	if (!s->valid || addr < s->base || addr >= s->base + sizeof(s->page)) {
+		s->base = ROUND_DOWN(addr, sizeof(s->page));
+		err = flash_worker_read(s->target, s->base, s->page,
+					sizeof(s->page));
+		if (err) {
+			s->valid = false;
+			return err;
+		}
+		s->valid = true;
+	}
+
+	*b = s->page[addr - s->base];
+	return 0;
+}
+
+/**
+ * @brief Count repeats of the byte at @p addr, up to @p max
+ *
+ * @return Run length, or negative errno
+ */
+static int run_length(struct source *s, uint32_t addr, uint32_t max)
+{
+	uint8_t first;
+	uint8_t b;
+	uint32_t n = 1;
+	int err;
+
+	err = src_byte(s, addr, &first);
+	if (err) {
+		return err;
+	}
+
+	while (n < max && addr + n < s->end) {
+		err = src_byte(s, addr + n, &b);
+		if (err) {
+			return err;
+		}
+		if (b != first) {
+			break;
+		}
+		n++;
+	}
+
+	return n;
+}
+
+int readback_raw(int target, uint32_t addr, uint32_t avail, uint8_t *buf,
+		 size_t len, size_t *out_len)
+{
+	size_t n = MIN(avail, len);
+	int err;
+
+	err = flash_worker_read(target, addr, buf, n);
+	if (err) {
+		return err;
+	}
+
+	*out_len = n;
+	return n;
+}
+
+int readback_rle(int target, uint32_t addr, uint32_t avail, uint8_t *buf,
+		 size_t len, size_t *out_len)
+{
+	uint32_t pos = addr;
+	size_t o = 0;
+	size_t hdr;
+	uint32_t n;
+	int run;
+	int err;
+
+	src.target = target;
+	src.end = addr + MIN(avail, RLE_SOURCE_MAX);
+	src.valid = false;
+
+	while (pos < src.end) {
+		run = run_length(&src, pos, RLE_RUN_MAX);
+		if (run < 0) {
+			return run;
+		}
+
+		if (run >= RLE_RUN_MIN) {
+			if (o + 3 > len) {
+				break;
+			}
+			buf[o++] = 0x80 | ((run - 1) >> 8);
+			buf[o++] = (run - 1) & 0xFF;
+			err = src_byte(&src, pos, &buf[o++]);
+			if (err) {
+				return err;
+			}
+			pos += run;
+			continue;
+		}
+
+		/* Literal up to the next worthwhile run */
+		if (o + 2 > len) {
+			break;
+		}
+
+		hdr = o++;
+		n = 0;
+
+		while (pos < src.end && n < RLE_LITERAL_MAX && o < len) {
+			if (n > 0) {
+				run = run_length(&src, pos, RLE_RUN_MIN);
+				if (run < 0) {
+					return run;
+				}
+				if (run >= RLE_RUN_MIN) {
+					break;
+				}
+			}
+			err = src_byte(&src, pos, &buf[o++]);
+			if (err) {
+				return err;
+			}
+			pos++;
+			n++;
+		}
+		buf[hdr] = n - 1;
+	}
+
+	*out_len = o;
+	return pos - addr;
+}
@@ -0,0 +1,45 @@
+/**
+ * @file readback.h
+ * @brief Flash contents returned to the host, raw or run-length encoded
+ */
+
+#ifndef READBACK_H
+#define READBACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Copy flash contents into a reply report
+ *
+ * @param target Target to read
+ * @param addr Flash address to start at
+ * @param avail Bytes left in the requested range
+ * @param buf Report data area
+ * @param len Size of @p buf
+ * @param out_len Set to the number of bytes written to @p buf
+ * @return Number of flash bytes consumed, or negative errno
+ */
+int readback_raw(int target, uint32_t addr, uint32_t avail, uint8_t *buf,
+		 size_t len, size_t *out_len);
+
+/**
+ * @brief Run-length encode flash contents into a reply report
+ *
+ * Each report is encoded on its own as a sequence of tokens:
+ * - 0x00-0x7F: literal, the next (c + 1) bytes are copied;
+ * - 0x80-0xFF: run, ((c & 0x7F) << 8 | next) + 1 copies of the byte
+ *   after that.
+ *
+ * @param target Target to read
+ * @param addr Flash address to start at
+ * @param avail Bytes left in the requested range
+ * @param buf Report data area
+ * @param len Size of @p buf
+ * @param out_len Set to the number of bytes written to @p buf
+ * @return Number of flash bytes consumed, or negative errno
+ */
+int readback_rle(int target, uint32_t addr, uint32_t avail, uint8_t *buf,
+		 size_t len, size_t *out_len);
+
+#endif /* READBACK_H */
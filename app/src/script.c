@@ -0,0 +1,338 @@
+/**
+ * @file script.c
+ * @brief On-device execution of host-provided programming scripts
+ *
+ * A script is a compact list of steps (see FLASHER_OP_* in
+ * flasher_proto.h) uploaded once by the host. The runner sequences the
+ * steps as flash worker jobs and only involves the host to stream the
+ * data of WRITE steps, so a full programming session costs a handful of
+ * USB round-trips instead of one per command.
+ */
+
+#include "script.h"
+
+#include <string.h>
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/atomic.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
+
+#include "flash_worker.h"
+#include "flasher_proto.h"
+#include "fpga.h"
+#include "protocol.h"
+#include "sector_index.h"
+
+LOG_MODULE_REGISTER(script);
+
+/* How long range jobs may wait for a free page buffer */
+#define JOB_ALLOC_TIMEOUT_MS           1000
+
+static uint8_t script_buf[CONFIG_FLASHER_SCRIPT_SIZE];
+static size_t script_len;
+
+static K_SEM_DEFINE(run_sem, 0, 1);
+static atomic_t running;
+static struct script_status status;
+
+/**
+ * @brief Length of a step including its opcode
+ *
+ * @return Step length, or 0 for unknown opcodes
+ */
+static size_t step_len(uint8_t op)
+{
+	switch (op) {
+	case FLASHER_OP_END:
+		return 1;
+	case FLASHER_OP_ERASE:
+	case FLASHER_OP_DIGEST:
+		return 1 + 4 + 4;
+	case FLASHER_OP_WRITE:
+		return 1 + 4 + 4 + 1;
+	case FLASHER_OP_RESET:
+	case FLASHER_OP_WAIT_CDONE:
+		return 1 + 2;
+	case FLASHER_OP_SELECT:
+		return 1 + 1;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * @brief Check the flash range of an ERASE, WRITE or DIGEST step
+ *
+ * An erase covers whole 64KB blocks, so it is checked rounded up.
+ *
+ * @return 0 if the step may run, negative errno otherwise
+ */
+static int check_range(const uint8_t *step)
+{
+	uint32_t addr = sys_get_le32(&step[1]);
+	uint64_t end = addr + (uint64_t)sys_get_le32(&step[5]);
+
+	if (step[0] == FLASHER_OP_ERASE) {
+		if (addr % W25Q16_BLOCK_SIZE) {
+			return -EINVAL;
+		}
+		end = ROUND_UP(end, W25Q16_BLOCK_SIZE);
+	}
+
+	if (end > W25Q16_SIZE) {
+		return -EINVAL;
+	}
+
+	if (step[0] != FLASHER_OP_DIGEST &&
+	    sector_index_reserved(addr, (uint32_t)(end - addr))) {
+		return -EACCES;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Check that every step is known and complete
+ */
+static int validate(const uint8_t *buf, size_t len)
+{
+	size_t pc = 0;
+	int err;
+
+	while (pc < len) {
+		size_t n = step_len(buf[pc]);
+
+		if (n == 0 || pc + n > len) {
+			status.pc = pc;
+			return -EINVAL;
+		}
+
+		if (buf[pc] == FLASHER_OP_ERASE || buf[pc] == FLASHER_OP_WRITE ||
+		    buf[pc] == FLASHER_OP_DIGEST) {
+			err = check_range(&buf[pc]);
+			if (err) {
+				status.pc = pc;
+				return err;
+			}
+		}
+
+		if (buf[pc] == FLASHER_OP_END) {
+			break;
+		}
+
+		pc += n;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Wait for queued jobs and report failures from them
+ */
+static int sync_workers(void)
+{
+	(void)flash_worker_flush(K_FOREVER);
+
+	return flash_worker_failed() ? flash_worker_last_error() : 0;
+}
+
+/**
+ * @brief Run a per-target step on every selected target
+ */
+static int for_each_target(int (*fn)(int target, uint16_t arg), uint16_t arg)
+{
+	uint32_t mask = flash_worker_selected();
+	int err;
+
+	for (int i = 0; i < FLASH_TARGET_COUNT; i++) {
+		if (!(mask & BIT(i))) {
+			continue;
+		}
+
+		err = fn(i, arg);
+		if (err) {
+			return err;
+		}
+	}
+
+	return 0;
+}
+
+static int reset_target(int target, uint16_t ms)
+{
+	int err;
+
+	err = fpga_set_reset(target, true);
+	if (err || ms == 0) {
+		return err;
+	}
+
+	k_msleep(ms);
+	return fpga_set_reset(target, false);
+}
+
+static int wait_cdone(int target, uint16_t ms)
+{
+	return fpga_wait_cdone(target, K_MSEC(ms));
+}
+
+/**
+ * @brief Execute one step
+ */
+static int run_step(const uint8_t *step)
+{
+	uint32_t addr = 0;
+	uint32_t len = 0;
+	uint8_t flags = 0;
+	int err;
+
+	if (step_len(step[0]) >= 1 + 4 + 4) {
+		addr = sys_get_le32(&step[1]);
+		len = sys_get_le32(&step[5]);
+	}
+
+	switch (step[0]) {
+	case FLASHER_OP_ERASE:
+		return flash_worker_queue_range(FLASH_JOB_ERASE_64K, addr,
+						ROUND_UP(len, W25Q16_BLOCK_SIZE),
+						K_MSEC(JOB_ALLOC_TIMEOUT_MS));
+	case FLASHER_OP_WRITE:
+		/* Data must not queue up behind a pending erase */
+		err = sync_workers();
+		if (err) {
+			return err;
+		}
+		if (step[9] & FLASHER_WRITE_VERIFY) {
+			flags |= FLASH_JOB_FLAG_VERIFY;
+		}
+		err = protocol_stream_begin(FLASH_JOB_PROGRAM, flags, addr, len);
+		if (err) {
+			return err;
+		}
+		err = protocol_stream_wait(
+			K_MSEC(CONFIG_FLASHER_SCRIPT_STREAM_TIMEOUT_MS));
+		if (err) {
+			return err;
+		}
+		return sync_workers();
+	case FLASHER_OP_DIGEST:
+		err = flash_worker_queue_range(FLASH_JOB_DIGEST, addr, len,
+					       K_MSEC(JOB_ALLOC_TIMEOUT_MS));
+		if (err) {
+			return err;
+		}
+		return sync_workers();
+	case FLASHER_OP_RESET:
+		err = sync_workers();
+		if (err) {
+			return err;
+		}
+		return for_each_target(reset_target, sys_get_le16(&step[1]));
+	case FLASHER_OP_WAIT_CDONE:
+		return for_each_target(wait_cdone, sys_get_le16(&step[1]));
+	case FLASHER_OP_SELECT:
+		err = sync_workers();
+		if (err) {
+			return err;
+		}
+		return flash_worker_select(step[1]);
+	default:
+		return -ENOTSUP;
+	}
+}
+
+static void script_entry(void *p1, void *p2, void *p3)
+{
+	ARG_UNUSED(p1);
+	ARG_UNUSED(p2);
+	ARG_UNUSED(p3);
+
+	while (1) {
+		size_t pc = 0;
+		int err = 0;
+
+		k_sem_take(&run_sem, K_FOREVER);
+
+		while (pc < script_len && script_buf[pc] != FLASHER_OP_END) {
+			status.pc = pc;
+
+			err = run_step(&script_buf[pc]);
+			if (err) {
+				break;
+			}
+
+			pc += step_len(script_buf[pc]);
+		}
+
+		if (!err) {
+			err = sync_workers();
+		}
+
+		status.error = err;
+		status.state = err ? FLASHER_SCRIPT_FAILED : FLASHER_SCRIPT_DONE;
+		if (err) {
+			LOG_ERR("Script failed at step %u: %d", status.pc, err);
+		} else {
+			LOG_DBG("Script done");
+		}
+
+		atomic_clear(&running);
+	}
+}
+
+K_THREAD_DEFINE(script_tid, CONFIG_FLASHER_SCRIPT_STACK_SIZE, script_entry,
+		NULL, NULL, NULL, CONFIG_FLASHER_WORKER_PRIORITY, 0, 0);
+
+int script_load(uint32_t offset, const uint8_t *data, size_t len)
+{
+	if (atomic_get(&running)) {
+		return -EBUSY;
+	}
+
+	if (offset > sizeof(script_buf) || len > sizeof(script_buf) - offset) {
+		return -ENOMEM;
+	}
+
+	memcpy(&script_buf[offset], data, len);
+	return 0;
+}
+
+int script_run(size_t len)
+{
+	int err;
+
+	if (len > sizeof(script_buf)) {
+		return -ENOMEM;
+	}
+
+	if (!atomic_cas(&running, 0, 1)) {
+		return -EBUSY;
+	}
+
+	status.pc = 0;
+	err = validate(script_buf, len);
+	if (err) {
+		status.error = err;
+		status.state = FLASHER_SCRIPT_FAILED;
+		atomic_clear(&running);
+		return err;
+	}
+
+	script_len = len;
+	status.error = 0;
+	status.state = FLASHER_SCRIPT_RUNNING;
+	k_sem_give(&run_sem);
+
+	return 0;
+}
+
+bool script_running(void)
+{
+	return atomic_get(&running) != 0;
+}
+
+void script_get_status(struct script_status *out)
+{
+	*out = status;
+}
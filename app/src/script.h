@@ -0,0 +1,61 @@
+/**
+ * @file script.h
+ * @brief On-device execution of host-provided programming scripts
+ */
+
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Progress of the most recent script
+ */
+struct script_status {
+	/** FLASHER_SCRIPT_* state */
+	uint8_t state;
+	/** Offset of the step being executed, or that failed */
+	uint16_t pc;
+	/** 0 on success, negative errno of the failed step */
+	int error;
+};
+
+/**
+ * @brief Store part of a script
+ *
+ * @param offset Offset of @p data within the script
+ * @param data Script bytes
+ * @param len Number of bytes
+ * @return 0 on success, -EBUSY while a script runs, -ENOMEM if the script
+ *         does not fit CONFIG_FLASHER_SCRIPT_SIZE
+ */
+int script_load(uint32_t offset, const uint8_t *data, size_t len);
+
+/**
+ * @brief Validate and start the loaded script
+ *
+ * The script is checked as a whole before its first step runs, so a
+ * malformed script never touches the flash.
+ *
+ * @param len Script length in bytes
+ * @return 0 if the script was started, negative errno otherwise
+ */
+int script_run(size_t len);
+
+/**
+ * @brief Check whether a script is executing
+ *
+ * @return true while a script runs
+ */
+bool script_running(void);
+
+/**
+ * @brief Read the progress of the most recent script
+ *
+ * @param status Destination for the status
+ */
+void script_get_status(struct script_status *status);
+
+#endif /* SCRIPT_H */
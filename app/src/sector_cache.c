@@ -0,0 +1,222 @@
+/**
+ * @file sector_cache.c
+ * @brief Write-back cache of flash sectors for unaligned byte writes
+ *
+ * Each target has CONFIG_FLASHER_SECTOR_CACHE_LINES lines of one sector
+ * each, owned by the target's flash worker. Repeated writes to a sector
+ * are merged in RAM and cost one erase and program when the line is
+ * written back.
+ */
+
+#include "sector_cache.h"
+
+#include <string.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/util.h>
+
+#include "flash_worker.h"
+#include "sector_index.h"
+
+LOG_MODULE_REGISTER(sector_cache);
+
+/* Address of a line that holds no sector */
+#define LINE_EMPTY                     UINT32_MAX
+
+#define PAGES_PER_SECTOR               (W25Q16_SECTOR_SIZE / W25Q16_PAGE_SIZE)
+
+BUILD_ASSERT(PAGES_PER_SECTOR <= 32, "Page mask too small");
+
+/**
+ * @brief One cached sector
+ */
+struct cache_line {
+	uint32_t addr;
+	/* Value of the target's write counter at the last write */
+	uint32_t used;
+	/* Pages that differ from the flash */
+	uint32_t dirty;
+	/* A write set bits, so programming alone cannot store the line */
+	bool needs_erase;
+	uint8_t data[W25Q16_SECTOR_SIZE];
+};
+
+static struct cache_line lines[FLASH_TARGET_COUNT]
+			      [CONFIG_FLASHER_SECTOR_CACHE_LINES];
+static uint32_t ticks[FLASH_TARGET_COUNT];
+static bool initialized[FLASH_TARGET_COUNT];
+
+static void init_lines(int target)
+{
+	for (int i = 0; i < CONFIG_FLASHER_SECTOR_CACHE_LINES; i++) {
+		lines[target][i].addr = LINE_EMPTY;
+	}
+	initialized[target] = true;
+}
+
+static bool page_blank(const uint8_t *data)
+{
+	for (size_t i = 0; i < W25Q16_PAGE_SIZE; i++) {
+		if (data[i] != 0xFF) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * @brief Store a modified line in the flash
+ */
+static int write_back(int target, struct flash_config *dev,
+		      struct cache_line *line)
+{
+	uint32_t pages = line->dirty;
+	uint32_t addr;
+	int err;
+
+	if (!pages) {
+		return 0;
+	}
+
+	if (line->needs_erase) {
+		err = flash_sector_erase(dev, line->addr);
+		if (err) {
+			return err;
+		}
+		sector_index_erased(target, line->addr, W25Q16_SECTOR_SIZE);
+		pages = BIT_MASK(PAGES_PER_SECTOR);
+	}
+
+	for (int p = 0; p < PAGES_PER_SECTOR; p++) {
+		const uint8_t *data = &line->data[p * W25Q16_PAGE_SIZE];
+
+		if (!(pages & BIT(p)) ||
+		    (line->needs_erase && page_blank(data))) {
+			continue;
+		}
+
+		addr = line->addr + p * W25Q16_PAGE_SIZE;
+		err = flash_page_program(dev, addr, data, W25Q16_PAGE_SIZE);
+		if (err) {
+			return err;
+		}
+		sector_index_programmed(target, addr, W25Q16_PAGE_SIZE);
+	}
+
+	LOG_DBG("Target %d wrote back 0x%06X%s", target, line->addr,
+		line->needs_erase ? " with erase" : "");
+
+	line->dirty = 0;
+	line->needs_erase = false;
+	return 0;
+}
+
+/**
+ * @brief Find the line caching a sector, loading it if needed
+ */
+static int get_line(int target, struct flash_config *dev, uint32_t sector,
+		    struct cache_line **out)
+{
+	struct cache_line *victim = &lines[target][0];
+	struct cache_line *line;
+	int err;
+
+	for (int i = 0; i < CONFIG_FLASHER_SECTOR_CACHE_LINES; i++) {
+		line = &lines[target][i];
+		if (line->addr == sector) {
+			*out = line;
+			return 0;
+		}
+		if (line->addr == LINE_EMPTY ||
+		    (victim->addr != LINE_EMPTY && line->used < victim->used)) {
+			victim = line;
+		}
+	}
+
+	err = write_back(target, dev, victim);
+	if (err) {
+		return err;
+	}
+
+	victim->addr = LINE_EMPTY;
+	err = flash_read(dev, sector, victim->data, sizeof(victim->data));
+	if (err) {
+		return err;
+	}
+
+	victim->addr = sector;
+	*out = victim;
+	return 0;
+}
+
+int sector_cache_write(int target, struct flash_config *dev, uint32_t addr,
+		       const uint8_t *data, size_t len)
+{
+	uint32_t sector = ROUND_DOWN(addr, W25Q16_SECTOR_SIZE);
+	uint32_t off = addr - sector;
+	struct cache_line *line;
+	uint8_t *dst;
+	int err;
+
+	if (len == 0 || off + len > W25Q16_SECTOR_SIZE) {
+		return -EINVAL;
+	}
+
+	if (!initialized[target]) {
+		init_lines(target);
+	}
+
+	err = get_line(target, dev, sector, &line);
+	if (err) {
+		return err;
+	}
+
+	dst = &line->data[off];
+	for (size_t i = 0; i < len; i++) {
+		if (dst[i] == data[i]) {
+			continue;
+		}
+		if ((dst[i] & data[i]) != data[i]) {
+			line->needs_erase = true;
+		}
+		dst[i] = data[i];
+		line->dirty |= BIT((off + i) / W25Q16_PAGE_SIZE);
+	}
+
+	line->used = ++ticks[target];
+	return 0;
+}
+
+int sector_cache_flush(int target, struct flash_config *dev)
+{
+	int err;
+
+	if (!initialized[target]) {
+		return 0;
+	}
+
+	for (int i = 0; i < CONFIG_FLASHER_SECTOR_CACHE_LINES; i++) {
+		err = write_back(target, dev, &lines[target][i]);
+		if (err) {
+			return err;
+		}
+		lines[target][i].addr = LINE_EMPTY;
+	}
+
+	return 0;
+}
+
+bool sector_cache_dirty(int target)
+{
+	if (!initialized[target]) {
+		return false;
+	}
+
+	for (int i = 0; i < CONFIG_FLASHER_SECTOR_CACHE_LINES; i++) {
+		if (lines[target][i].dirty) {
+			return true;
+		}
+	}
+
+	return false;
+}
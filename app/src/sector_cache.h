@@ -0,0 +1,83 @@
+/**
+ * @file sector_cache.h
+ * @brief Write-back cache of flash sectors for unaligned byte writes
+ */
+
+#ifndef SECTOR_CACHE_H
+#define SECTOR_CACHE_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "w25q16_hal.h"
+
+#ifdef CONFIG_FLASHER_SECTOR_CACHE
+
+/** Idle time after which the flash worker writes modified lines back */
+#define SECTOR_CACHE_WRITEBACK_DELAY                                       \
+	K_MSEC(CONFIG_FLASHER_SECTOR_CACHE_WRITEBACK_DELAY_MS)
+
+/**
+ * @brief Merge bytes into the cached copy of their sector
+ *
+ * The sector is read into a free line first, evicting the least recently
+ * used line if none is free. Writes may start and end anywhere but must
+ * not cross a sector boundary.
+ *
+ * @param target Target index
+ * @param dev Flash of the target
+ * @param addr Flash address of the first byte
+ * @param data Bytes to write
+ * @param len Number of bytes
+ * @return 0 on success, negative errno on failure
+ */
+int sector_cache_write(int target, struct flash_config *dev, uint32_t addr,
+		       const uint8_t *data, size_t len);
+
+/**
+ * @brief Write all modified lines of a target back to the flash
+ *
+ * A sector is only erased if a write set bits that were cleared in the
+ * flash; otherwise just the modified pages are programmed. All lines are
+ * dropped afterwards, so other jobs may change the flash.
+ *
+ * @param target Target index
+ * @param dev Flash of the target
+ * @return 0 on success, negative errno on failure
+ */
+int sector_cache_flush(int target, struct flash_config *dev);
+
+/**
+ * @brief Check whether a target has lines not yet written back
+ *
+ * @param target Target index
+ * @return true if sector_cache_flush() has work to do
+ */
+bool sector_cache_dirty(int target);
+
+#else
+
+#define SECTOR_CACHE_WRITEBACK_DELAY K_FOREVER
+
+static inline int sector_cache_write(int target, struct flash_config *dev,
+				     uint32_t addr, const uint8_t *data,
+				     size_t len)
+{
+	return -ENOTSUP;
+}
+
+static inline int sector_cache_flush(int target, struct flash_config *dev)
+{
+	return 0;
+}
+
+static inline bool sector_cache_dirty(int target)
+{
+	return false;
+}
+
+#endif /* CONFIG_FLASHER_SECTOR_CACHE */
+
+#endif /* SECTOR_CACHE_H */
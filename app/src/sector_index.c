@@ -0,0 +1,346 @@
+/**
+ * @file sector_index.c
+ * @brief Persistent table of per-sector hashes of each target flash
+ *
+ * Each target keeps a CRC-32 of every sector in RAM. Erasing sets the
+ * known hash of an erased sector; programming marks sectors dirty. The
+ * flash worker rehashes dirty sectors while idle and then saves the
+ * table to a reserved flash region, so a host can compare an image
+ * against the flash without reading it back.
+ *
+ * The region is used as a ring of sector-sized slots. A save erases the
+ * next slot, programs the table and finally a header with an increasing
+ * sequence number, so an interrupted save leaves the previous copy valid.
+ */
+
+#include "sector_index.h"
+
+#include <string.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/util.h>
+
+#include "flash_worker.h"
+
+LOG_MODULE_REGISTER(sector_index);
+
+#define INDEX_MAGIC                    0x58444953 /* "SIDX" */
+#define SLOT_COUNT                     (SECTOR_INDEX_SIZE / W25Q16_SECTOR_SIZE)
+#define TABLE_SIZE                     (SECTOR_INDEX_COUNT * sizeof(uint32_t))
+
+/* The header has a page to itself, the table follows */
+#define TABLE_OFFSET                   W25Q16_PAGE_SIZE
+
+BUILD_ASSERT(SECTOR_INDEX_ADDR % W25Q16_SECTOR_SIZE == 0 &&
+	     SECTOR_INDEX_SIZE % W25Q16_SECTOR_SIZE == 0,
+	     "Index region must consist of whole sectors");
+/* With one slot a save erases the only valid copy before rewriting it */
+BUILD_ASSERT(SLOT_COUNT >= 2,
+	     "Index region needs two sectors to survive power loss");
+BUILD_ASSERT(SECTOR_INDEX_ADDR + SECTOR_INDEX_SIZE <= W25Q16_SIZE,
+	     "Index region outside the flash");
+BUILD_ASSERT(TABLE_OFFSET + TABLE_SIZE <= W25Q16_SECTOR_SIZE,
+	     "Index does not fit a slot");
+#if DT_NODE_EXISTS(DT_NODELABEL(sector_index_b))
+BUILD_ASSERT(DT_REG_ADDR(DT_NODELABEL(sector_index_b)) == SECTOR_INDEX_ADDR &&
+	     DT_REG_SIZE(DT_NODELABEL(sector_index_b)) == SECTOR_INDEX_SIZE,
+	     "Gang targets must reserve the same index region");
+#endif
+
+/**
+ * @brief Header of a saved copy
+ */
+struct index_header {
+	uint32_t magic;
+	uint32_t seq;
+	uint32_t count;
+	uint32_t crc;
+};
+
+/**
+ * @brief Index of one target
+ *
+ * Only the target's worker thread modifies it.
+ */
+struct sector_index {
+	uint32_t hash[SECTOR_INDEX_COUNT];
+	uint32_t dirty[DIV_ROUND_UP(SECTOR_INDEX_COUNT, 32)];
+	uint32_t dirty_count;
+	/* Table differs from the saved copy */
+	bool unsaved;
+	uint32_t seq;
+	uint32_t slot;
+};
+
+static struct sector_index indexes[FLASH_TARGET_COUNT];
+
+/* Hash of a sector reading all 0xFF */
+static uint32_t erased_crc;
+
+static bool in_region(uint32_t sector)
+{
+	uint32_t addr = sector * W25Q16_SECTOR_SIZE;
+
+	return addr >= SECTOR_INDEX_ADDR &&
+	       addr < SECTOR_INDEX_ADDR + SECTOR_INDEX_SIZE;
+}
+
+static void set_dirty(struct sector_index *idx, uint32_t sector)
+{
+	if (in_region(sector) || (idx->dirty[sector / 32] & BIT(sector % 32))) {
+		return;
+	}
+
+	idx->dirty[sector / 32] |= BIT(sector % 32);
+	idx->dirty_count++;
+}
+
+static void clear_dirty(struct sector_index *idx, uint32_t sector)
+{
+	if (idx->dirty[sector / 32] & BIT(sector % 32)) {
+		idx->dirty[sector / 32] &= ~BIT(sector % 32);
+		idx->dirty_count--;
+	}
+}
+
+/**
+ * @brief Compute the CRC-32 of a flash range in page-sized reads
+ */
+static int hash_range(struct flash_config *dev, uint32_t addr, uint32_t len,
+		      uint8_t *buf, uint32_t *crc)
+{
+	int err;
+
+	for (uint32_t off = 0; off < len; off += W25Q16_PAGE_SIZE) {
+		size_t chunk = MIN(len - off, W25Q16_PAGE_SIZE);
+
+		err = flash_read(dev, addr + off, buf, chunk);
+		if (err) {
+			return err;
+		}
+
+		*crc = crc32_ieee_update(*crc, buf, chunk);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Find the valid saved copy with the highest sequence number
+ *
+ * @return Slot index, or -ENOENT if there is none
+ */
+static int find_latest(struct flash_config *dev, uint32_t *seq)
+{
+	struct index_header hdr;
+	int latest = -ENOENT;
+	int err;
+
+	for (uint32_t slot = 0; slot < SLOT_COUNT; slot++) {
+		err = flash_read(dev, SECTOR_INDEX_ADDR + slot * W25Q16_SECTOR_SIZE,
+				 (uint8_t *)&hdr, sizeof(hdr));
+		if (err) {
+			return err;
+		}
+
+		if (hdr.magic != INDEX_MAGIC || hdr.count != SECTOR_INDEX_COUNT) {
+			continue;
+		}
+
+		if (latest < 0 || hdr.seq > *seq) {
+			latest = slot;
+			*seq = hdr.seq;
+		}
+	}
+
+	return latest;
+}
+
+int sector_index_load(int target, struct flash_config *dev, uint8_t *buf)
+{
+	struct sector_index *idx = &indexes[target];
+	struct index_header hdr;
+	uint32_t base;
+	uint32_t crc;
+	int slot;
+	int err;
+
+	memset(buf, 0xFF, W25Q16_PAGE_SIZE);
+	erased_crc = 0;
+	for (uint32_t off = 0; off < W25Q16_SECTOR_SIZE; off += W25Q16_PAGE_SIZE) {
+		erased_crc = crc32_ieee_update(erased_crc, buf, W25Q16_PAGE_SIZE);
+	}
+
+	memset(idx, 0, sizeof(*idx));
+
+	slot = find_latest(dev, &idx->seq);
+	if (slot >= 0) {
+		base = SECTOR_INDEX_ADDR + slot * W25Q16_SECTOR_SIZE;
+		err = flash_read(dev, base, (uint8_t *)&hdr, sizeof(hdr));
+		if (!err) {
+			err = flash_read(dev, base + TABLE_OFFSET,
+					 (uint8_t *)idx->hash, TABLE_SIZE);
+		}
+		if (err) {
+			return err;
+		}
+
+		crc = crc32_ieee((uint8_t *)idx->hash, TABLE_SIZE);
+		if (crc == hdr.crc) {
+			idx->slot = slot;
+			LOG_INF("Target %d: index #%u loaded", target, idx->seq);
+			return 0;
+		}
+
+		LOG_WRN("Target %d: index #%u corrupt", target, idx->seq);
+	}
+
+	/* Nothing usable was saved, hash the whole flash while idle */
+	memset(idx->hash, 0, sizeof(idx->hash));
+	for (uint32_t s = 0; s < SECTOR_INDEX_COUNT; s++) {
+		set_dirty(idx, s);
+	}
+	idx->unsaved = true;
+	idx->slot = SLOT_COUNT - 1;
+
+	return 0;
+}
+
+void sector_index_programmed(int target, uint32_t addr, uint32_t len)
+{
+	struct sector_index *idx = &indexes[target];
+
+	if (len == 0) {
+		return;
+	}
+
+	for (uint32_t s = addr / W25Q16_SECTOR_SIZE;
+	     s <= (addr + len - 1) / W25Q16_SECTOR_SIZE &&
+	     s < SECTOR_INDEX_COUNT; s++) {
+		set_dirty(idx, s);
+	}
+}
+
+void sector_index_erased(int target, uint32_t addr, uint32_t size)
+{
+	struct sector_index *idx = &indexes[target];
+
+	for (uint32_t s = addr / W25Q16_SECTOR_SIZE;
+	     s < (addr + size) / W25Q16_SECTOR_SIZE && s < SECTOR_INDEX_COUNT;
+	     s++) {
+		if (in_region(s)) {
+			continue;
+		}
+		clear_dirty(idx, s);
+		idx->hash[s] = erased_crc;
+		idx->unsaved = true;
+	}
+}
+
+bool sector_index_pending(int target)
+{
+	struct sector_index *idx = &indexes[target];
+
+	return idx->dirty_count || idx->unsaved;
+}
+
+/**
+ * @brief Write the table into the next slot
+ */
+static int save(struct sector_index *idx, struct flash_config *dev)
+{
+	struct index_header hdr = {
+		.magic = INDEX_MAGIC,
+		.seq = idx->seq + 1,
+		.count = SECTOR_INDEX_COUNT,
+		.crc = crc32_ieee((uint8_t *)idx->hash, TABLE_SIZE),
+	};
+	uint32_t slot = (idx->slot + 1) % SLOT_COUNT;
+	uint32_t base = SECTOR_INDEX_ADDR + slot * W25Q16_SECTOR_SIZE;
+	const uint8_t *table = (const uint8_t *)idx->hash;
+	int err;
+
+	err = flash_sector_erase(dev, base);
+	if (err) {
+		return err;
+	}
+
+	for (uint32_t off = 0; off < TABLE_SIZE; off += W25Q16_PAGE_SIZE) {
+		err = flash_page_program(dev, base + TABLE_OFFSET + off,
+					 &table[off],
+					 MIN(TABLE_SIZE - off, W25Q16_PAGE_SIZE));
+		if (err) {
+			return err;
+		}
+	}
+
+	/* The header makes the copy valid, so it goes last */
+	err = flash_page_program(dev, base, (const uint8_t *)&hdr, sizeof(hdr));
+	if (err) {
+		return err;
+	}
+
+	idx->seq = hdr.seq;
+	idx->slot = slot;
+	idx->unsaved = false;
+
+	LOG_DBG("Index #%u saved to slot %u", idx->seq, slot);
+	return 0;
+}
+
+int sector_index_sync_step(int target, struct flash_config *dev, uint8_t *buf)
+{
+	struct sector_index *idx = &indexes[target];
+	uint32_t crc = 0;
+	int err;
+
+	if (idx->dirty_count == 0) {
+		return idx->unsaved ? save(idx, dev) : 0;
+	}
+
+	for (uint32_t s = 0; s < SECTOR_INDEX_COUNT; s++) {
+		if (!(idx->dirty[s / 32] & BIT(s % 32))) {
+			continue;
+		}
+
+		err = hash_range(dev, s * W25Q16_SECTOR_SIZE,
+				 W25Q16_SECTOR_SIZE, buf, &crc);
+		if (err) {
+			return err;
+		}
+
+		clear_dirty(idx, s);
+		if (idx->hash[s] != crc) {
+			idx->hash[s] = crc;
+			idx->unsaved = true;
+		}
+		break;
+	}
+
+	return 1;
+}
+
+int sector_index_read(int target, uint32_t offset, uint8_t *buf, size_t len)
+{
+	struct sector_index *idx = &indexes[target];
+
+	if (target < 0 || target >= FLASH_TARGET_COUNT ||
+	    offset % sizeof(uint32_t) || len % sizeof(uint32_t) ||
+	    offset + len > TABLE_SIZE) {
+		return -EINVAL;
+	}
+
+	for (size_t i = 0; i < len; i += sizeof(uint32_t)) {
+		sys_put_le32(idx->hash[(offset + i) / sizeof(uint32_t)],
+			     &buf[i]);
+	}
+
+	return 0;
+}
+
+bool sector_index_reserved(uint32_t addr, uint32_t len)
+{
+	return addr < SECTOR_INDEX_ADDR + SECTOR_INDEX_SIZE &&
+	       addr + (uint64_t)len > SECTOR_INDEX_ADDR;
+}
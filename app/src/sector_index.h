@@ -0,0 +1,147 @@
+/**
+ * @file sector_index.h
+ * @brief Persistent table of per-sector hashes of each target flash
+ */
+
+#ifndef SECTOR_INDEX_H
+#define SECTOR_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <zephyr/devicetree.h>
+
+#include "w25q16_hal.h"
+
+/** Number of sectors covered by the index */
+#define SECTOR_INDEX_COUNT (W25Q16_SIZE / W25Q16_SECTOR_SIZE)
+
+#ifdef CONFIG_FLASHER_SECTOR_INDEX
+
+/** Flash region reserved for storing the index */
+#define SECTOR_INDEX_NODE DT_NODELABEL(sector_index)
+#define SECTOR_INDEX_ADDR DT_REG_ADDR(SECTOR_INDEX_NODE)
+#define SECTOR_INDEX_SIZE DT_REG_SIZE(SECTOR_INDEX_NODE)
+
+/** Idle time after which the flash worker syncs the index */
+#define SECTOR_INDEX_SYNC_DELAY K_MSEC(CONFIG_FLASHER_SECTOR_INDEX_SYNC_DELAY_MS)
+
+/**
+ * @brief Load the most recent saved index of a target
+ *
+ * Sectors without a valid saved hash are marked for rehashing.
+ *
+ * @param target Target index
+ * @param dev Flash of the target
+ * @param buf Scratch buffer of at least one page
+ * @return 0 on success, negative errno on failure
+ */
+int sector_index_load(int target, struct flash_config *dev, uint8_t *buf);
+
+/**
+ * @brief Note that a range was programmed
+ *
+ * The covered sectors are rehashed by the next sync.
+ *
+ * @param target Target index
+ * @param addr Start of the range
+ * @param len Length of the range in bytes
+ */
+void sector_index_programmed(int target, uint32_t addr, uint32_t len);
+
+/**
+ * @brief Note that a range was erased
+ *
+ * Erased sectors have a known hash and need no rehashing.
+ *
+ * @param target Target index
+ * @param addr Start of the range, sector aligned
+ * @param size Size of the range in bytes
+ */
+void sector_index_erased(int target, uint32_t addr, uint32_t size);
+
+/**
+ * @brief Check whether the index of a target needs a sync
+ *
+ * @param target Target index
+ * @return true if sectors must be rehashed or the table saved
+ */
+bool sector_index_pending(int target);
+
+/**
+ * @brief Do one bounded piece of sync work
+ *
+ * Rehashes one sector, or saves the table once no sector is left.
+ *
+ * @param target Target index
+ * @param dev Flash of the target
+ * @param buf Scratch buffer of at least one page
+ * @return 1 if more work is left, 0 when in sync, negative errno on failure
+ */
+int sector_index_sync_step(int target, struct flash_config *dev, uint8_t *buf);
+
+/**
+ * @brief Copy part of the index, as little-endian CRC-32 values
+ *
+ * @param target Target index
+ * @param offset Byte offset into the table
+ * @param buf Destination buffer
+ * @param len Number of bytes to copy
+ * @return 0 on success, -EINVAL if the range is outside the table
+ */
+int sector_index_read(int target, uint32_t offset, uint8_t *buf, size_t len);
+
+/**
+ * @brief Check whether a range overlaps the reserved index region
+ *
+ * @param addr Start of the range
+ * @param len Length of the range in bytes
+ * @return true if the host must not touch the range
+ */
+bool sector_index_reserved(uint32_t addr, uint32_t len);
+
+#else
+
+#define SECTOR_INDEX_SYNC_DELAY K_FOREVER
+
+static inline int sector_index_load(int target, struct flash_config *dev,
+				    uint8_t *buf)
+{
+	return 0;
+}
+
+static inline void sector_index_programmed(int target, uint32_t addr,
+					   uint32_t len)
+{
+}
+
+static inline void sector_index_erased(int target, uint32_t addr,
+				       uint32_t size)
+{
+}
+
+static inline bool sector_index_pending(int target)
+{
+	return false;
+}
+
+static inline int sector_index_sync_step(int target, struct flash_config *dev,
+					 uint8_t *buf)
+{
+	return 0;
+}
+
+static inline int sector_index_read(int target, uint32_t offset, uint8_t *buf,
+				    size_t len)
+{
+	return -ENOTSUP;
+}
+
+static inline bool sector_index_reserved(uint32_t addr, uint32_t len)
+{
+	return false;
+}
+
+#endif /* CONFIG_FLASHER_SECTOR_INDEX */
+
+#endif /* SECTOR_INDEX_H */
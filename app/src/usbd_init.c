@@ -11,6 +11,12 @@
 #include <zephyr/usb/bos.h>
 #include <zephyr/usb/usbd.h>
 
+#ifdef CONFIG_FLASHER_MSC
+#include <zephyr/usb/class/usbd_msc.h>
+
+#include "msc_volume.h"
+#endif
+
 LOG_MODULE_REGISTER(usbd_config);
 
 /* USB Device Identification */
@@ -27,13 +33,20 @@ LOG_MODULE_REGISTER(usbd_config);
 /**
  * @brief USB classes to exclude from registration
  * 
- * By default, do not register the DFU mode instance
+ * By default, do not register the DFU mode instance; it lives in its own
+ * device context (see flasher_usbd_init_dfu()).
  */
 static const char *const class_blocklist[] = {
 	"dfu_dfu",
 	NULL,
 };
 
+#ifdef CONFIG_FLASHER_MSC
+/* Drag-and-drop volume backed by the target flash */
+USBD_DEFINE_MSC_LUN(flasher_volume, MSC_VOLUME_DISK_NAME, "ICE40DK",
+		    "Flash Volume", "1.0");
+#endif
+
 /* Instantiate USB device context */
 USBD_DEVICE_DEFINE(flasher_usbd,
 		   DEVICE_DT_GET(DT_NODELABEL(zephyr_udc0)),
@@ -44,6 +57,8 @@ USBD_DEVICE_DEFINE(flasher_usbd,
 USBD_DESC_LANG_DEFINE(lang_desc);
 USBD_DESC_MANUFACTURER_DEFINE(mfr_desc, MANUFACTURER_STRING);
 USBD_DESC_PRODUCT_DEFINE(product_desc, PRODUCT_STRING);
+/* Generated from the MCU unique ID (hwinfo), so each flasher is distinct */
+USBD_DESC_SERIAL_NUMBER_DEFINE(sn_desc);
 
 USBD_DESC_CONFIG_DEFINE(fs_cfg_desc, "FS Configuration");
 USBD_DESC_CONFIG_DEFINE(hs_cfg_desc, "HS Configuration");
@@ -123,6 +138,13 @@ static struct usbd_context *setup_usb_device(usbd_msg_cb_t msg_cb)
 		return NULL;
 	}
 
+	/* Add serial number descriptor */
+	err = usbd_add_descriptor(&flasher_usbd, &sn_desc);
+	if (err) {
+		LOG_ERR("Failed to add serial number descriptor: %d", err);
+		return NULL;
+	}
+
 	/* Configure High-Speed if supported */
 	if (USBD_SUPPORTS_HIGH_SPEED &&
 	    usbd_caps_speed(&flasher_usbd) == USBD_SPEED_HS) {
@@ -193,3 +215,71 @@ struct usbd_context *flasher_usbd_init_device(usbd_msg_cb_t msg_cb)
 	return &flasher_usbd;
 }
 
+#ifdef CONFIG_FLASHER_DFU
+/*
+ * DFU mode device. It shares the controller with the runtime device and
+ * is only initialized after the runtime device was shut down.
+ */
+USBD_DEVICE_DEFINE(flasher_dfu_usbd,
+		   DEVICE_DT_GET(DT_NODELABEL(zephyr_udc0)),
+		   ZEPHYR_PROJECT_USB_VID,
+		   ZEPHYR_PROJECT_USB_PID);
+
+USBD_DESC_LANG_DEFINE(dfu_lang_desc);
+USBD_DESC_MANUFACTURER_DEFINE(dfu_mfr_desc, MANUFACTURER_STRING);
+USBD_DESC_PRODUCT_DEFINE(dfu_product_desc, PRODUCT_STRING " (DFU)");
+USBD_DESC_SERIAL_NUMBER_DEFINE(dfu_sn_desc);
+USBD_DESC_CONFIG_DEFINE(dfu_cfg_desc, "DFU Configuration");
+
+USBD_CONFIGURATION_DEFINE(dfu_config, config_attributes,
+			  USB_MAX_POWER_MA, &dfu_cfg_desc);
+
+struct usbd_context *flasher_usbd_init_dfu(usbd_msg_cb_t msg_cb)
+{
+	struct usbd_desc_node *const descs[] = {
+		&dfu_lang_desc, &dfu_mfr_desc, &dfu_product_desc, &dfu_sn_desc,
+	};
+	int err;
+
+	for (size_t i = 0; i < ARRAY_SIZE(descs); i++) {
+		err = usbd_add_descriptor(&flasher_dfu_usbd, descs[i]);
+		if (err) {
+			LOG_ERR("Failed to add DFU descriptor: %d", err);
+			return NULL;
+		}
+	}
+
+	/* DFU transfers are control transfers, full speed is sufficient */
+	err = usbd_add_configuration(&flasher_dfu_usbd, USBD_SPEED_FS,
+				     &dfu_config);
+	if (err) {
+		LOG_ERR("Failed to add DFU configuration: %d", err);
+		return NULL;
+	}
+
+	err = usbd_register_class(&flasher_dfu_usbd, "dfu_dfu",
+				  USBD_SPEED_FS, 1);
+	if (err) {
+		LOG_ERR("Failed to register DFU class: %d", err);
+		return NULL;
+	}
+
+	usbd_device_set_code_triple(&flasher_dfu_usbd, USBD_SPEED_FS, 0, 0, 0);
+
+	if (msg_cb != NULL) {
+		err = usbd_msg_register_cb(&flasher_dfu_usbd, msg_cb);
+		if (err) {
+			LOG_ERR("Failed to register message callback: %d", err);
+			return NULL;
+		}
+	}
+
+	err = usbd_init(&flasher_dfu_usbd);
+	if (err) {
+		LOG_ERR("Failed to initialize DFU device: %d", err);
+		return NULL;
+	}
+
+	return &flasher_dfu_usbd;
+}
+#endif /* CONFIG_FLASHER_DFU */
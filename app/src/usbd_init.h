@@ -20,5 +20,16 @@
  */
 struct usbd_context *flasher_usbd_init_device(usbd_msg_cb_t msg_cb);
 
+/**
+ * @brief Initialize the DFU mode USB device
+ *
+ * The DFU mode device only exposes the DFU interface. It must not be
+ * initialized while the runtime device is.
+ *
+ * @param msg_cb Optional message callback for USB events (can be NULL)
+ * @return Pointer to the initialized USB context, or NULL on failure
+ */
+struct usbd_context *flasher_usbd_init_dfu(usbd_msg_cb_t msg_cb);
+
 #endif /* USBD_INIT_H */
 
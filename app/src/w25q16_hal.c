@@ -5,8 +5,9 @@
 
 #include "w25q16_hal.h"
 
-#include <string.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/util.h>
 
 LOG_MODULE_REGISTER(w25q16_hal);
 
@@ -17,27 +18,333 @@ LOG_MODULE_REGISTER(w25q16_hal);
 #define W25Q16_CMD_POWER_DOWN          0xB9
 #define W25Q16_CMD_READ_JEDEC_ID       0x9F
 #define W25Q16_CMD_READ_DATA           0x03
+#define W25Q16_CMD_FAST_READ           0x0B
 #define W25Q16_CMD_PAGE_PROGRAM        0x02
 #define W25Q16_CMD_WRITE_ENABLE        0x06
 #define W25Q16_CMD_READ_STATUS_REG1    0x05
 #define W25Q16_CMD_CHIP_ERASE          0xC7
 #define W25Q16_CMD_BLOCK_ERASE_64K     0xD8
+#define W25Q16_CMD_SECTOR_ERASE        0x20
+#define W25Q16_CMD_READ_STATUS_REG2    0x35
+#define W25Q16_CMD_WRITE_STATUS_REG1   0x01
+#define W25Q16_CMD_WRITE_STATUS_REG2   0x31
+#define W25Q16_CMD_QUAD_PAGE_PROGRAM   0x32
+#define W25Q16_CMD_QUAD_OUTPUT_READ    0x6B
+#define W25Q16_CMD_QUAD_IO_READ        0xEB
 
 /* Status Register Bits */
 #define W25Q16_STATUS_BUSY             0x01
-
-/* Timing delays */
-#define RESET_DELAY_MS                 10
-#define POWER_DOWN_RELEASE_DELAY_MS    1
-#define BUSY_POLL_DELAY_MS             1
+#define W25Q16_STATUS2_QE              0x02
+
+/* Timing delays (datasheet maxima, from the devicetree) */
+#define T_PUW_MS             DT_PROP(W25Q16_NODE, power_up_write_ms)
+#define T_RES1_US            DT_PROP(W25Q16_NODE, release_power_down_us)
+#define T_DP_US              DT_PROP(W25Q16_NODE, power_down_us)
+#define T_PP_MAX_US          DT_PROP(W25Q16_NODE, page_program_max_us)
+#define T_SE_MAX_US          (DT_PROP(W25Q16_NODE, sector_erase_max_ms) * 1000U)
+#define T_BE_MAX_US          (DT_PROP(W25Q16_NODE, block_erase_max_ms) * 1000U)
+#define T_CE_MAX_US          (DT_PROP(W25Q16_NODE, chip_erase_max_ms) * 1000U)
+#define T_W_MAX_US           (DT_PROP(W25Q16_NODE, write_status_max_ms) * 1000U)
+
+/* Busy polling: a fraction of the expected maximum, but not too often */
+#define BUSY_POLL_DIVISOR              32
+#define BUSY_POLL_MIN_US               50
+
+/* Use Fast Read only where the clock is too fast for Read Data */
+#if DT_PROP(W25Q16_NODE, fast_read) && \
+	DT_PROP(W25Q16_NODE, spi_max_frequency) > \
+	DT_PROP(W25Q16_NODE, read_max_frequency)
+#define READ_CMD                       W25Q16_CMD_FAST_READ
+#define READ_DUMMY_BYTES               1
+#else
+#define READ_CMD                       W25Q16_CMD_READ_DATA
+#define READ_DUMMY_BYTES               0
+#endif
+
+/* Data lanes requested by the devicetree */
+#ifdef CONFIG_FLASHER_QUAD_SPI
+#define QUAD_PROGRAM        (DT_PROP(W25Q16_NODE, spi_tx_bus_width) == 4)
+#define QUAD_READ           (DT_PROP(W25Q16_NODE, spi_rx_bus_width) == 4)
+#else
+#define QUAD_PROGRAM        0
+#define QUAD_READ           0
+#endif
+
+/* Quad I/O Fast Read also sends the address on four lanes */
+#define QUAD_IO_READ        (QUAD_READ && QUAD_PROGRAM)
+/* Address, mode byte M7-0 and four dummy clocks, all on four lanes */
+#define QUAD_IO_HEADER_SIZE 6
+/* Continuous read mode stays off unless M5-4 is 10b */
+#define QUAD_IO_MODE        0xFF
+
+/* Command sizes and erase opcodes assume this geometry */
+BUILD_ASSERT(W25Q16_SIZE <= BIT(24), "3-byte addressing only");
+BUILD_ASSERT(W25Q16_BLOCK_SIZE == 0x10000, "0xD8 erases 64KB blocks");
+BUILD_ASSERT(W25Q16_BLOCK_SIZE % W25Q16_SECTOR_SIZE == 0 &&
+	     W25Q16_SECTOR_SIZE % W25Q16_PAGE_SIZE == 0,
+	     "Inconsistent flash geometry");
+
+/*
+ * All targets are built for a single part: geometry, timing, read command
+ * and lanes above come from the first instance and drive every target.
+ */
+#if DT_NUM_INST_STATUS_OKAY(winbond_w25q16) > 1
+#define SAME_PROP(prop) \
+	(DT_PROP(DT_INST(0, winbond_w25q16), prop) == \
+	 DT_PROP(DT_INST(1, winbond_w25q16), prop))
+BUILD_ASSERT(SAME_PROP(flash_size) && SAME_PROP(page_size) &&
+	     SAME_PROP(sector_size) && SAME_PROP(block_size) &&
+	     SAME_PROP(spi_max_frequency) && SAME_PROP(spi_tx_bus_width) &&
+	     SAME_PROP(spi_rx_bus_width),
+	     "Gang targets must use the same flash part");
+BUILD_ASSERT(SAME_PROP(power_up_write_ms) &&
+	     SAME_PROP(release_power_down_us) && SAME_PROP(power_down_us) &&
+	     SAME_PROP(page_program_max_us) &&
+	     SAME_PROP(sector_erase_max_ms) &&
+	     SAME_PROP(block_erase_max_ms) && SAME_PROP(chip_erase_max_ms) &&
+	     SAME_PROP(write_status_max_ms),
+	     "Gang targets must use the same flash timing");
+BUILD_ASSERT(SAME_PROP(fast_read) && SAME_PROP(read_max_frequency) &&
+	     SAME_PROP(qe_two_byte_write),
+	     "Gang targets must use the same read and quad setup");
+#endif
 
 /* Buffer sizes */
 #define JEDEC_ID_SIZE                  3
 #define PAGE_WRITE_SIZE                64
 
+#ifdef CONFIG_FLASHER_SPI_TRACE
+
+#define TRACE_ENTRIES                  CONFIG_FLASHER_SPI_TRACE_ENTRIES
+
+static struct flash_trace_entry trace_ring[TRACE_ENTRIES];
+/* Sequence number of the next entry and of the oldest kept one */
+static uint32_t trace_next;
+static uint32_t trace_first;
+static struct k_spinlock trace_lock;
+
+#ifdef CONFIG_TIMER_HAS_64BIT_CYCLE_COUNTER
+static uint32_t trace_now(void)
+{
+	return (uint32_t)k_cyc_to_us_floor64(k_cycle_get_64());
+}
+#else
+/*
+ * Extend the 32-bit cycle counter at every transaction. An idle gap of
+ * more than one counter wrap shows up shortened by whole wraps.
+ */
+static uint64_t trace_cycles;
+static uint32_t trace_last_cycle;
+
+static uint32_t trace_now(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&trace_lock);
+	uint32_t now = k_cycle_get_32();
+	uint64_t cycles;
+
+	trace_cycles += now - trace_last_cycle;
+	trace_last_cycle = now;
+	cycles = trace_cycles;
+	k_spin_unlock(&trace_lock, key);
+
+	return (uint32_t)k_cyc_to_us_floor64(cycles);
+}
+#endif
+
+static bool has_addr(uint8_t opcode)
+{
+	switch (opcode) {
+	case W25Q16_CMD_READ_DATA:
+	case W25Q16_CMD_FAST_READ:
+	case W25Q16_CMD_PAGE_PROGRAM:
+	case W25Q16_CMD_BLOCK_ERASE_64K:
+	case W25Q16_CMD_SECTOR_ERASE:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static void trace_record(struct flash_config *dev, uint8_t opcode,
+			 uint32_t addr, size_t len, uint32_t start, int err)
+{
+	uint32_t end = trace_now();
+	struct flash_trace_entry *e;
+	k_spinlock_key_t key;
+
+	key = k_spin_lock(&trace_lock);
+	e = &trace_ring[trace_next % TRACE_ENTRIES];
+	e->start_us = start;
+	e->end_us = end;
+	e->opcode = opcode;
+	e->addr = addr;
+	e->len = (uint16_t)MIN(len, UINT16_MAX);
+	e->target = dev->target;
+	e->failed = err != 0;
+	trace_next++;
+	if (trace_next - trace_first > TRACE_ENTRIES) {
+		trace_first = trace_next - TRACE_ENTRIES;
+	}
+	k_spin_unlock(&trace_lock, key);
+}
+
+static void trace_spi(struct flash_config *dev, const struct spi_buf_set *tx,
+		      uint32_t start, int err)
+{
+	const uint8_t *cmd = tx->buffers[0].buf;
+	size_t len = 0;
+
+	for (size_t i = 0; i < tx->count; i++) {
+		len += tx->buffers[i].len;
+	}
+
+	trace_record(dev, cmd[0],
+		     (has_addr(cmd[0]) && tx->buffers[0].len >= 4) ?
+		     sys_get_be24(&cmd[1]) : FLASH_TRACE_NO_ADDR,
+		     len, start, err);
+}
+
+void flash_trace_bounds(uint32_t *first, uint32_t *next)
+{
+	k_spinlock_key_t key = k_spin_lock(&trace_lock);
+
+	*first = trace_first;
+	*next = trace_next;
+	k_spin_unlock(&trace_lock, key);
+}
+
+int flash_trace_get(uint32_t seq, struct flash_trace_entry *entry)
+{
+	k_spinlock_key_t key = k_spin_lock(&trace_lock);
+	int err = -ENOENT;
+
+	if (seq - trace_first < trace_next - trace_first) {
+		*entry = trace_ring[seq % TRACE_ENTRIES];
+		err = 0;
+	}
+	k_spin_unlock(&trace_lock, key);
+
+	return err;
+}
+
+void flash_trace_clear(void)
+{
+	k_spinlock_key_t key = k_spin_lock(&trace_lock);
+
+	trace_first = trace_next;
+	k_spin_unlock(&trace_lock, key);
+}
+
+#else
+
+static inline uint32_t trace_now(void)
+{
+	return 0;
+}
+
+static inline void trace_record(struct flash_config *dev, uint8_t opcode,
+				uint32_t addr, size_t len, uint32_t start,
+				int err)
+{
+}
+
+static inline void trace_spi(struct flash_config *dev,
+			     const struct spi_buf_set *tx, uint32_t start,
+			     int err)
+{
+}
+
+#endif /* CONFIG_FLASHER_SPI_TRACE */
+
+/**
+ * @brief Run one SPI transaction, recording it in the trace
+ *
+ * @param dev Flash device
+ * @param tx Bytes to send, starting with the opcode
+ * @param rx Bytes to receive, or NULL for a write-only transaction
+ * @return 0 on success, negative errno from the SPI driver
+ */
+static int flash_spi(struct flash_config *dev, const struct spi_buf_set *tx,
+		     const struct spi_buf_set *rx)
+{
+	uint32_t start = trace_now();
+	int err;
+
+	if (rx) {
+		err = spi_transceive_dt(&dev->dev, tx, rx);
+	} else {
+		err = spi_write_dt(&dev->dev, tx);
+	}
+
+	trace_spi(dev, tx, start, err);
+	return err;
+}
+
+#ifdef CONFIG_FLASHER_QUAD_SPI
+/**
+ * @brief Run one transaction whose header goes out on a single lane and
+ *        whose data moves on four
+ *
+ * The chip select stays asserted between the two phases, which takes a
+ * GPIO chip select (checked by flash_quad_setup).
+ *
+ * @param dev Flash device
+ * @param cmd Single-lane header, starting with the opcode
+ * @param cmd_len Header length
+ * @param tx Bytes to send on four lanes, or NULL
+ * @param rx Bytes to receive on four lanes after @p tx, or NULL
+ * @param addr Flash address, for the trace
+ * @return 0 on success, negative errno from the SPI driver
+ */
+static int flash_spi_quad(struct flash_config *dev, const uint8_t *cmd,
+			  size_t cmd_len, const struct spi_buf_set *tx,
+			  const struct spi_buf_set *rx, uint32_t addr)
+{
+	uint32_t start = trace_now();
+	size_t len = cmd_len;
+	int err;
+
+	struct spi_buf hdr_buf = {
+		.buf = (uint8_t *)cmd,
+		.len = cmd_len,
+	};
+	struct spi_buf_set hdr_set = {
+		.buffers = &hdr_buf,
+		.count = 1,
+	};
+
+	err = spi_write(dev->dev.bus, &dev->hold_cfg, &hdr_set);
+	if (!err) {
+		err = spi_transceive(dev->dev.bus, &dev->quad_cfg, tx, rx);
+	}
+	if (err) {
+		/* Deassert the chip select held by the header phase */
+		spi_release(dev->dev.bus, &dev->hold_cfg);
+	}
+
+	for (size_t i = 0; tx && i < tx->count; i++) {
+		len += tx->buffers[i].len;
+	}
+	for (size_t i = 0; rx && i < rx->count; i++) {
+		len += rx->buffers[i].len;
+	}
+	trace_record(dev, cmd[0], addr, len, start, err);
+
+	return err;
+}
+#else
+static inline int flash_spi_quad(struct flash_config *dev, const uint8_t *cmd,
+				 size_t cmd_len, const struct spi_buf_set *tx,
+				 const struct spi_buf_set *rx, uint32_t addr)
+{
+	return -ENOTSUP;
+}
+#endif /* CONFIG_FLASHER_QUAD_SPI */
+
 int flash_reset(struct flash_config *dev)
 {
 	int err;
+	int64_t uptime;
 	uint8_t tx_cmd[8] = {0xFF};
 
 	struct spi_buf tx_buf = {
@@ -50,27 +357,25 @@ int flash_reset(struct flash_config *dev)
 	};
 
 	/* Send dummy bytes to reset SPI interface */
-	err = spi_write_dt(&dev->dev, &tx_set);
+	err = flash_spi(dev, &tx_set, NULL);
 	if (err) {
 		LOG_ERR("Failed to reset SPI interface: %d", err);
 		return err;
 	}
 
-	k_msleep(RESET_DELAY_MS);
-
-	/* Release from power-down mode */
-	uint8_t power_on_cmd = W25Q16_CMD_RELEASE_POWER_DOWN;
-	tx_buf.buf = &power_on_cmd;
-	tx_buf.len = 1;
+	/* Writes are ignored until tPUW after power-up, which shares our rail */
+	uptime = k_uptime_get();
+	if (uptime < T_PUW_MS) {
+		k_msleep(T_PUW_MS - uptime);
+	}
 
-	err = spi_write_dt(&dev->dev, &tx_set);
+	/* The device may have been left in power-down mode */
+	dev->powered_down = true;
+	err = flash_release_power_down(dev);
 	if (err) {
-		LOG_ERR("Failed to release from power down: %d", err);
 		return err;
 	}
 
-	k_msleep(POWER_DOWN_RELEASE_DELAY_MS);
-
 	LOG_DBG("Flash reset completed");
 	return 0;
 }
@@ -89,16 +394,54 @@ int flash_power_down(struct flash_config *dev)
 		.count = 1,
 	};
 
-	err = spi_write_dt(&dev->dev, &tx_set);
+	if (dev->powered_down) {
+		return 0;
+	}
+
+	err = flash_spi(dev, &tx_set, NULL);
 	if (err) {
 		LOG_ERR("Failed to enter power down: %d", err);
 		return err;
 	}
 
+	k_busy_wait(T_DP_US);
+	dev->powered_down = true;
+
 	LOG_DBG("Flash entered power-down mode");
 	return 0;
 }
 
+int flash_release_power_down(struct flash_config *dev)
+{
+	int err;
+	uint8_t tx_cmd = W25Q16_CMD_RELEASE_POWER_DOWN;
+
+	struct spi_buf tx_buf = {
+		.buf = &tx_cmd,
+		.len = sizeof(tx_cmd),
+	};
+	struct spi_buf_set tx_set = {
+		.buffers = &tx_buf,
+		.count = 1,
+	};
+
+	if (!dev->powered_down) {
+		return 0;
+	}
+
+	err = flash_spi(dev, &tx_set, NULL);
+	if (err) {
+		LOG_ERR("Failed to release from power down: %d", err);
+		return err;
+	}
+
+	k_busy_wait(T_RES1_US);
+	dev->powered_down = false;
+
+	LOG_DBG("Flash released from power-down mode");
+	return 0;
+}
+
 int flash_read_id(struct flash_config *dev)
 {
 	int err;
@@ -123,7 +466,7 @@ int flash_read_id(struct flash_config *dev)
 		.count = 1,
 	};
 
-	err = spi_transceive_dt(&dev->dev, &tx_set, &rx_set);
+	err = flash_spi(dev, &tx_set, &rx_set);
 	if (err) {
 		LOG_ERR("Failed to read JEDEC ID: %d", err);
 		return err;
@@ -152,13 +495,57 @@ int flash_chip_erase(struct flash_config *dev)
 		return err;
 	}
 
-	err = spi_write_dt(&dev->dev, &tx_set);
+	err = flash_spi(dev, &tx_set, NULL);
 	if (err) {
 		LOG_ERR("Chip erase failed: %d", err);
 		return err;
 	}
 
-	LOG_DBG("Chip erase initiated");
+	err = flash_wait_busy(dev, T_CE_MAX_US);
+	if (err) {
+		return err;
+	}
+
+	LOG_DBG("Erased chip");
+	return 0;
+}
+
+int flash_sector_erase(struct flash_config *dev, uint32_t addr_start)
+{
+	int err;
+	uint8_t tx_cmd[4];
+
+	tx_cmd[0] = W25Q16_CMD_SECTOR_ERASE;
+	tx_cmd[1] = (uint8_t)((addr_start >> 16) & 0xFF);
+	tx_cmd[2] = (uint8_t)((addr_start >> 8) & 0xFF);
+	tx_cmd[3] = (uint8_t)(addr_start & 0xFF);
+
+	struct spi_buf tx_buf = {
+		.buf = tx_cmd,
+		.len = sizeof(tx_cmd),
+	};
+	struct spi_buf_set tx_set = {
+		.buffers = &tx_buf,
+		.count = 1,
+	};
+
+	err = flash_write_enable(dev);
+	if (err) {
+		return err;
+	}
+
+	err = flash_spi(dev, &tx_set, NULL);
+	if (err) {
+		LOG_ERR("Sector erase failed: %d", err);
+		return err;
+	}
+
+	err = flash_wait_busy(dev, T_SE_MAX_US);
+	if (err) {
+		return err;
+	}
+
+	LOG_DBG("Erased sector at 0x%06X", addr_start);
 	return 0;
 }
 
@@ -186,21 +573,30 @@ int flash_block_erase_64k(struct flash_config *dev, uint32_t addr_start)
 		return err;
 	}
 
-	err = spi_write_dt(&dev->dev, &tx_set);
+	err = flash_spi(dev, &tx_set, NULL);
 	if (err) {
 		LOG_ERR("64KB block erase failed: %d", err);
 		return err;
 	}
 
-	LOG_DBG("64KB block erase at 0x%06X initiated", addr_start);
+	err = flash_wait_busy(dev, T_BE_MAX_US);
+	if (err) {
+		return err;
+	}
+
+	LOG_DBG("Erased 64KB block at 0x%06X", addr_start);
 	return 0;
 }
 
-int flash_wait_busy(struct flash_config *dev)
+int flash_wait_busy(struct flash_config *dev, uint32_t max_us)
 {
 	int err;
 	uint8_t tx_cmd[2] = {W25Q16_CMD_READ_STATUS_REG1, 0x00};
 	uint8_t rx_data[2] = {0};
+	uint32_t poll_us = MAX(max_us / BUSY_POLL_DIVISOR, BUSY_POLL_MIN_US);
+	/* k_usleep() rounds up to ticks, so sleeps cannot be summed up */
+	int64_t deadline = k_uptime_ticks() + k_us_to_ticks_ceil64(max_us);
+	bool expired;
 
 	struct spi_buf tx_buf = {
 		.buf = tx_cmd,
@@ -221,16 +617,27 @@ int flash_wait_busy(struct flash_config *dev)
 	};
 
 	/* Poll status register until BUSY bit is cleared */
-	do {
-		err = spi_transceive_dt(&dev->dev, &tx_set, &rx_set);
+	while (1) {
+		/* Sampled first: a status read after the deadline decides */
+		expired = k_uptime_ticks() > deadline;
+
+		err = flash_spi(dev, &tx_set, &rx_set);
 		if (err) {
 			LOG_ERR("Failed to read status register: %d", err);
 			return err;
 		}
-		k_msleep(BUSY_POLL_DELAY_MS);
-	} while (rx_data[1] & W25Q16_STATUS_BUSY);
 
-	return 0;
+		if (!(rx_data[1] & W25Q16_STATUS_BUSY)) {
+			return 0;
+		}
+
+		if (expired) {
+			LOG_ERR("Flash still busy after %u us", max_us);
+			return -ETIMEDOUT;
+		}
+
+		k_usleep(poll_us);
+	}
 }
 
 int flash_write_enable(struct flash_config *dev)
@@ -247,7 +654,7 @@ int flash_write_enable(struct flash_config *dev)
 		.count = 1,
 	};
 
-	err = spi_write_dt(&dev->dev, &tx_set);
+	err = flash_spi(dev, &tx_set, NULL);
 	if (err) {
 		LOG_ERR("Write enable failed: %d", err);
 		return err;
@@ -256,29 +663,39 @@ int flash_write_enable(struct flash_config *dev)
 	return 0;
 }
 
-int flash_write_64bytes(struct flash_config *dev, uint32_t addr,
-			const uint8_t *data)
+int flash_page_program(struct flash_config *dev, uint32_t addr,
+		       const uint8_t *data, size_t len)
 {
 	int err;
-	uint8_t tx_cmd[4 + PAGE_WRITE_SIZE];
+	uint8_t tx_cmd[4];
 
-	if (!data) {
+	if (!data || len == 0 || len > W25Q16_PAGE_SIZE) {
 		return -EINVAL;
 	}
 
-	tx_cmd[0] = W25Q16_CMD_PAGE_PROGRAM;
+	tx_cmd[0] = dev->quad_program ? W25Q16_CMD_QUAD_PAGE_PROGRAM :
+					W25Q16_CMD_PAGE_PROGRAM;
 	tx_cmd[1] = (uint8_t)((addr >> 16) & 0xFF);
 	tx_cmd[2] = (uint8_t)((addr >> 8) & 0xFF);
 	tx_cmd[3] = (uint8_t)(addr & 0xFF);
 
-	memcpy(&tx_cmd[4], data, PAGE_WRITE_SIZE);
-
-	struct spi_buf tx_buf = {
-		.buf = tx_cmd,
-		.len = sizeof(tx_cmd),
+	/* Header and payload go out back-to-back under a single CS assertion */
+	struct spi_buf tx_bufs[2] = {
+		{
+			.buf = tx_cmd,
+			.len = sizeof(tx_cmd),
+		},
+		{
+			.buf = (uint8_t *)data,
+			.len = len,
+		},
 	};
 	struct spi_buf_set tx_set = {
-		.buffers = &tx_buf,
+		.buffers = tx_bufs,
+		.count = 2,
+	};
+	struct spi_buf_set data_set = {
+		.buffers = &tx_bufs[1],
 		.count = 1,
 	};
 
@@ -287,32 +704,93 @@ int flash_write_64bytes(struct flash_config *dev, uint32_t addr,
 		return err;
 	}
 
-	err = spi_write_dt(&dev->dev, &tx_set);
+	if (dev->quad_program) {
+		err = flash_spi_quad(dev, tx_cmd, sizeof(tx_cmd), &data_set,
+				     NULL, addr);
+	} else {
+		err = flash_spi(dev, &tx_set, NULL);
+	}
 	if (err) {
-		LOG_ERR("Failed to write 64 bytes at 0x%06X: %d", addr, err);
+		LOG_ERR("Failed to program %zu bytes at 0x%06X: %d",
+			len, addr, err);
 		return err;
 	}
 
-	err = flash_wait_busy(dev);
+	err = flash_wait_busy(dev, T_PP_MAX_US);
 	if (err) {
 		return err;
 	}
 
-	LOG_DBG("Wrote 64 bytes at 0x%06X", addr);
+	LOG_DBG("Programmed %zu bytes at 0x%06X", len, addr);
 	return 0;
 }
 
+int flash_write_64bytes(struct flash_config *dev, uint32_t addr,
+			const uint8_t *data)
+{
+	return flash_page_program(dev, addr, data, PAGE_WRITE_SIZE);
+}
+
+/**
+ * @brief Read over four lanes with Quad I/O or Quad Output Fast Read
+ */
+static int quad_read(struct flash_config *dev, uint32_t addr, uint8_t *data,
+		     size_t len)
+{
+	uint8_t tx_cmd[5] = {W25Q16_CMD_QUAD_OUTPUT_READ};
+	uint8_t quad_hdr[QUAD_IO_HEADER_SIZE] = {0};
+
+	struct spi_buf tx_buf = {
+		.buf = quad_hdr,
+		.len = sizeof(quad_hdr),
+	};
+	struct spi_buf_set tx_set = {
+		.buffers = &tx_buf,
+		.count = 1,
+	};
+
+	struct spi_buf rx_buf = {
+		.buf = data,
+		.len = len,
+	};
+	struct spi_buf_set rx_set = {
+		.buffers = &rx_buf,
+		.count = 1,
+	};
+
+	if (QUAD_IO_READ) {
+		tx_cmd[0] = W25Q16_CMD_QUAD_IO_READ;
+		sys_put_be24(addr, quad_hdr);
+		quad_hdr[3] = QUAD_IO_MODE;
+		return flash_spi_quad(dev, tx_cmd, 1, &tx_set, &rx_set, addr);
+	}
+
+	/* Opcode, address and eight dummy clocks on one lane */
+	sys_put_be24(addr, &tx_cmd[1]);
+	return flash_spi_quad(dev, tx_cmd, sizeof(tx_cmd), NULL, &rx_set,
+			      addr);
+}
+
 int flash_read(struct flash_config *dev, uint32_t addr, uint8_t *data,
 	       size_t len)
 {
 	int err;
-	uint8_t tx_cmd[4];
+	uint8_t tx_cmd[4 + READ_DUMMY_BYTES] = {0};
 
 	if (!data || len == 0) {
 		return -EINVAL;
 	}
 
-	tx_cmd[0] = W25Q16_CMD_READ_DATA;
+	if (dev->quad_read) {
+		err = quad_read(dev, addr, data, len);
+		if (err) {
+			LOG_ERR("Failed to quad read %zu bytes from 0x%06X: %d",
+				len, addr, err);
+		}
+		return err;
+	}
+
+	tx_cmd[0] = READ_CMD;
 	tx_cmd[1] = (uint8_t)((addr >> 16) & 0xFF);
 	tx_cmd[2] = (uint8_t)((addr >> 8) & 0xFF);
 	tx_cmd[3] = (uint8_t)(addr & 0xFF);
@@ -349,7 +827,7 @@ int flash_read(struct flash_config *dev, uint32_t addr, uint8_t *data,
 		.count = 2,
 	};
 
-	err = spi_transceive_dt(&dev->dev, &tx_set, &rx_set);
+	err = flash_spi(dev, &tx_set, &rx_set);
 	if (err) {
 		LOG_ERR("Failed to read %zu bytes from 0x%06X: %d",
 			len, addr, err);
@@ -360,3 +838,159 @@ int flash_read(struct flash_config *dev, uint32_t addr, uint8_t *data,
 	return 0;
 }
 
+/**
+ * @brief Read Status Register-1 or -2
+ */
+static int read_status(struct flash_config *dev, uint8_t opcode,
+		       uint8_t *value)
+{
+	int err;
+	uint8_t tx_cmd[2] = {opcode, 0x00};
+	uint8_t rx_data[2] = {0};
+
+	struct spi_buf tx_buf = {
+		.buf = tx_cmd,
+		.len = sizeof(tx_cmd),
+	};
+	struct spi_buf_set tx_set = {
+		.buffers = &tx_buf,
+		.count = 1,
+	};
+
+	struct spi_buf rx_buf = {
+		.buf = rx_data,
+		.len = sizeof(rx_data),
+	};
+	struct spi_buf_set rx_set = {
+		.buffers = &rx_buf,
+		.count = 1,
+	};
+
+	err = flash_spi(dev, &tx_set, &rx_set);
+	if (err) {
+		LOG_ERR("Failed to read status register %02X: %d", opcode, err);
+		return err;
+	}
+
+	*value = rx_data[1];
+	return 0;
+}
+
+/**
+ * @brief Set the Quad Enable bit, which is non-volatile
+ *
+ * @return 0 once set, -EACCES if the status registers are protected,
+ *         other negative errno on failure
+ */
+static int set_quad_enable(struct flash_config *dev)
+{
+	int err;
+	uint8_t sr2;
+	uint8_t tx_cmd[3];
+	size_t tx_len;
+
+	struct spi_buf tx_buf = {
+		.buf = tx_cmd,
+	};
+	struct spi_buf_set tx_set = {
+		.buffers = &tx_buf,
+		.count = 1,
+	};
+
+	err = read_status(dev, W25Q16_CMD_READ_STATUS_REG2, &sr2);
+	if (err || (sr2 & W25Q16_STATUS2_QE)) {
+		return err;
+	}
+
+	if (DT_PROP(W25Q16_NODE, qe_two_byte_write)) {
+		/* Rewrite Status Register-1 unchanged along with it */
+		tx_cmd[0] = W25Q16_CMD_WRITE_STATUS_REG1;
+		err = read_status(dev, W25Q16_CMD_READ_STATUS_REG1,
+				  &tx_cmd[1]);
+		if (err) {
+			return err;
+		}
+		tx_cmd[2] = sr2 | W25Q16_STATUS2_QE;
+		tx_len = 3;
+	} else {
+		tx_cmd[0] = W25Q16_CMD_WRITE_STATUS_REG2;
+		tx_cmd[1] = sr2 | W25Q16_STATUS2_QE;
+		tx_len = 2;
+	}
+	tx_buf.len = tx_len;
+
+	err = flash_write_enable(dev);
+	if (err) {
+		return err;
+	}
+
+	err = flash_spi(dev, &tx_set, NULL);
+	if (err) {
+		LOG_ERR("Failed to write status register: %d", err);
+		return err;
+	}
+
+	err = flash_wait_busy(dev, T_W_MAX_US);
+	if (err) {
+		return err;
+	}
+
+	err = read_status(dev, W25Q16_CMD_READ_STATUS_REG2, &sr2);
+	if (err) {
+		return err;
+	}
+
+	return (sr2 & W25Q16_STATUS2_QE) ? 0 : -EACCES;
+}
+
+int flash_quad_setup(struct flash_config *dev)
+{
+	int err;
+	uint8_t probe;
+
+	dev->quad_program = false;
+	dev->quad_read = false;
+
+	if (!QUAD_PROGRAM && !QUAD_READ) {
+		return 0;
+	}
+
+#ifdef CONFIG_FLASHER_QUAD_SPI
+	if (!spi_cs_is_gpio_dt(&dev->dev)) {
+		LOG_WRN("Quad SPI needs a GPIO chip select, using one lane");
+		return 0;
+	}
+
+	dev->hold_cfg = dev->dev.config;
+	dev->hold_cfg.operation |= SPI_HOLD_ON_CS;
+	dev->quad_cfg = dev->dev.config;
+	dev->quad_cfg.operation |= SPI_LINES_QUAD | SPI_HALF_DUPLEX;
+#endif
+
+	/* Controllers without quad support refuse the configuration */
+	err = quad_read(dev, 0, &probe, sizeof(probe));
+	if (err == -ENOTSUP || err == -EINVAL) {
+		LOG_WRN("SPI controller refuses quad transfers, using one lane");
+		return 0;
+	}
+	if (err) {
+		LOG_ERR("Quad read probe failed: %d", err);
+		return err;
+	}
+
+	err = set_quad_enable(dev);
+	if (err == -EACCES) {
+		LOG_WRN("Quad Enable bit is write protected, using one lane");
+		return 0;
+	}
+	if (err) {
+		return err;
+	}
+
+	dev->quad_program = QUAD_PROGRAM;
+	dev->quad_read = QUAD_READ;
+
+	LOG_INF("Quad SPI:%s%s", dev->quad_program ? " program" : "",
+		dev->quad_read ? (QUAD_IO_READ ? " read (I/O)" : " read") : "");
+	return 0;
+}
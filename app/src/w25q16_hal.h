@@ -6,15 +6,68 @@
 #ifndef W25Q16_HAL_H
 #define W25Q16_HAL_H
 
+#include <zephyr/devicetree.h>
 #include <zephyr/drivers/spi.h>
 #include <zephyr/kernel.h>
+#include <errno.h>
+#include <stdbool.h>
 #include <stdint.h>
 
+/** Devicetree node describing the flash part; all targets share it */
+#define W25Q16_NODE DT_INST(0, winbond_w25q16)
+
+/** Capacity of the flash in bytes */
+#define W25Q16_SIZE DT_PROP(W25Q16_NODE, flash_size)
+
+/** Page program granularity */
+#define W25Q16_PAGE_SIZE DT_PROP(W25Q16_NODE, page_size)
+
+/** Sector erase granularity */
+#define W25Q16_SECTOR_SIZE DT_PROP(W25Q16_NODE, sector_size)
+
+/** Block erase granularity */
+#define W25Q16_BLOCK_SIZE DT_PROP(W25Q16_NODE, block_size)
+
 /**
  * @brief Flash device configuration structure
  */
 struct flash_config {
 	struct spi_dt_spec dev;
+	/** Device is in deep power-down and only accepts release */
+	bool powered_down;
+	/** Target index, recorded in SPI traces */
+	uint8_t target;
+	/** Pages are programmed over four lanes (flash_quad_setup) */
+	bool quad_program;
+	/** Reads use four lanes (flash_quad_setup) */
+	bool quad_read;
+#ifdef CONFIG_FLASHER_QUAD_SPI
+	/** Single-lane header phase, chip select kept asserted */
+	struct spi_config hold_cfg;
+	/** Quad data phase */
+	struct spi_config quad_cfg;
+#endif
+};
+
+/** Address of a traced transaction that carries none */
+#define FLASH_TRACE_NO_ADDR UINT32_MAX
+
+/**
+ * @brief One recorded SPI transaction
+ */
+struct flash_trace_entry {
+	/** Uptime in us when the transaction started */
+	uint32_t start_us;
+	/** Uptime in us when it completed */
+	uint32_t end_us;
+	/** Flash address, or FLASH_TRACE_NO_ADDR */
+	uint32_t addr;
+	/** Bytes clocked, command header included */
+	uint16_t len;
+	uint8_t opcode;
+	uint8_t target;
+	/** The SPI driver reported an error */
+	bool failed;
 };
 
 /**
@@ -30,11 +83,36 @@ int flash_reset(struct flash_config *dev);
 /**
  * @brief Enter power-down mode
  * 
+ * Does nothing if the device is already powered down.
+ *
  * @param dev Pointer to flash device configuration
  * @return 0 on success, negative errno on failure
  */
 int flash_power_down(struct flash_config *dev);
 
+/**
+ * @brief Release from power-down mode
+ *
+ * Returns once the device accepts commands again (tRES1). Does nothing
+ * if the device is not powered down.
+ *
+ * @param dev Pointer to flash device configuration
+ * @return 0 on success, negative errno on failure
+ */
+int flash_release_power_down(struct flash_config *dev);
+
+/**
+ * @brief Switch to four data lanes where the devicetree asks for them
+ *
+ * Checks that the SPI controller accepts quad transfers and sets the
+ * Quad Enable bit of Status Register-2 if needed. Where either fails,
+ * the device keeps using single-lane commands, which is not an error.
+ *
+ * @param dev Pointer to flash device configuration
+ * @return 0 on success, negative errno on failure
+ */
+int flash_quad_setup(struct flash_config *dev);
+
 /**
  * @brief Read and display JEDEC ID
  * 
@@ -45,15 +123,30 @@ int flash_read_id(struct flash_config *dev);
 
 /**
  * @brief Erase entire chip
- * 
+ *
+ * Returns once the erase completed.
+ *
  * @param dev Pointer to flash device configuration
  * @return 0 on success, negative errno on failure
  */
 int flash_chip_erase(struct flash_config *dev);
 
+/**
+ * @brief Erase a sector
+ *
+ * Returns once the erase completed.
+ *
+ * @param dev Pointer to flash device configuration
+ * @param addr_start Starting address (must be sector aligned)
+ * @return 0 on success, negative errno on failure
+ */
+int flash_sector_erase(struct flash_config *dev, uint32_t addr_start);
+
 /**
  * @brief Erase a 64KB block
- * 
+ *
+ * Returns once the erase completed.
+ *
  * @param dev Pointer to flash device configuration
  * @param addr_start Starting address (must be 64KB aligned)
  * @return 0 on success, negative errno on failure
@@ -63,10 +156,16 @@ int flash_block_erase_64k(struct flash_config *dev, uint32_t addr_start);
 /**
  * @brief Wait for flash busy flag to clear
  * 
+ * The status register is polled at a fraction of @p max_us, so short
+ * operations are noticed quickly and long ones do not flood the bus.
+ * The timeout is measured on the uptime clock, not by adding up sleeps.
+ *
  * @param dev Pointer to flash device configuration
- * @return 0 on success, negative errno on failure
+ * @param max_us Datasheet maximum of the pending operation
+ * @return 0 on success, -ETIMEDOUT if still busy after @p max_us,
+ *         other negative errno on failure
  */
-int flash_wait_busy(struct flash_config *dev);
+int flash_wait_busy(struct flash_config *dev, uint32_t max_us);
 
 /**
  * @brief Enable write operations
@@ -76,6 +175,22 @@ int flash_wait_busy(struct flash_config *dev);
  */
 int flash_write_enable(struct flash_config *dev);
 
+/**
+ * @brief Program up to one page of flash memory
+ *
+ * The payload is handed to the SPI driver as-is, behind a separate
+ * opcode/address header, so no copy of @p data is made. The range must
+ * not cross a page boundary or the device wraps within the page.
+ *
+ * @param dev Pointer to flash device configuration
+ * @param addr Starting address
+ * @param data Pointer to data buffer
+ * @param len Number of bytes to program (1 to W25Q16_PAGE_SIZE)
+ * @return 0 on success, negative errno on failure
+ */
+int flash_page_program(struct flash_config *dev, uint32_t addr,
+		       const uint8_t *data, size_t len);
+
 /**
  * @brief Write 64 bytes to flash memory
  * 
@@ -99,5 +214,52 @@ int flash_write_64bytes(struct flash_config *dev, uint32_t addr,
 int flash_read(struct flash_config *dev, uint32_t addr, uint8_t *data,
 	       size_t len);
 
+#ifdef CONFIG_FLASHER_SPI_TRACE
+
+/**
+ * @brief Get the sequence numbers of the recorded transactions
+ *
+ * The ring keeps the last CONFIG_FLASHER_SPI_TRACE_ENTRIES transactions
+ * of all targets; recording continues while they are read.
+ *
+ * @param first Set to the oldest recorded transaction
+ * @param next Set to the sequence number the next one will get
+ */
+void flash_trace_bounds(uint32_t *first, uint32_t *next);
+
+/**
+ * @brief Get one recorded transaction
+ *
+ * @param seq Sequence number
+ * @param entry Destination
+ * @return 0 on success, -ENOENT if not recorded or already overwritten
+ */
+int flash_trace_get(uint32_t seq, struct flash_trace_entry *entry);
+
+/**
+ * @brief Discard all recorded transactions
+ */
+void flash_trace_clear(void);
+
+#else
+
+static inline void flash_trace_bounds(uint32_t *first, uint32_t *next)
+{
+	*first = 0;
+	*next = 0;
+}
+
+static inline int flash_trace_get(uint32_t seq,
+				  struct flash_trace_entry *entry)
+{
+	return -ENOTSUP;
+}
+
+static inline void flash_trace_clear(void)
+{
+}
+
+#endif /* CONFIG_FLASHER_SPI_TRACE */
+
 #endif /* W25Q16_HAL_H */
 
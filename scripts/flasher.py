@@ -0,0 +1,601 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: Apache-2.0
+
+'''flasher.py
+
+Host tool for ICE40 flashers attached over USB HID (Linux hidraw).
+
+Every flasher reports a serial number derived from its MCU unique ID, so
+several of them can be told apart and programmed at once:
+
+    flasher.py list
+    flasher.py program top.bin --all
+    flasher.py program top.bin --serial 3A0045001851 --serial 3A0045001852
+    flasher.py patch config.bin --addr 0x1A0010 --serial 3A0045001851
+    flasher.py blank --serial 3A0045001851
+    flasher.py read dump.bin --serial 3A0045001851 --len 0x20000
+    flasher.py info --serial 3A0045001851
+    flasher.py trace spi.trace --serial 3A0045001851
+    flasher.py uf2 top.bin top.uf2
+
+Programming runs one worker thread per device; each erases the blocks
+covering the image, streams it with page read-back verification and
+waits for the device to finish. Report sizes and codecs come from each
+device's capability report, so every device runs its fastest supported
+path. Wire format constants mirror app/src/flasher_proto.h.
+
+Firmware built with CONFIG_FLASHER_MSC also shows up as a drive; copying
+a file made with "flasher.py uf2" onto it programs the flash without this
+tool.'''
+
+import argparse
+import collections
+import concurrent.futures
+import fcntl
+import glob
+import os
+import struct
+import sys
+import time
+
+VID = 0x2FE3
+PID = 0x1193
+
+REPORT_SIZE = 64
+BLOCK_SIZE = 0x10000
+
+CMD_ERASE_64K = 0x02
+CMD_WRITE = 0x03
+CMD_READ = 0x09
+CMD_BLANK_CHECK = 0x0A
+CMD_PATCH = 0x0B
+CMD_FLUSH = 0x0C
+CMD_TRACE = 0x0D
+
+WRITE_VERIFY = 0x01
+READ_RLE = 0x01
+TRACE_CLEAR = 0x01
+
+STATUS_STATE = 0
+STATUS_ERROR = 1
+STATUS_DONE = 5
+STATUS_MISMATCH = 15
+STATUS_NONBLANK = 60
+
+STATE_IDLE = 0x00
+STATE_BUSY = 0x01
+STATE_STREAMING = 0x02
+STATE_REPLY = 0x03
+
+REPLY_CMD = 1
+REPLY_OFFSET = 2
+REPLY_LEN = 6
+REPLY_DATA = 8
+
+CAPS_SIZE = 64
+TRANSPORT_HID_INT_OUT = 0x01
+TRANSPORT_MSC = 0x02
+TRANSPORT_DFU = 0x04
+CODEC_READ_RLE = 0x01
+FEATURE_INDEX = 0x0001
+FEATURE_PATCH = 0x0002
+FEATURE_TRACE = 0x0004
+
+# UF2 container for drag-and-drop programming (app/src/msc_volume.c)
+UF2_MAGIC_START0 = 0x0A324655
+UF2_MAGIC_START1 = 0x9E5D5157
+UF2_MAGIC_END = 0x0AB16F30
+UF2_PAYLOAD_SIZE = 256
+
+Caps = collections.namedtuple('Caps', [
+    'version', 'in_size', 'out_size', 'transports', 'codecs', 'window',
+    'targets', 'features', 'flash_size', 'page_size', 'sector_size',
+    'block_size', 'spi_hz'])
+
+# What a device without a capability report supports
+CAPS_V0 = Caps(0, REPORT_SIZE, REPORT_SIZE, 0, 0, 4, 1, 0, 0x200000, 256,
+               0x1000, BLOCK_SIZE, ())
+
+
+def _hidiocginput(length):
+    '''HIDIOCGINPUT(len) from linux/hidraw.h'''
+    return (3 << 30) | (length << 16) | (ord('H') << 8) | 0x0A
+
+
+def _hidiocgfeature(length):
+    '''HIDIOCGFEATURE(len) from linux/hidraw.h'''
+    return (3 << 30) | (length << 16) | (ord('H') << 8) | 0x07
+
+
+def parse_caps(buf):
+    '''Decode a capability report (FLASHER_CAPS_* in flasher_proto.h).'''
+    fields = struct.unpack_from('<HHHBBBBHIHII', buf)
+    targets = fields[6]
+    spi_hz = struct.unpack_from(f'<{targets}I', buf, 26)
+    return Caps(*fields, spi_hz)
+
+
+def rle_decode(data):
+    '''Expand one run-length encoded reply (see app/src/readback.h).'''
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        c = data[i]
+        if c < 0x80:
+            out += data[i + 1:i + 2 + c]
+            i += 2 + c
+        else:
+            run = ((c & 0x7F) << 8 | data[i + 1]) + 1
+            out += bytes([data[i + 2]]) * run
+            i += 3
+    return bytes(out)
+
+
+def uf2_encode(image, addr=0):
+    '''Pack an image into 512-byte UF2 blocks of one flash page each.'''
+    if addr % UF2_PAYLOAD_SIZE:
+        raise ValueError('address must be page aligned')
+    count = (len(image) + UF2_PAYLOAD_SIZE - 1) // UF2_PAYLOAD_SIZE
+    out = bytearray()
+    for no in range(count):
+        off = no * UF2_PAYLOAD_SIZE
+        data = image[off:off + UF2_PAYLOAD_SIZE].ljust(UF2_PAYLOAD_SIZE,
+                                                       b'\xff')
+        out += struct.pack('<IIIIIIII', UF2_MAGIC_START0, UF2_MAGIC_START1,
+                           0, addr + off, UF2_PAYLOAD_SIZE, no, count, 0)
+        out += data.ljust(476, b'\0')
+        out += struct.pack('<I', UF2_MAGIC_END)
+    return bytes(out)
+
+
+class FlasherError(Exception):
+    '''Raised when a device rejects a command or a job fails.'''
+
+
+class Flasher:
+    '''One attached flasher, opened through its hidraw node.'''
+
+    def __init__(self, path, serial):
+        self.path = path
+        self.serial = serial
+        self.fd = os.open(path, os.O_RDWR)
+        self.caps = self.read_caps()
+
+    def close(self):
+        os.close(self.fd)
+
+    def read_caps(self):
+        '''Read the capability report; older firmware stalls it.'''
+        buf = bytearray(CAPS_SIZE + 1)
+        try:
+            fcntl.ioctl(self.fd, _hidiocgfeature(len(buf)), buf)
+        except OSError:
+            return CAPS_V0
+        return parse_caps(bytes(buf[1:]))
+
+    def send(self, payload):
+        '''Send one OUT report, zero padded (report ID 0 first).'''
+        report = bytes(payload).ljust(self.caps.out_size, b'\0')
+        os.write(self.fd, b'\0' + report)
+
+    def send_data(self, data):
+        '''Send a data stream in reports of the device's OUT size.'''
+        step = self.caps.out_size
+        for off in range(0, len(data), step):
+            self.send(data[off:off + step])
+
+    def status(self):
+        '''Read the status report with GET_REPORT.'''
+        buf = bytearray(self.caps.in_size + 1)
+        fcntl.ioctl(self.fd, _hidiocginput(len(buf)), buf)
+        return bytes(buf[1:])
+
+    def wait_idle(self, timeout=60.0):
+        '''Poll until the device has no queued work, then check errors.'''
+        deadline = time.monotonic() + timeout
+        while True:
+            st = self.status()
+            if st[STATUS_STATE] == STATE_IDLE:
+                break
+            if time.monotonic() > deadline:
+                raise FlasherError('timed out waiting for device')
+            time.sleep(0.005)
+
+        err, = struct.unpack_from('<i', st, STATUS_ERROR)
+        if err:
+            mismatch, = struct.unpack_from('<I', st, STATUS_MISMATCH)
+            where = f' (first mismatch at 0x{mismatch:06X})' \
+                if mismatch != 0xFFFFFFFF else ''
+            raise FlasherError(f'device error {err}{where}')
+        return st
+
+    def command(self, cmd, addr=0, count=0, flags=0, check=True):
+        '''Send a command and make sure the device took it.
+
+        A rejected command leaves its error latched in the status, so it
+        is caught here before any data follows. Commands with a reply
+        pass check=False: the status read would take the first part.'''
+        self.send(struct.pack('<BIIB', cmd, addr, count, flags))
+        if not check:
+            return
+        err, = struct.unpack_from('<i', self.status(), STATUS_ERROR)
+        if err:
+            raise FlasherError(f'command 0x{cmd:02X} rejected: '
+                               f'device error {err}')
+
+    def program(self, image, addr=0, verify=True):
+        '''Erase, write and verify an image; returns seconds taken.'''
+        start = time.monotonic()
+
+        blocks = (len(image) + (addr % BLOCK_SIZE) + BLOCK_SIZE - 1) \
+            // BLOCK_SIZE
+        self.command(CMD_ERASE_64K, addr - addr % BLOCK_SIZE, blocks)
+        self.wait_idle()
+
+        self.command(CMD_WRITE, addr, len(image),
+                     WRITE_VERIFY if verify else 0)
+        self.send_data(image)
+        self.wait_idle()
+
+        return time.monotonic() - start
+
+    def patch(self, addr, data):
+        '''Write bytes at any address, then write back the sectors.'''
+        self.command(CMD_PATCH, addr, len(data))
+        self.send_data(data)
+        self.wait_idle()
+        self.command(CMD_FLUSH)
+        self.wait_idle()
+
+    def blank_check(self, addr, length):
+        '''Return the first non-blank address of a range, or None.'''
+        self.command(CMD_BLANK_CHECK, addr, length)
+        st = self.wait_idle()
+        nonblank, = struct.unpack_from('<I', st, STATUS_NONBLANK)
+        return None if nonblank == 0xFFFFFFFF else nonblank
+
+    def read(self, addr, length, rle=None, timeout=60.0):
+        '''Read flash contents of the lowest selected target.
+
+        Run-length encoding is used whenever the device supports it,
+        unless rle is False.'''
+        rle = rle is not False and bool(self.caps.codecs & CODEC_READ_RLE)
+        self.wait_idle()
+        self.command(CMD_READ, addr, length, READ_RLE if rle else 0,
+                     check=False)
+
+        out = bytearray(length)
+        got = 0
+        deadline = time.monotonic() + timeout
+        while got < length:
+            rep = self.status()
+            if rep[0] != STATE_REPLY or rep[REPLY_CMD] != CMD_READ:
+                if rep[0] == STATE_IDLE:
+                    err, = struct.unpack_from('<i', rep, STATUS_ERROR)
+                    raise FlasherError(f'read ended early at {got} bytes'
+                                       f' (device error {err})')
+                if time.monotonic() > deadline:
+                    raise FlasherError('timed out waiting for device')
+                time.sleep(0.005)
+                continue
+            off, = struct.unpack_from('<I', rep, REPLY_OFFSET)
+            n, = struct.unpack_from('<H', rep, REPLY_LEN)
+            data = rep[REPLY_DATA:REPLY_DATA + n]
+            if rle:
+                data = rle_decode(data)
+            out[off:off + len(data)] = data
+            got = off + len(data)
+        return bytes(out)
+
+
+    def trace(self, clear=False, timeout=10.0):
+        '''Download the recorded SPI transactions, or discard them.
+
+        Returns the raw records (see FLASHER_TRACE_* in flasher_proto.h),
+        which tools/trace-replay reads.'''
+        self.wait_idle()
+        if clear:
+            self.command(CMD_TRACE, flags=TRACE_CLEAR)
+            self.wait_idle()
+            return b''
+        self.command(CMD_TRACE, check=False)
+
+        out = bytearray()
+        deadline = time.monotonic() + timeout
+        while True:
+            rep = self.status()
+            if rep[0] == STATE_REPLY and rep[REPLY_CMD] == CMD_TRACE:
+                off, = struct.unpack_from('<I', rep, REPLY_OFFSET)
+                n, = struct.unpack_from('<H', rep, REPLY_LEN)
+                if off != len(out):
+                    raise FlasherError(f'trace reply out of order at {off}')
+                out += rep[REPLY_DATA:REPLY_DATA + n]
+                continue
+            if rep[0] == STATE_IDLE:
+                err, = struct.unpack_from('<i', rep, STATUS_ERROR)
+                if err:
+                    raise FlasherError(f'device error {err}')
+                break
+            if time.monotonic() > deadline:
+                raise FlasherError('timed out waiting for device')
+            time.sleep(0.005)
+        return bytes(out)
+
+
+def find_flashers():
+    '''List (hidraw path, serial) of every attached flasher.'''
+    found = []
+    hid_id = f'0003:{VID:08X}:{PID:08X}'
+    for node in sorted(glob.glob('/sys/class/hidraw/hidraw*')):
+        props = {}
+        try:
+            with open(os.path.join(node, 'device', 'uevent')) as f:
+                for line in f:
+                    key, _, value = line.strip().partition('=')
+                    props[key] = value
+        except OSError:
+            continue
+        if props.get('HID_ID', '').upper() != hid_id:
+            continue
+        found.append(('/dev/' + os.path.basename(node),
+                      props.get('HID_UNIQ', '')))
+    return found
+
+
+def program_one(path, serial, image, addr, verify):
+    dev = Flasher(path, serial)
+    try:
+        return dev.program(image, addr, verify)
+    finally:
+        dev.close()
+
+
+def cmd_list(_args):
+    for path, serial in find_flashers():
+        print(f'{serial or "(no serial)"}\t{path}')
+    return 0
+
+
+def cmd_program(args):
+    with open(args.image, 'rb') as f:
+        image = f.read()
+
+    targets = find_flashers()
+    if not args.all:
+        targets = [t for t in targets if t[1] in args.serial]
+        missing = set(args.serial) - {t[1] for t in targets}
+        if missing:
+            print(f'not found: {", ".join(sorted(missing))}',
+                  file=sys.stderr)
+            return 1
+    if not targets:
+        print('no flashers found', file=sys.stderr)
+        return 1
+
+    failed = 0
+    with concurrent.futures.ThreadPoolExecutor(len(targets)) as pool:
+        jobs = {pool.submit(program_one, path, serial, image, args.addr,
+                            not args.no_verify): serial
+                for path, serial in targets}
+        for job in concurrent.futures.as_completed(jobs):
+            serial = jobs[job]
+            try:
+                secs = job.result()
+                print(f'{serial}: ok, {len(image)} bytes in {secs:.2f} s '
+                      f'({len(image) / 1024 / secs:.1f} KiB/s)')
+            except (OSError, FlasherError) as e:
+                failed += 1
+                print(f'{serial}: FAILED: {e}', file=sys.stderr)
+
+    return 1 if failed else 0
+
+
+def cmd_patch(args):
+    with open(args.data, 'rb') as f:
+        data = f.read()
+
+    targets = [t for t in find_flashers() if t[1] == args.serial]
+    if not targets:
+        print(f'not found: {args.serial}', file=sys.stderr)
+        return 1
+
+    dev = Flasher(*targets[0])
+    try:
+        dev.patch(args.addr, data)
+    except (OSError, FlasherError) as e:
+        print(f'{args.serial}: FAILED: {e}', file=sys.stderr)
+        return 1
+    finally:
+        dev.close()
+
+    print(f'{args.serial}: patched {len(data)} bytes at 0x{args.addr:06X}')
+    return 0
+
+
+def cmd_blank(args):
+    targets = [t for t in find_flashers() if t[1] == args.serial]
+    if not targets:
+        print(f'not found: {args.serial}', file=sys.stderr)
+        return 1
+
+    dev = Flasher(*targets[0])
+    try:
+        nonblank = dev.blank_check(args.addr, args.len)
+    except (OSError, FlasherError) as e:
+        print(f'{args.serial}: FAILED: {e}', file=sys.stderr)
+        return 1
+    finally:
+        dev.close()
+
+    if nonblank is None:
+        print(f'{args.serial}: blank')
+        return 0
+    print(f'{args.serial}: not blank at 0x{nonblank:06X}')
+    return 2
+
+
+def cmd_read(args):
+    targets = [t for t in find_flashers() if t[1] == args.serial]
+    if not targets:
+        print(f'not found: {args.serial}', file=sys.stderr)
+        return 1
+
+    dev = Flasher(*targets[0])
+    try:
+        start = time.monotonic()
+        data = dev.read(args.addr, args.len, False if args.raw else None)
+        secs = time.monotonic() - start
+    except (OSError, FlasherError) as e:
+        print(f'{args.serial}: FAILED: {e}', file=sys.stderr)
+        return 1
+    finally:
+        dev.close()
+
+    with open(args.output, 'wb') as f:
+        f.write(data)
+    print(f'{args.serial}: {len(data)} bytes in {secs:.2f} s '
+          f'({len(data) / 1024 / secs:.1f} KiB/s)')
+    return 0
+
+
+def cmd_trace(args):
+    targets = [t for t in find_flashers() if t[1] == args.serial]
+    if not targets:
+        print(f'not found: {args.serial}', file=sys.stderr)
+        return 1
+    if not args.clear and not args.output:
+        print('an output file or --clear is required', file=sys.stderr)
+        return 1
+
+    dev = Flasher(*targets[0])
+    try:
+        if not dev.caps.features & FEATURE_TRACE:
+            raise FlasherError('firmware built without CONFIG_FLASHER_SPI_TRACE')
+        data = dev.trace(clear=args.clear)
+    except (OSError, FlasherError) as e:
+        print(f'{args.serial}: FAILED: {e}', file=sys.stderr)
+        return 1
+    finally:
+        dev.close()
+
+    if args.clear:
+        print(f'{args.serial}: trace cleared')
+        return 0
+    with open(args.output, 'wb') as f:
+        f.write(data)
+    print(f'{args.serial}: {len(data) // 16} transactions')
+    return 0
+
+
+def cmd_uf2(args):
+    with open(args.image, 'rb') as f:
+        image = f.read()
+    data = uf2_encode(image, args.addr)
+    with open(args.output, 'wb') as f:
+        f.write(data)
+    print(f'{args.output}: {len(data) // 512} blocks')
+    return 0
+
+
+def _flag_names(mask, table):
+    return ', '.join(name for bit, name in table if mask & bit) or 'none'
+
+
+def cmd_info(args):
+    targets = [t for t in find_flashers() if t[1] == args.serial]
+    if not targets:
+        print(f'not found: {args.serial}', file=sys.stderr)
+        return 1
+
+    dev = Flasher(*targets[0])
+    caps = dev.caps
+    dev.close()
+
+    print(f'protocol version {caps.version}')
+    print(f'reports: IN {caps.in_size} bytes, OUT {caps.out_size} bytes')
+    print('transports: HID, ' + _flag_names(caps.transports, [
+        (TRANSPORT_HID_INT_OUT, 'interrupt OUT'),
+        (TRANSPORT_MSC, 'mass storage'), (TRANSPORT_DFU, 'DFU')]))
+    print('codecs: ' + _flag_names(caps.codecs, [(CODEC_READ_RLE, 'read RLE')]))
+    print('features: ' + _flag_names(caps.features, [
+        (FEATURE_INDEX, 'sector index'), (FEATURE_PATCH, 'patch'),
+        (FEATURE_TRACE, 'SPI trace')]))
+    print(f'window: {caps.window} pages, {caps.targets} target(s)')
+    print(f'flash: {caps.flash_size} bytes, page {caps.page_size}, '
+          f'sector {caps.sector_size}, block {caps.block_size}')
+    for i, hz in enumerate(caps.spi_hz):
+        print(f'target {i}: SPI {hz / 1e6:g} MHz')
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n\n')[1],
+                                     formatter_class=argparse.
+                                     RawDescriptionHelpFormatter)
+    sub = parser.add_subparsers(dest='cmd', required=True)
+
+    sub.add_parser('list', help='list attached flashers')
+
+    prog = sub.add_parser('program', help='program one or more flashers')
+    prog.add_argument('image', help='raw image to write')
+    prog.add_argument('--addr', type=lambda s: int(s, 0), default=0,
+                      help='flash address (default 0)')
+    prog.add_argument('--no-verify', action='store_true',
+                      help='skip page read-back verification')
+    who = prog.add_mutually_exclusive_group(required=True)
+    who.add_argument('--all', action='store_true',
+                     help='program every attached flasher')
+    who.add_argument('--serial', action='append', default=[],
+                     help='program the flasher with this serial number')
+
+    patch = sub.add_parser('patch', help='write bytes at any address')
+    patch.add_argument('data', help='file holding the bytes to write')
+    patch.add_argument('--addr', type=lambda s: int(s, 0), required=True,
+                       help='flash address of the first byte')
+    patch.add_argument('--serial', required=True,
+                       help='patch the flasher with this serial number')
+
+    blank = sub.add_parser('blank', help='check that flash is erased')
+    blank.add_argument('--serial', required=True,
+                       help='check the flasher with this serial number')
+    blank.add_argument('--addr', type=lambda s: int(s, 0), default=0,
+                       help='flash address (default 0)')
+    blank.add_argument('--len', type=lambda s: int(s, 0), default=0x200000,
+                       help='number of bytes (default whole flash)')
+
+    rd = sub.add_parser('read', help='read back flash contents')
+    rd.add_argument('output', help='file to write')
+    rd.add_argument('--serial', required=True,
+                    help='read the flasher with this serial number')
+    rd.add_argument('--addr', type=lambda s: int(s, 0), default=0,
+                    help='flash address (default 0)')
+    rd.add_argument('--len', type=lambda s: int(s, 0), default=0x200000,
+                    help='number of bytes (default whole flash)')
+    rd.add_argument('--raw', action='store_true',
+                    help='disable on-device run-length encoding')
+
+    info = sub.add_parser('info', help='show device capabilities')
+    info.add_argument('--serial', required=True,
+                      help='query the flasher with this serial number')
+
+    trace = sub.add_parser('trace', help='download the SPI trace')
+    trace.add_argument('output', nargs='?', help='file to write')
+    trace.add_argument('--serial', required=True,
+                       help='query the flasher with this serial number')
+    trace.add_argument('--clear', action='store_true',
+                       help='discard the recorded transactions instead')
+
+    uf2 = sub.add_parser('uf2', help='convert an image for mass storage')
+    uf2.add_argument('image', help='raw image to convert')
+    uf2.add_argument('output', help='UF2 file to write')
+    uf2.add_argument('--addr', type=lambda s: int(s, 0), default=0,
+                     help='flash address (default 0)')
+
+    args = parser.parse_args()
+    return {'list': cmd_list, 'program': cmd_program, 'patch': cmd_patch,
+            'blank': cmd_blank, 'read': cmd_read, 'info': cmd_info,
+            'trace': cmd_trace, 'uf2': cmd_uf2}[args.cmd](args)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
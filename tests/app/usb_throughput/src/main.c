@@ -0,0 +1,256 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * @file end-to-end USB throughput test
+ *
+ * The flasher application runs on native_sim against an emulated W25Q16,
+ * and the USB host stack drives its HID interface over the virtual bus
+ * the same way scripts/flasher.py does: commands and data as SET_REPORT,
+ * status polled with GET_REPORT. The suite uploads a reference image,
+ * prints bytes/s and per-report latency percentiles, and fails if the
+ * throughput falls more than CONFIG_USB_THROUGHPUT_MARGIN_PERCENT below
+ * the recorded CONFIG_USB_THROUGHPUT_BASELINE_BPS. native_sim runs on
+ * simulated time, so the figure is the same on every host.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zephyr/drivers/spi.h>
+#include <zephyr/drivers/usb/uhc.h>
+#include <zephyr/kernel.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/usb/usbd.h>
+#include <zephyr/usb/usbh.h>
+#include <zephyr/ztest.h>
+
+/*
+ * The host stack has no public API for class requests yet; Zephyr's own
+ * tests/subsys/usb/device_next drives devices through these headers too.
+ */
+#include <usbh_ch9.h>
+#include <usbh_device.h>
+
+#include "flash_worker.h"
+#include "flasher_proto.h"
+#include "fpga.h"
+#include "hid_device.h"
+#include "usbd_init.h"
+#include "w25q16_emul.h"
+#include "w25q16_hal.h"
+
+#define IMAGE_SIZE      CONFIG_USB_THROUGHPUT_IMAGE_SIZE
+#define REPORT_SIZE     FLASHER_REPORT_SIZE_MIN
+#define REPORT_COUNT    (IMAGE_SIZE / REPORT_SIZE)
+
+/* HID class requests, interface 0 */
+#define HID_REQ_GET_REPORT      0x01
+#define HID_REQ_SET_REPORT      0x09
+#define HID_REPORT_INPUT        0x0100
+#define HID_REPORT_OUTPUT       0x0200
+#define HID_IFACE               0
+
+#define IDLE_TIMEOUT_MS         30000
+
+BUILD_ASSERT(IMAGE_SIZE % W25Q16_BLOCK_SIZE == 0,
+	     "Reference image must cover whole 64KB blocks");
+
+USBH_CONTROLLER_DEFINE(uhs_ctx, DEVICE_DT_GET(DT_NODELABEL(zephyr_uhc0)));
+
+static struct flash_config flash_dev = {
+	.dev = SPI_DT_SPEC_GET(DT_NODELABEL(w25q16),
+			       SPI_OP_MODE_MASTER | SPI_WORD_SET(8)),
+};
+
+static struct usb_device *udev;
+static uint8_t image[IMAGE_SIZE];
+static uint32_t latency_us[REPORT_COUNT + 1];
+
+static uint32_t now_us(void)
+{
+	return (uint32_t)k_cyc_to_us_floor64(k_cycle_get_64());
+}
+
+static int set_report(const uint8_t *data, size_t len)
+{
+	struct net_buf *buf;
+	int err;
+
+	buf = usbh_xfer_buf_alloc(udev, REPORT_SIZE);
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	net_buf_add_mem(buf, data, len);
+	if (len < REPORT_SIZE) {
+		memset(net_buf_add(buf, REPORT_SIZE - len), 0,
+		       REPORT_SIZE - len);
+	}
+
+	err = usbh_req_setup(udev, USB_REQTYPE_DIR_TO_DEVICE << 7 |
+				   USB_REQTYPE_TYPE_CLASS << 5 |
+				   USB_REQTYPE_RECIPIENT_INTERFACE,
+			     HID_REQ_SET_REPORT, HID_REPORT_OUTPUT, HID_IFACE,
+			     REPORT_SIZE, buf);
+	usbh_xfer_buf_free(udev, buf);
+
+	return err;
+}
+
+static int get_report(uint8_t report[FLASHER_STATUS_SIZE])
+{
+	struct net_buf *buf;
+	int err;
+
+	buf = usbh_xfer_buf_alloc(udev, FLASHER_STATUS_SIZE);
+	if (!buf) {
+		return -ENOMEM;
+	}
+
+	err = usbh_req_setup(udev, USB_REQTYPE_DIR_TO_HOST << 7 |
+				   USB_REQTYPE_TYPE_CLASS << 5 |
+				   USB_REQTYPE_RECIPIENT_INTERFACE,
+			     HID_REQ_GET_REPORT, HID_REPORT_INPUT, HID_IFACE,
+			     FLASHER_STATUS_SIZE, buf);
+	if (!err) {
+		memcpy(report, buf->data, MIN(buf->len, FLASHER_STATUS_SIZE));
+	}
+	usbh_xfer_buf_free(udev, buf);
+
+	return err;
+}
+
+static void command(uint8_t cmd, uint32_t addr, uint32_t count, uint8_t flags)
+{
+	uint8_t report[FLASHER_REPORT_SIZE_MIN] = {cmd};
+
+	sys_put_le32(addr, &report[FLASHER_ARG_ADDR]);
+	sys_put_le32(count, &report[FLASHER_ARG_LEN]);
+	report[FLASHER_ARG_FLAGS] = flags;
+
+	zassert_ok(set_report(report, sizeof(report)), "Command %u failed",
+		   cmd);
+}
+
+/**
+ * @brief Poll the status until the device is idle and check for errors
+ */
+static void wait_idle(void)
+{
+	uint8_t status[FLASHER_STATUS_SIZE];
+	int64_t deadline = k_uptime_get() + IDLE_TIMEOUT_MS;
+
+	while (true) {
+		zassert_ok(get_report(status), "GET_REPORT failed");
+		if (status[FLASHER_STATUS_STATE] == FLASHER_STATE_IDLE) {
+			break;
+		}
+		zassert_true(k_uptime_get() < deadline, "Device stayed busy");
+		k_msleep(1);
+	}
+
+	zassert_equal((int32_t)sys_get_le32(&status[FLASHER_STATUS_ERROR]), 0,
+		      "Device error, first mismatch at 0x%06X",
+		      sys_get_le32(&status[FLASHER_STATUS_MISMATCH]));
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+static uint32_t percentile(const uint32_t *sorted, size_t n, unsigned int p)
+{
+	return sorted[MIN(n - 1, n * p / 100)];
+}
+
+ZTEST(usb_throughput, test_program_image)
+{
+	uint32_t erase_us, write_us, start, t;
+	uint64_t bps;
+
+	/* Deterministic pseudo-random image so every page is programmed */
+	for (size_t i = 0; i < sizeof(image); i++) {
+		image[i] = (uint8_t)((i * 2654435761u) >> 24);
+	}
+
+	start = now_us();
+	command(FLASHER_CMD_ERASE_64K, 0, IMAGE_SIZE / W25Q16_BLOCK_SIZE, 0);
+	wait_idle();
+	erase_us = now_us() - start;
+
+	start = now_us();
+	command(FLASHER_CMD_WRITE, 0, IMAGE_SIZE, FLASHER_WRITE_VERIFY);
+	for (size_t i = 0; i < REPORT_COUNT; i++) {
+		t = now_us();
+		zassert_ok(set_report(&image[i * REPORT_SIZE], REPORT_SIZE),
+			   "Data report %zu failed", i);
+		latency_us[i] = now_us() - t;
+	}
+	wait_idle();
+	write_us = now_us() - start;
+
+	zassert_mem_equal(w25q16_emul_memory(), image, IMAGE_SIZE,
+			  "Flash does not hold the image");
+
+	bps = (uint64_t)IMAGE_SIZE * USEC_PER_SEC / MAX(write_us, 1);
+	qsort(latency_us, REPORT_COUNT, sizeof(latency_us[0]), cmp_u32);
+
+	TC_PRINT("erase %u us, write+verify %u us, %u bytes/s\n", erase_us,
+		 write_us, (uint32_t)bps);
+	TC_PRINT("report latency us: p50 %u p90 %u p99 %u max %u\n",
+		 percentile(latency_us, REPORT_COUNT, 50),
+		 percentile(latency_us, REPORT_COUNT, 90),
+		 percentile(latency_us, REPORT_COUNT, 99),
+		 latency_us[REPORT_COUNT - 1]);
+
+	if (CONFIG_USB_THROUGHPUT_BASELINE_BPS == 0) {
+		TC_PRINT("No baseline recorded; record "
+			 "CONFIG_USB_THROUGHPUT_BASELINE_BPS=%u\n",
+			 (uint32_t)bps);
+		ztest_test_skip();
+	}
+
+	zassert_true(bps * 100 >= (uint64_t)CONFIG_USB_THROUGHPUT_BASELINE_BPS *
+				  (100 - CONFIG_USB_THROUGHPUT_MARGIN_PERCENT),
+		     "%u bytes/s is more than %u%% below the baseline of %u",
+		     (uint32_t)bps, CONFIG_USB_THROUGHPUT_MARGIN_PERCENT,
+		     CONFIG_USB_THROUGHPUT_BASELINE_BPS);
+}
+
+static void *usb_throughput_setup(void)
+{
+	struct usbd_context *usbd_ctx;
+
+	zassert_ok(hid_device_init(), "HID init failed");
+	zassert_ok(fpga_init(0), "FPGA init failed");
+	zassert_ok(flash_worker_start(0, &flash_dev), "Worker start failed");
+	zassert_ok(flash_worker_wait_ready(0, K_SECONDS(1)),
+		   "Flash not ready");
+
+	zassert_ok(usbh_init(&uhs_ctx), "Failed to initialize USB host");
+	zassert_ok(usbh_enable(&uhs_ctx), "Failed to enable USB host");
+	zassert_ok(uhc_bus_reset(uhs_ctx.dev), "Failed to reset bus");
+	zassert_ok(uhc_bus_resume(uhs_ctx.dev), "Failed to resume bus");
+	zassert_ok(uhc_sof_enable(uhs_ctx.dev), "Failed to enable SoF");
+
+	usbd_ctx = flasher_usbd_init_device(NULL);
+	zassert_not_null(usbd_ctx, "Failed to initialize USB device");
+	zassert_ok(usbd_enable(usbd_ctx), "Failed to enable USB device");
+
+	/* Let the host enumerate the device */
+	k_msleep(1000);
+
+	udev = usbh_device_get_any(&uhs_ctx);
+	zassert_not_null(udev, "No device on the virtual bus");
+	zassert_ok(usbh_req_set_cfg(udev, 1), "SET_CONFIGURATION failed");
+
+	return NULL;
+}
+
+ZTEST_SUITE(usb_throughput, NULL, usb_throughput_setup, NULL, NULL, NULL);
@@ -0,0 +1,239 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+/*
+ * @file W25Q16 emulator on the SPI emulation bus
+ *
+ * Implements the commands issued by the flasher HAL with NOR semantics
+ * (programming only clears bits) and keeps WIP set for the typical
+ * program and erase times, so the HAL's busy polling and the resulting
+ * throughput behave as on hardware.
+ */
+
+#define DT_DRV_COMPAT winbond_w25q16
+
+#include <string.h>
+
+#include <zephyr/device.h>
+#include <zephyr/drivers/emul.h>
+#include <zephyr/drivers/emul_stub_device.h>
+#include <zephyr/drivers/spi.h>
+#include <zephyr/drivers/spi_emul.h>
+#include <zephyr/kernel.h>
+
+#include "w25q16_emul.h"
+
+#define EMUL_SIZE       DT_INST_PROP(0, flash_size)
+#define EMUL_PAGE_SIZE  DT_INST_PROP(0, page_size)
+#define EMUL_SECTOR     DT_INST_PROP(0, sector_size)
+#define EMUL_BLOCK      DT_INST_PROP(0, block_size)
+
+/* Typical timings of the W25Q16JV */
+#define T_PP_US         700
+#define T_SE_US         45000
+#define T_BE_US         150000
+#define T_CE_US         5000000
+
+#define SR1_BUSY        BIT(0)
+#define SR1_WEL         BIT(1)
+
+struct w25q16_emul_data {
+	uint8_t mem[EMUL_SIZE];
+	int64_t busy_until;
+	bool wel;
+	bool powered_down;
+};
+
+static struct w25q16_emul_data emul_data;
+
+/* Bytes of one transaction, flattened from the buffer sets */
+struct xfer {
+	const struct spi_buf_set *tx;
+	const struct spi_buf_set *rx;
+	size_t len;
+};
+
+static size_t set_len(const struct spi_buf_set *set)
+{
+	size_t len = 0;
+
+	for (size_t i = 0; set && i < set->count; i++) {
+		len += set->buffers[i].len;
+	}
+
+	return len;
+}
+
+static uint8_t *byte_at(const struct spi_buf_set *set, size_t pos)
+{
+	for (size_t i = 0; set && i < set->count; i++) {
+		if (pos < set->buffers[i].len) {
+			return set->buffers[i].buf ?
+			       (uint8_t *)set->buffers[i].buf + pos : NULL;
+		}
+		pos -= set->buffers[i].len;
+	}
+
+	return NULL;
+}
+
+static uint8_t tx_byte(const struct xfer *x, size_t pos)
+{
+	uint8_t *b = byte_at(x->tx, pos);
+
+	return b ? *b : 0;
+}
+
+static void rx_byte(const struct xfer *x, size_t pos, uint8_t value)
+{
+	uint8_t *b = byte_at(x->rx, pos);
+
+	if (b) {
+		*b = value;
+	}
+}
+
+static uint32_t tx_addr(const struct xfer *x)
+{
+	return (tx_byte(x, 1) << 16) | (tx_byte(x, 2) << 8) | tx_byte(x, 3);
+}
+
+static bool busy(struct w25q16_emul_data *d)
+{
+	return k_uptime_ticks() < d->busy_until;
+}
+
+static void start_busy(struct w25q16_emul_data *d, uint32_t us)
+{
+	d->busy_until = k_uptime_ticks() + k_us_to_ticks_ceil64(us);
+	d->wel = false;
+}
+
+static int w25q16_emul_io(const struct emul *target,
+			  const struct spi_config *config,
+			  const struct spi_buf_set *tx_bufs,
+			  const struct spi_buf_set *rx_bufs)
+{
+	struct w25q16_emul_data *d = target->data;
+	struct xfer x = {
+		.tx = tx_bufs,
+		.rx = rx_bufs,
+		.len = MAX(set_len(tx_bufs), set_len(rx_bufs)),
+	};
+	uint8_t cmd = tx_byte(&x, 0);
+	uint32_t addr;
+
+	ARG_UNUSED(config);
+
+	if (x.len == 0) {
+		return 0;
+	}
+
+	if (d->powered_down && cmd != 0xAB) {
+		return 0;
+	}
+
+	switch (cmd) {
+	case 0xAB: /* Release power-down */
+		d->powered_down = false;
+		break;
+	case 0xB9: /* Power-down */
+		d->powered_down = true;
+		break;
+	case 0x05: /* Read status register 1 */
+		for (size_t i = 1; i < x.len; i++) {
+			rx_byte(&x, i, (busy(d) ? SR1_BUSY : 0) |
+					       (d->wel ? SR1_WEL : 0));
+		}
+		break;
+	case 0x9F: /* JEDEC ID */
+		rx_byte(&x, 1, 0xEF);
+		rx_byte(&x, 2, 0x40);
+		rx_byte(&x, 3, 0x15);
+		break;
+	case 0x03: /* Read data */
+	case 0x0B: /* Fast read */
+		if (busy(d)) {
+			break;
+		}
+		addr = tx_addr(&x);
+		for (size_t i = (cmd == 0x0B) ? 5 : 4; i < x.len; i++) {
+			rx_byte(&x, i, d->mem[addr++ % EMUL_SIZE]);
+		}
+		break;
+	case 0x06: /* Write enable */
+		if (!busy(d)) {
+			d->wel = true;
+		}
+		break;
+	case 0x02: /* Page program, wraps within the page */
+		if (busy(d) || !d->wel) {
+			break;
+		}
+		addr = tx_addr(&x) % EMUL_SIZE;
+		for (size_t i = 4; i < x.len; i++) {
+			uint32_t a = ROUND_DOWN(addr, EMUL_PAGE_SIZE) +
+				     (addr + i - 4) % EMUL_PAGE_SIZE;
+
+			d->mem[a] &= tx_byte(&x, i);
+		}
+		start_busy(d, T_PP_US);
+		break;
+	case 0x20: /* Sector erase */
+	case 0xD8: /* 64KB block erase */
+		if (busy(d) || !d->wel) {
+			break;
+		}
+		addr = tx_addr(&x) % EMUL_SIZE;
+		if (cmd == 0x20) {
+			memset(&d->mem[ROUND_DOWN(addr, EMUL_SECTOR)], 0xFF,
+			       EMUL_SECTOR);
+			start_busy(d, T_SE_US);
+		} else {
+			memset(&d->mem[ROUND_DOWN(addr, EMUL_BLOCK)], 0xFF,
+			       EMUL_BLOCK);
+			start_busy(d, T_BE_US);
+		}
+		break;
+	case 0xC7: /* Chip erase */
+	case 0x60:
+		if (busy(d) || !d->wel) {
+			break;
+		}
+		memset(d->mem, 0xFF, sizeof(d->mem));
+		start_busy(d, T_CE_US);
+		break;
+	default:
+		/* Reset, dummy clocks and unsupported commands */
+		break;
+	}
+
+	return 0;
+}
+
+static const struct spi_emul_api w25q16_emul_api = {
+	.io = w25q16_emul_io,
+};
+
+static int w25q16_emul_init(const struct emul *target,
+			    const struct device *parent)
+{
+	struct w25q16_emul_data *d = target->data;
+
+	ARG_UNUSED(parent);
+
+	memset(d->mem, 0xFF, sizeof(d->mem));
+	return 0;
+}
+
+/* The flasher talks to the part through the bus, so it has no driver */
+DT_INST_FOREACH_STATUS_OKAY(EMUL_STUB_DEVICE);
+
+EMUL_DT_INST_DEFINE(0, w25q16_emul_init, &emul_data, NULL, &w25q16_emul_api,
+		    NULL);
+
+const uint8_t *w25q16_emul_memory(void)
+{
+	return emul_data.mem;
+}
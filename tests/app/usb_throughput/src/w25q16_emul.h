@@ -0,0 +1,17 @@
+/*
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef W25Q16_EMUL_H
+#define W25Q16_EMUL_H
+
+#include <stdint.h>
+
+/**
+ * @brief Get the contents of the emulated flash
+ *
+ * @return Pointer to the flash-size byte array of the first instance
+ */
+const uint8_t *w25q16_emul_memory(void);
+
+#endif /* W25Q16_EMUL_H */
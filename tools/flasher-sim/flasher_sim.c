@@ -0,0 +1,645 @@
+/**
+ * @file flasher_sim.c
+ * @brief Linux uhid simulator of the ICE40 flasher
+ *
+ * Creates a HID device with the flasher's VID/PID and report descriptor,
+ * so host tools find it as /dev/hidraw* exactly like the real board. The
+ * wire protocol from flasher_proto.h runs against an in-memory W25Q16
+ * whose program and erase times follow a configurable timing model,
+ * including the page pool back-pressure of the firmware. Every write
+ * stream is timed, so host tools can be benchmarked end to end without
+ * hardware.
+ *
+ * Needs access to /dev/uhid (usually root). Not modelled: gang mode,
+ * scripts, image parsing and CDONE; those commands are refused.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/uhid.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "flasher_proto.h"
+
+/* Must match usbd_init.c and hid_device.c */
+#define SIM_VID                        0x2FE3
+#define SIM_PID                        0x1193
+#define SIM_NAME                       "Purple Petina ICE40DK Programmer"
+#define REPORT_SIZE                    64
+
+/* W25Q16 geometry */
+#define FLASH_SIZE                     (2 * 1024 * 1024)
+#define PAGE_SIZE                      256
+#define SECTOR_SIZE                    4096
+#define BLOCK_SIZE                     65536
+
+/* Firmware defaults (CONFIG_FLASHER_PAGE_POOL_COUNT) */
+#define POOL_COUNT                     4
+
+static const uint8_t report_desc[] = {
+	0x06, 0x00, 0xFF,       /* USAGE_PAGE (Vendor Defined 0xFF00) */
+	0x09, 0x01,             /* USAGE (Vendor Usage 1) */
+	0xA1, 0x01,             /* COLLECTION (Application) */
+	0x09, 0x02,             /*   USAGE (Vendor Usage 2) */
+	0x15, 0x00,             /*   LOGICAL_MINIMUM (0) */
+	0x26, 0xFF, 0x00,       /*   LOGICAL_MAXIMUM (255) */
+	0x75, 0x08,             /*   REPORT_SIZE (8 bits) */
+	0x96, REPORT_SIZE, 0x00, /*   REPORT_COUNT */
+	0x91, 0x02,             /*   OUTPUT (Data,Var,Abs) */
+	0x09, 0x03,             /*   USAGE (Vendor Usage 3) */
+	0x15, 0x00,             /*   LOGICAL_MINIMUM (0) */
+	0x26, 0xFF, 0x00,       /*   LOGICAL_MAXIMUM (255) */
+	0x75, 0x08,             /*   REPORT_SIZE (8 bits) */
+	0x96, REPORT_SIZE, 0x00, /*   REPORT_COUNT */
+	0x81, 0x02,             /*   INPUT (Data,Var,Abs) */
+	0x09, 0x04,             /*   USAGE (Vendor Usage 4) */
+	0x15, 0x00,             /*   LOGICAL_MINIMUM (0) */
+	0x26, 0xFF, 0x00,       /*   LOGICAL_MAXIMUM (255) */
+	0x75, 0x08,             /*   REPORT_SIZE (8 bits) */
+	0x96, FLASHER_CAPS_SIZE, 0x00, /*   REPORT_COUNT */
+	0xB1, 0x02,             /*   FEATURE (Data,Var,Abs) */
+	0xC0                    /* END_COLLECTION */
+};
+
+/**
+ * @brief Flash timing model, in microseconds
+ */
+struct timing {
+	uint32_t spi_hz;
+	uint32_t page_us;
+	uint32_t sector_us;
+	uint32_t block_us;
+	uint32_t chip_us;
+};
+
+static struct timing timing = {
+	.spi_hz = 1000000,
+	.page_us = 700,
+	.sector_us = 45000,
+	.block_us = 150000,
+	.chip_us = 5000000,
+};
+
+static uint8_t flash[FLASH_SIZE];
+
+/* Completion times of queued page buffers, oldest first */
+static struct {
+	uint64_t done_at[POOL_COUNT];
+	uint32_t bytes[POOL_COUNT];
+	int head;
+	int count;
+} queue;
+
+/* Time at which the flash finishes all queued work */
+static uint64_t busy_until;
+
+static struct {
+	int32_t error;
+	/* Rejected report the host has not read yet, as in the firmware */
+	int32_t latched;
+	uint32_t bytes_done;
+	uint32_t peak;
+	uint32_t waits;
+	uint32_t mismatch;
+	uint32_t nonblank;
+} stats = {.mismatch = UINT32_MAX, .nonblank = UINT32_MAX};
+
+static struct {
+	uint8_t cmd;
+	uint32_t addr;
+	uint32_t remaining;
+	uint32_t total;
+	uint64_t started;
+} stream;
+
+static struct {
+	uint32_t offset;
+	uint32_t first;
+	uint32_t total;
+} reply;
+
+static FILE *csv;
+static volatile sig_atomic_t stop;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void sleep_until(uint64_t t)
+{
+	uint64_t now = now_us();
+	struct timespec ts;
+
+	if (t <= now) {
+		return;
+	}
+
+	ts.tv_sec = (t - now) / 1000000;
+	ts.tv_nsec = ((t - now) % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+}
+
+static void put_le16(uint8_t *p, uint16_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+}
+
+static void put_le32(uint8_t *p, uint32_t v)
+{
+	put_le16(p, v);
+	put_le16(p + 2, v >> 16);
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint32_t crc32_ieee(const uint8_t *data, size_t len)
+{
+	uint32_t crc = ~0U;
+
+	while (len--) {
+		crc ^= *data++;
+		for (int i = 0; i < 8; i++) {
+			crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+		}
+	}
+
+	return ~crc;
+}
+
+/**
+ * @brief Retire page buffers whose program time has passed
+ */
+static void retire(uint64_t now)
+{
+	while (queue.count && queue.done_at[queue.head] <= now) {
+		stats.bytes_done += queue.bytes[queue.head];
+		queue.head = (queue.head + 1) % POOL_COUNT;
+		queue.count--;
+	}
+}
+
+/**
+ * @brief Account a flash operation taking @p us after queued work
+ *
+ * Blocks like the firmware does when every page buffer is in use.
+ */
+static void schedule(uint32_t us, uint32_t bytes)
+{
+	uint64_t now = now_us();
+
+	retire(now);
+	if (queue.count == POOL_COUNT) {
+		stats.waits++;
+		sleep_until(queue.done_at[queue.head]);
+		now = now_us();
+		retire(now);
+	}
+
+	busy_until = (busy_until > now ? busy_until : now) + us;
+	queue.done_at[(queue.head + queue.count) % POOL_COUNT] = busy_until;
+	queue.bytes[(queue.head + queue.count) % POOL_COUNT] = bytes;
+	queue.count++;
+	if ((uint32_t)queue.count > stats.peak) {
+		stats.peak = queue.count;
+	}
+}
+
+static uint32_t spi_us(uint32_t bytes)
+{
+	return (uint32_t)((uint64_t)bytes * 8 * 1000000 / timing.spi_hz);
+}
+
+static void erase(uint32_t addr, uint32_t size, uint32_t us)
+{
+	memset(&flash[addr], 0xFF, size);
+	schedule(us, 0);
+}
+
+static void stream_finish(void)
+{
+	uint64_t end = busy_until > now_us() ? busy_until : now_us();
+	double secs = (end - stream.started) / 1e6;
+
+	if (stream.cmd != FLASHER_CMD_WRITE) {
+		return;
+	}
+
+	printf("wrote %u bytes in %.3f s (%.1f KiB/s)\n", stream.total, secs,
+	       stream.total / 1024.0 / secs);
+	if (csv) {
+		fprintf(csv, "%llu,%u,%.6f\n",
+			(unsigned long long)stream.started, stream.total, secs);
+		fflush(csv);
+	}
+}
+
+/**
+ * @brief Store or compare one data report of a stream
+ */
+static void stream_data(const uint8_t *buf, size_t len)
+{
+	size_t avail = len < stream.remaining ? len : stream.remaining;
+
+	while (avail) {
+		size_t room = PAGE_SIZE - stream.addr % PAGE_SIZE;
+		size_t chunk = avail < room ? avail : room;
+
+		if (stream.cmd == FLASHER_CMD_WRITE) {
+			/* NOR flash can only clear bits */
+			for (size_t i = 0; i < chunk; i++) {
+				flash[stream.addr + i] &= buf[i];
+			}
+			schedule(spi_us(4 + chunk) + timing.page_us, chunk);
+		} else {
+			for (size_t i = 0; i < chunk; i++) {
+				if (flash[stream.addr + i] != buf[i] &&
+				    stream.addr + i < stats.mismatch) {
+					stats.mismatch = stream.addr + i;
+					stats.error = -EIO;
+				}
+			}
+			schedule(spi_us(4 + chunk), 0);
+		}
+
+		buf += chunk;
+		avail -= chunk;
+		stream.addr += chunk;
+		stream.remaining -= chunk;
+	}
+
+	if (stream.remaining == 0) {
+		stream_finish();
+	}
+}
+
+static int handle_command(const uint8_t *buf)
+{
+	uint32_t addr = get_le32(&buf[FLASHER_ARG_ADDR]);
+	uint32_t count = get_le32(&buf[FLASHER_ARG_LEN]);
+
+	stats.error = 0;
+	stats.mismatch = UINT32_MAX;
+	stats.nonblank = UINT32_MAX;
+	reply.total = 0;
+
+	switch (buf[0]) {
+	case FLASHER_CMD_ERASE_CHIP:
+		erase(0, FLASH_SIZE, timing.chip_us);
+		return 0;
+	case FLASHER_CMD_ERASE_64K:
+		if (addr % BLOCK_SIZE || count == 0 ||
+		    addr + (uint64_t)count * BLOCK_SIZE > FLASH_SIZE) {
+			return -EINVAL;
+		}
+		/* One range job in the firmware */
+		erase(addr, count * BLOCK_SIZE, count * timing.block_us);
+		return 0;
+	case FLASHER_CMD_WRITE:
+	case FLASHER_CMD_VERIFY:
+		if (count == 0 || addr + (uint64_t)count > FLASH_SIZE ||
+		    (buf[FLASHER_ARG_FLAGS] & FLASHER_WRITE_IMAGE)) {
+			return -EINVAL;
+		}
+		stream.cmd = buf[0];
+		stream.addr = addr;
+		stream.remaining = count;
+		stream.total = count;
+		stream.started = now_us();
+		return 0;
+	case FLASHER_CMD_BLANK_CHECK:
+		if (count == 0 || addr + (uint64_t)count > FLASH_SIZE) {
+			return -EINVAL;
+		}
+		/* The scan stops at the first non-blank byte */
+		for (uint32_t i = 0; i < count; i++) {
+			if (flash[addr + i] != 0xFF) {
+				stats.nonblank = addr + i;
+				count = i + 1;
+				break;
+			}
+		}
+		schedule(spi_us(count), 0);
+		return 0;
+	case FLASHER_CMD_SELECT:
+		return get_le32(&buf[FLASHER_ARG_MASK]) == 1 ? 0 : -EINVAL;
+	case FLASHER_CMD_INDEX:
+		if (count == 0) {
+			count = FLASH_SIZE / SECTOR_SIZE - addr;
+		}
+		if (addr + (uint64_t)count > FLASH_SIZE / SECTOR_SIZE) {
+			return -EINVAL;
+		}
+		/* Rehashing reads each sector once */
+		schedule(spi_us(count * SECTOR_SIZE), 0);
+		reply.first = addr;
+		reply.offset = 0;
+		reply.total = count * sizeof(uint32_t);
+		return 0;
+	default:
+		return -ENOTSUP;
+	}
+}
+
+static void handle_report(const uint8_t *buf, size_t len)
+{
+	int err;
+
+	/* hidraw prefixes unnumbered reports with report ID 0 */
+	if (len == REPORT_SIZE + 1 && buf[0] == 0) {
+		buf++;
+		len--;
+	}
+
+	if (stream.remaining) {
+		stream_data(buf, len);
+		return;
+	}
+
+	if (len < FLASHER_ARG_FLAGS + 1) {
+		return;
+	}
+
+	err = stats.latched ? stats.latched : handle_command(buf);
+	if (err) {
+		if (!stats.latched) {
+			stats.latched = err;
+		}
+		fprintf(stderr, "command 0x%02X rejected: %d\n", buf[0], err);
+	}
+}
+
+static size_t fill_reply(uint8_t *buf)
+{
+	uint32_t chunk = reply.total - reply.offset;
+
+	if (chunk > (REPORT_SIZE - FLASHER_REPLY_DATA) / 4 * 4) {
+		chunk = (REPORT_SIZE - FLASHER_REPLY_DATA) / 4 * 4;
+	}
+
+	for (uint32_t i = 0; i < chunk; i += 4) {
+		uint32_t sector = reply.first + (reply.offset + i) / 4;
+
+		put_le32(&buf[FLASHER_REPLY_DATA + i],
+			 crc32_ieee(&flash[sector * SECTOR_SIZE], SECTOR_SIZE));
+	}
+
+	buf[FLASHER_REPLY_STATE] = FLASHER_STATE_REPLY;
+	buf[FLASHER_REPLY_CMD] = FLASHER_CMD_INDEX;
+	put_le32(&buf[FLASHER_REPLY_OFFSET], reply.offset);
+	put_le16(&buf[FLASHER_REPLY_LEN], chunk);
+
+	reply.offset += chunk;
+	if (reply.offset == reply.total) {
+		reply.total = 0;
+	}
+
+	return REPORT_SIZE;
+}
+
+static size_t fill_status(uint8_t *buf)
+{
+	uint64_t now = now_us();
+	bool busy = busy_until > now;
+
+	retire(now);
+	memset(buf, 0, REPORT_SIZE);
+
+	if (reply.total && !busy) {
+		return fill_reply(buf);
+	}
+
+	buf[FLASHER_STATUS_STATE] = stream.remaining ? FLASHER_STATE_STREAMING :
+				    busy ? FLASHER_STATE_BUSY :
+					   FLASHER_STATE_IDLE;
+	put_le32(&buf[FLASHER_STATUS_ERROR],
+		 stats.latched ? stats.latched : stats.error);
+	if (buf[FLASHER_STATUS_STATE] == FLASHER_STATE_IDLE) {
+		stats.latched = 0;
+	}
+	put_le32(&buf[FLASHER_STATUS_DONE], stats.bytes_done);
+	buf[FLASHER_STATUS_POOL_TOTAL] = POOL_COUNT;
+	buf[FLASHER_STATUS_POOL_PEAK] = stats.peak;
+	put_le16(&buf[FLASHER_STATUS_POOL_WAITS], stats.waits);
+	buf[FLASHER_STATUS_SELECTED] = 1;
+	buf[FLASHER_STATUS_FAILED] = stats.error ? 1 : 0;
+	put_le32(&buf[FLASHER_STATUS_MISMATCH], stats.mismatch);
+	buf[FLASHER_STATUS_FPGA_STATE] = FLASHER_FPGA_NO_CDONE;
+	put_le32(&buf[FLASHER_STATUS_NONBLANK], stats.nonblank);
+
+	return REPORT_SIZE;
+}
+
+/* No codecs, extra transports or optional features are modelled */
+static size_t fill_caps(uint8_t *buf)
+{
+	memset(buf, 0, FLASHER_CAPS_SIZE);
+	put_le16(&buf[FLASHER_CAPS_VERSION], FLASHER_PROTOCOL_VERSION);
+	put_le16(&buf[FLASHER_CAPS_IN_SIZE], REPORT_SIZE);
+	put_le16(&buf[FLASHER_CAPS_OUT_SIZE], REPORT_SIZE);
+	buf[FLASHER_CAPS_WINDOW] = POOL_COUNT;
+	buf[FLASHER_CAPS_TARGETS] = 1;
+	put_le32(&buf[FLASHER_CAPS_FLASH_SIZE], FLASH_SIZE);
+	put_le16(&buf[FLASHER_CAPS_PAGE_SIZE], PAGE_SIZE);
+	put_le32(&buf[FLASHER_CAPS_SECTOR_SIZE], SECTOR_SIZE);
+	put_le32(&buf[FLASHER_CAPS_BLOCK_SIZE], BLOCK_SIZE);
+	put_le32(&buf[FLASHER_CAPS_SPI_FREQ], timing.spi_hz);
+
+	return FLASHER_CAPS_SIZE;
+}
+
+static int uhid_write(int fd, const struct uhid_event *ev)
+{
+	ssize_t ret = write(fd, ev, sizeof(*ev));
+
+	return ret == sizeof(*ev) ? 0 : -EIO;
+}
+
+static int create(int fd)
+{
+	struct uhid_event ev = {.type = UHID_CREATE2};
+
+	snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name), "%s",
+		 SIM_NAME);
+	snprintf((char *)ev.u.create2.uniq, sizeof(ev.u.create2.uniq),
+		 "SIM%08X", (unsigned int)getpid());
+	memcpy(ev.u.create2.rd_data, report_desc, sizeof(report_desc));
+	ev.u.create2.rd_size = sizeof(report_desc);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = SIM_VID;
+	ev.u.create2.product = SIM_PID;
+
+	return uhid_write(fd, &ev);
+}
+
+static int handle_event(int fd)
+{
+	struct uhid_event ev;
+	struct uhid_event rsp = {0};
+	ssize_t ret;
+
+	ret = read(fd, &ev, sizeof(ev));
+	if (ret <= 0) {
+		return ret == 0 ? -EIO : -errno;
+	}
+
+	switch (ev.type) {
+	case UHID_OUTPUT:
+		handle_report(ev.u.output.data, ev.u.output.size);
+		return 0;
+	case UHID_SET_REPORT:
+		rsp.type = UHID_SET_REPORT_REPLY;
+		rsp.u.set_report_reply.id = ev.u.set_report.id;
+		if (ev.u.set_report.rtype == UHID_FEATURE_REPORT) {
+			rsp.u.set_report_reply.err = EIO;
+		} else {
+			handle_report(ev.u.set_report.data,
+				      ev.u.set_report.size);
+		}
+		return uhid_write(fd, &rsp);
+	case UHID_GET_REPORT:
+		rsp.type = UHID_GET_REPORT_REPLY;
+		rsp.u.get_report_reply.id = ev.u.get_report.id;
+		/* Report ID 0 first, as usbhid returns it */
+		rsp.u.get_report_reply.size = 1 +
+			(ev.u.get_report.rtype == UHID_FEATURE_REPORT ?
+				 fill_caps(&rsp.u.get_report_reply.data[1]) :
+				 fill_status(&rsp.u.get_report_reply.data[1]));
+		return uhid_write(fd, &rsp);
+	default:
+		return 0;
+	}
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	stop = 1;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  --spi-hz N      SPI clock (default %u)\n"
+		"  --page-us N     page program time (default %u)\n"
+		"  --sector-us N   4KB sector erase time (default %u)\n"
+		"  --block-us N    64KB block erase time (default %u)\n"
+		"  --chip-us N     chip erase time (default %u)\n"
+		"  --image FILE    initial flash contents\n"
+		"  --csv FILE      append one line per write stream\n",
+		prog, timing.spi_hz, timing.page_us, timing.sector_us,
+		timing.block_us, timing.chip_us);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option opts[] = {
+		{"spi-hz", required_argument, NULL, 's'},
+		{"page-us", required_argument, NULL, 'p'},
+		{"sector-us", required_argument, NULL, 'e'},
+		{"block-us", required_argument, NULL, 'b'},
+		{"chip-us", required_argument, NULL, 'c'},
+		{"image", required_argument, NULL, 'i'},
+		{"csv", required_argument, NULL, 'o'},
+		{"help", no_argument, NULL, 'h'},
+		{0},
+	};
+	struct uhid_event destroy = {.type = UHID_DESTROY};
+	struct pollfd pfd;
+	FILE *img;
+	int opt;
+	int fd;
+
+	memset(flash, 0xFF, sizeof(flash));
+
+	while ((opt = getopt_long(argc, argv, "h", opts, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			timing.spi_hz = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			timing.page_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			timing.sector_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			timing.block_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			timing.chip_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			img = fopen(optarg, "rb");
+			if (!img) {
+				perror(optarg);
+				return 1;
+			}
+			(void)!fread(flash, 1, sizeof(flash), img);
+			fclose(img);
+			break;
+		case 'o':
+			csv = fopen(optarg, "a");
+			if (!csv) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (timing.spi_hz == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	fd = open("/dev/uhid", O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		perror("/dev/uhid");
+		return 1;
+	}
+
+	if (create(fd)) {
+		fprintf(stderr, "failed to create HID device\n");
+		return 1;
+	}
+
+	signal(SIGINT, on_signal);
+	signal(SIGTERM, on_signal);
+	printf("simulated flasher %04x:%04x ready\n", SIM_VID, SIM_PID);
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!stop) {
+		if (poll(&pfd, 1, -1) <= 0) {
+			continue;
+		}
+		if (handle_event(fd)) {
+			break;
+		}
+	}
+
+	uhid_write(fd, &destroy);
+	close(fd);
+	return 0;
+}
@@ -0,0 +1,90 @@
+/**
+ * @file program.cpp
+ * @brief Program an image into every attached flasher at once
+ *
+ *     flasher-program top.bin [--no-verify]
+ *
+ * Prints the time of each phase per device once it finishes.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+
+#include <flasher/flasher.hpp>
+
+int main(int argc, char **argv)
+{
+	flasher::program_options opts;
+	std::vector<std::unique_ptr<flasher::device>> devs;
+	std::vector<std::future<flasher::result>> jobs;
+	std::vector<std::string> serials;
+	std::mutex print_lock;
+	int failed = 0;
+
+	if (argc < 2 || (argc > 2 && strcmp(argv[2], "--no-verify"))) {
+		fprintf(stderr, "usage: %s IMAGE [--no-verify]\n", argv[0]);
+		return 2;
+	}
+	opts.verify = argc == 2;
+
+	std::ifstream f(argv[1], std::ios::binary);
+	std::vector<uint8_t> image((std::istreambuf_iterator<char>(f)),
+				   std::istreambuf_iterator<char>());
+	if (!f.good() && !f.eof()) {
+		fprintf(stderr, "cannot read %s\n", argv[1]);
+		return 1;
+	}
+
+	for (const auto &info : flasher::enumerate()) {
+		try {
+			devs.push_back(flasher::device::open(info));
+		} catch (const flasher::error &e) {
+			fprintf(stderr, "%s: %s\n", info.serial.c_str(),
+				e.what());
+			failed++;
+			continue;
+		}
+
+		std::string serial = info.serial;
+		serials.push_back(serial);
+		jobs.push_back(devs.back()->program(
+			image, 0, opts,
+			[&print_lock, serial](const flasher::result &r,
+					      std::exception_ptr err) {
+				std::lock_guard<std::mutex> guard(print_lock);
+
+				if (err) {
+					return;
+				}
+				printf("%s: %zu bytes, erase %lld us, send %lld us, "
+				       "drain %lld us, %u window stalls\n",
+				       serial.c_str(), r.bytes,
+				       (long long)r.timing.erase.count(),
+				       (long long)r.timing.send.count(),
+				       (long long)r.timing.drain.count(),
+				       r.timing.window_stalls);
+			}));
+	}
+
+	if (devs.empty()) {
+		fprintf(stderr, "no flashers found\n");
+		return 1;
+	}
+
+	for (size_t i = 0; i < jobs.size(); i++) {
+		try {
+			jobs[i].get();
+		} catch (const flasher::error &e) {
+			std::lock_guard<std::mutex> guard(print_lock);
+
+			fprintf(stderr, "%s: FAILED: %s\n", serials[i].c_str(),
+				e.what());
+			failed++;
+		}
+	}
+
+	return failed ? 1 : 0;
+}
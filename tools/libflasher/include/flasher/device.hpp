@@ -0,0 +1,195 @@
+/**
+ * @file device.hpp
+ * @brief Asynchronous, pipelined flashing API for one attached flasher
+ *
+ * Each device owns a worker thread that runs its operations in
+ * submission order; operations may be submitted from any thread, and
+ * several devices run in parallel. Every operation returns a future and
+ * optionally calls a completion callback on the worker thread before the
+ * future becomes ready.
+ *
+ * Data streams are windowed: the host keeps at most the device's page
+ * pool worth of unprogrammed data in flight, tracked through the bytes
+ * programmed counter of the status report, so the device never has to
+ * abort a stream for lack of page buffers.
+ */
+
+#ifndef FLASHER_DEVICE_HPP
+#define FLASHER_DEVICE_HPP
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "transport.hpp"
+
+namespace flasher {
+
+/**
+ * @brief Capability report of a device (FLASHER_CAPS_* in flasher_proto.h)
+ *
+ * Firmware without the report is described with protocol version 0 and
+ * the 64-byte, SET_REPORT-only defaults.
+ */
+struct caps {
+	uint16_t version = 0;
+	uint16_t in_size = 64;
+	uint16_t out_size = 64;
+	uint8_t transports = 0;
+	uint8_t codecs = 0;
+	uint8_t window = 4;
+	uint8_t targets = 1;
+	uint16_t features = 0;
+	uint32_t flash_size = 0x200000;
+	uint16_t page_size = 256;
+	uint32_t sector_size = 0x1000;
+	uint32_t block_size = 0x10000;
+	std::vector<uint32_t> spi_hz;
+};
+
+/**
+ * @brief Time spent in each phase of an operation
+ *
+ * Phases an operation does not have stay zero. "send" is the time the
+ * host spent streaming data reports, "drain" the time the device needed
+ * afterwards to finish the queued jobs.
+ */
+struct timing {
+	std::chrono::microseconds erase{0};
+	std::chrono::microseconds send{0};
+	std::chrono::microseconds drain{0};
+	std::chrono::microseconds read{0};
+	std::chrono::microseconds total{0};
+	/** Status polls that found the window full */
+	uint32_t window_stalls = 0;
+};
+
+/**
+ * @brief Outcome of a completed operation
+ */
+struct result {
+	/** Flash contents, for readback only */
+	std::vector<uint8_t> data;
+	/** Bytes written, verified or read */
+	size_t bytes = 0;
+	struct timing timing;
+};
+
+/**
+ * @brief Options of program()
+ */
+struct program_options {
+	/** Read back each page after programming it */
+	bool verify = true;
+	/** Erase the 64KB blocks covering the image first */
+	bool erase = true;
+	/** Bytes in flight; 0 = page pool size from the capabilities */
+	uint32_t window = 0;
+	/** Longest the device may stay busy in one phase */
+	std::chrono::milliseconds timeout{60000};
+};
+
+/**
+ * @brief Called on the worker thread when an operation ends
+ *
+ * @p err is null on success; the result is only meaningful then.
+ */
+using completion = std::function<void(const result &, std::exception_ptr err)>;
+
+/**
+ * @brief One attached flasher with its own worker thread
+ */
+class device {
+public:
+	/**
+	 * @brief Take over a transport and read the device capabilities
+	 */
+	explicit device(std::unique_ptr<transport> t);
+
+	/**
+	 * @brief Open a flasher found by enumerate()
+	 */
+	static std::unique_ptr<device> open(const device_info &info);
+
+	/**
+	 * @brief Finish all submitted operations and stop the worker
+	 */
+	~device();
+
+	device(const device &) = delete;
+	device &operator=(const device &) = delete;
+
+	const struct caps &caps() const noexcept
+	{
+		return caps_;
+	}
+
+	/**
+	 * @brief Erase, write and optionally verify an image
+	 *
+	 * @param image Bytes to write
+	 * @param addr Flash address, 64KB aligned when erasing
+	 * @param opts Erase, verify and flow control options
+	 * @param done Optional completion callback
+	 */
+	std::future<result> program(std::vector<uint8_t> image,
+				    uint32_t addr = 0,
+				    const program_options &opts = {},
+				    completion done = {});
+
+	/**
+	 * @brief Compare the flash with an image without writing
+	 *
+	 * Fails with the device's error and first mismatching address.
+	 */
+	std::future<result> verify(std::vector<uint8_t> image,
+				   uint32_t addr = 0, completion done = {});
+
+	/**
+	 * @brief Read flash contents of the lowest selected target
+	 *
+	 * Uses on-device run-length encoding when the firmware offers it.
+	 */
+	std::future<result> readback(uint32_t addr, uint32_t len,
+				     completion done = {});
+
+private:
+	using clock = std::chrono::steady_clock;
+
+	std::future<result> submit(std::function<result()> op,
+				   completion done);
+	void run();
+
+	void command(uint8_t cmd, uint32_t addr, uint32_t count,
+		     uint8_t flags = 0, bool check = true);
+	std::vector<uint8_t> status();
+	std::vector<uint8_t> wait_idle(std::chrono::milliseconds timeout);
+	void stream(const std::vector<uint8_t> &data, uint32_t window,
+		    bool windowed, struct timing &t);
+
+	result do_program(const std::vector<uint8_t> &image, uint32_t addr,
+			  const program_options &opts);
+	result do_verify(const std::vector<uint8_t> &image, uint32_t addr);
+	result do_readback(uint32_t addr, uint32_t len);
+
+	std::unique_ptr<transport> transport_;
+	struct caps caps_;
+
+	std::mutex lock_;
+	std::condition_variable wake_;
+	std::deque<std::function<void()>> queue_;
+	bool stopping_ = false;
+	std::thread worker_;
+};
+
+} // namespace flasher
+
+#endif /* FLASHER_DEVICE_HPP */
@@ -0,0 +1,17 @@
+/**
+ * @file flasher.hpp
+ * @brief C++ host library for ICE40 flashers attached over USB HID
+ *
+ *     for (auto &info : flasher::enumerate()) {
+ *         auto dev = flasher::device::open(info);
+ *         auto r = dev->program(image).get();
+ *     }
+ */
+
+#ifndef FLASHER_FLASHER_HPP
+#define FLASHER_FLASHER_HPP
+
+#include "device.hpp"
+#include "transport.hpp"
+
+#endif /* FLASHER_FLASHER_HPP */
@@ -0,0 +1,110 @@
+/**
+ * @file transport.hpp
+ * @brief Report-level access to one attached flasher
+ *
+ * A transport moves whole HID reports without a report ID; the wire
+ * format on top of it lives in device.cpp. Which backend implements
+ * enumerate() and open_transport() is chosen at build time (hidapi where
+ * available, Linux hidraw otherwise).
+ */
+
+#ifndef FLASHER_TRANSPORT_HPP
+#define FLASHER_TRANSPORT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace flasher {
+
+/* Must match usbd_init.c */
+constexpr uint16_t usb_vid = 0x2FE3;
+constexpr uint16_t usb_pid = 0x1193;
+
+/**
+ * @brief Failure reported by the transport or the device
+ *
+ * code() is a positive errno value: from the OS for transport errors,
+ * negated from the status report for device errors.
+ */
+class error : public std::runtime_error {
+public:
+	error(const std::string &what, int code)
+		: std::runtime_error(what), code_(code)
+	{
+	}
+
+	int code() const noexcept
+	{
+		return code_;
+	}
+
+private:
+	int code_;
+};
+
+/**
+ * @brief Attached flasher found by enumerate()
+ */
+struct device_info {
+	/** Backend-specific path passed to open_transport() */
+	std::string path;
+	/** Serial number derived from the MCU unique ID */
+	std::string serial;
+};
+
+/**
+ * @brief HID report channel to one device
+ *
+ * Not thread-safe; a device object serializes all access.
+ */
+class transport {
+public:
+	virtual ~transport() = default;
+
+	/**
+	 * @brief Send one OUT report
+	 *
+	 * @param report Report contents, already padded to the OUT size
+	 * @param len Report length in bytes
+	 */
+	virtual void write(const uint8_t *report, size_t len) = 0;
+
+	/**
+	 * @brief Read the input report with GET_REPORT
+	 *
+	 * @param buf Destination buffer
+	 * @param len Size of @p buf, the IN report size
+	 * @return Number of bytes received
+	 */
+	virtual size_t get_input(uint8_t *buf, size_t len) = 0;
+
+	/**
+	 * @brief Read the feature report with GET_REPORT
+	 *
+	 * @param buf Destination buffer
+	 * @param len Size of @p buf
+	 * @return Number of bytes received
+	 * @throws error if the device stalls the request
+	 */
+	virtual size_t get_feature(uint8_t *buf, size_t len) = 0;
+};
+
+/**
+ * @brief List every attached flasher
+ */
+std::vector<device_info> enumerate();
+
+/**
+ * @brief Open a flasher found by enumerate()
+ *
+ * @throws error if the device cannot be opened
+ */
+std::unique_ptr<transport> open_transport(const device_info &info);
+
+} // namespace flasher
+
+#endif /* FLASHER_TRANSPORT_HPP */
@@ -0,0 +1,505 @@
+/**
+ * @file device.cpp
+ * @brief Wire protocol and worker thread of a flasher device
+ *
+ * Mirrors scripts/flasher.py; the report layout comes straight from
+ * app/src/flasher_proto.h.
+ */
+
+#include "flasher/device.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#include "flasher_proto.h"
+
+namespace flasher {
+
+namespace {
+
+/* Pause between status polls while the device works */
+constexpr auto poll_interval = std::chrono::milliseconds(2);
+/* Longest a verify or readback phase may take */
+constexpr auto phase_timeout = std::chrono::milliseconds(60000);
+
+uint16_t get_le16(const uint8_t *p)
+{
+	return p[0] | p[1] << 8;
+}
+
+uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+void put_le32(uint8_t *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+template <typename D> std::chrono::microseconds us(D d)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(d);
+}
+
+/* Expand one run-length encoded reply (see app/src/readback.h) */
+std::vector<uint8_t> rle_decode(const uint8_t *data, size_t len)
+{
+	std::vector<uint8_t> out;
+	size_t i = 0;
+
+	while (i < len) {
+		uint8_t c = data[i];
+
+		if (c < 0x80) {
+			size_t n = c + 1;
+
+			if (i + 1 + n > len) {
+				throw error("truncated RLE literal", EPROTO);
+			}
+			out.insert(out.end(), &data[i + 1], &data[i + 1 + n]);
+			i += 1 + n;
+		} else {
+			if (i + 3 > len) {
+				throw error("truncated RLE run", EPROTO);
+			}
+			size_t run = ((c & 0x7F) << 8 | data[i + 1]) + 1;
+
+			out.insert(out.end(), run, data[i + 2]);
+			i += 3;
+		}
+	}
+
+	return out;
+}
+
+struct caps parse_caps(const uint8_t *buf, size_t len)
+{
+	struct caps c;
+
+	if (len < FLASHER_CAPS_SPI_FREQ) {
+		throw error("short capability report", EPROTO);
+	}
+
+	c.version = get_le16(&buf[FLASHER_CAPS_VERSION]);
+	c.in_size = get_le16(&buf[FLASHER_CAPS_IN_SIZE]);
+	c.out_size = get_le16(&buf[FLASHER_CAPS_OUT_SIZE]);
+	c.transports = buf[FLASHER_CAPS_TRANSPORTS];
+	c.codecs = buf[FLASHER_CAPS_CODECS];
+	c.window = buf[FLASHER_CAPS_WINDOW];
+	c.targets = buf[FLASHER_CAPS_TARGETS];
+	c.features = get_le16(&buf[FLASHER_CAPS_FEATURES]);
+	c.flash_size = get_le32(&buf[FLASHER_CAPS_FLASH_SIZE]);
+	c.page_size = get_le16(&buf[FLASHER_CAPS_PAGE_SIZE]);
+	c.sector_size = get_le32(&buf[FLASHER_CAPS_SECTOR_SIZE]);
+	c.block_size = get_le32(&buf[FLASHER_CAPS_BLOCK_SIZE]);
+	for (size_t i = 0; i < c.targets; i++) {
+		size_t off = FLASHER_CAPS_SPI_FREQ + i * sizeof(uint32_t);
+
+		if (off + sizeof(uint32_t) <= len) {
+			c.spi_hz.push_back(get_le32(&buf[off]));
+		}
+	}
+
+	if (c.in_size < FLASHER_STATUS_SIZE ||
+	    c.out_size < FLASHER_REPORT_SIZE_MIN || c.block_size == 0 ||
+	    c.page_size == 0) {
+		throw error("invalid capability report", EPROTO);
+	}
+
+	return c;
+}
+
+} // namespace
+
+device::device(std::unique_ptr<transport> t) : transport_(std::move(t))
+{
+	std::vector<uint8_t> buf(FLASHER_CAPS_SIZE);
+
+	try {
+		size_t n = transport_->get_feature(buf.data(), buf.size());
+
+		caps_ = parse_caps(buf.data(), n);
+	} catch (const error &) {
+		/* Firmware before the capability report */
+		caps_ = {};
+	}
+
+	worker_ = std::thread(&device::run, this);
+}
+
+std::unique_ptr<device> device::open(const device_info &info)
+{
+	return std::make_unique<device>(open_transport(info));
+}
+
+device::~device()
+{
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+		stopping_ = true;
+	}
+	wake_.notify_one();
+	worker_.join();
+}
+
+void device::run()
+{
+	std::function<void()> task;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> guard(lock_);
+
+			wake_.wait(guard,
+				   [this] { return stopping_ || !queue_.empty(); });
+			if (queue_.empty()) {
+				return;
+			}
+			task = std::move(queue_.front());
+			queue_.pop_front();
+		}
+
+		task();
+	}
+}
+
+std::future<result> device::submit(std::function<result()> op,
+				   completion done)
+{
+	auto promise = std::make_shared<std::promise<result>>();
+	auto future = promise->get_future();
+
+	{
+		std::lock_guard<std::mutex> guard(lock_);
+
+		queue_.emplace_back([op = std::move(op), done = std::move(done),
+				     promise] {
+			std::exception_ptr err;
+			result r;
+
+			try {
+				r = op();
+			} catch (...) {
+				err = std::current_exception();
+			}
+
+			/* A throwing callback must not lose the result */
+			if (done) {
+				try {
+					done(r, err);
+				} catch (...) {
+				}
+			}
+
+			if (err) {
+				promise->set_exception(err);
+			} else {
+				promise->set_value(std::move(r));
+			}
+		});
+	}
+	wake_.notify_one();
+
+	return future;
+}
+
+/**
+ * @brief Send a command and make sure the device took it
+ *
+ * A rejected command leaves its error latched in the status, so it is
+ * caught here before any data follows. Commands with a reply pass
+ * @p check false: the status read would take the first part.
+ */
+void device::command(uint8_t cmd, uint32_t addr, uint32_t count,
+		     uint8_t flags, bool check)
+{
+	std::vector<uint8_t> report(caps_.out_size);
+
+	report[0] = cmd;
+	put_le32(&report[FLASHER_ARG_ADDR], addr);
+	put_le32(&report[FLASHER_ARG_LEN], count);
+	report[FLASHER_ARG_FLAGS] = flags;
+
+	transport_->write(report.data(), report.size());
+	if (!check) {
+		return;
+	}
+
+	int32_t err = (int32_t)get_le32(&status()[FLASHER_STATUS_ERROR]);
+
+	if (err) {
+		char what[64];
+
+		snprintf(what, sizeof(what),
+			 "command 0x%02X rejected (device error %d)", cmd,
+			 (int)err);
+		throw error(what, err < 0 ? -err : err);
+	}
+}
+
+std::vector<uint8_t> device::status()
+{
+	std::vector<uint8_t> buf(caps_.in_size);
+	size_t n = transport_->get_input(buf.data(), buf.size());
+
+	if (n < FLASHER_STATUS_SIZE) {
+		throw error("short status report", EPROTO);
+	}
+
+	return buf;
+}
+
+/**
+ * @brief Poll until the device has no queued work, then check errors
+ */
+std::vector<uint8_t> device::wait_idle(std::chrono::milliseconds timeout)
+{
+	auto deadline = clock::now() + timeout;
+	std::vector<uint8_t> st;
+
+	while (true) {
+		st = status();
+		if (st[FLASHER_STATUS_STATE] == FLASHER_STATE_IDLE) {
+			break;
+		}
+		if (clock::now() > deadline) {
+			throw error("timed out waiting for device", ETIMEDOUT);
+		}
+		std::this_thread::sleep_for(poll_interval);
+	}
+
+	int32_t err = (int32_t)get_le32(&st[FLASHER_STATUS_ERROR]);
+
+	if (err) {
+		uint32_t mismatch = get_le32(&st[FLASHER_STATUS_MISMATCH]);
+		char where[40] = "";
+
+		if (mismatch != UINT32_MAX) {
+			snprintf(where, sizeof(where),
+				 " (first mismatch at 0x%06X)", mismatch);
+		}
+		throw error("device error " + std::to_string(err) + where,
+			    err < 0 ? -err : err);
+	}
+
+	return st;
+}
+
+/**
+ * @brief Send a data stream in reports of the OUT size
+ *
+ * With @p windowed the stream pauses whenever more than @p window bytes
+ * are sent but not yet programmed. A device that left the STREAMING
+ * state gave up on the stream; one that shows an error while streaming
+ * discards the rest, which is then sent without waiting.
+ */
+void device::stream(const std::vector<uint8_t> &data, uint32_t window,
+		    bool windowed, struct timing &t)
+{
+	std::vector<uint8_t> report(caps_.out_size);
+	std::vector<uint8_t> st = status();
+	size_t step = caps_.out_size;
+	uint32_t base = get_le32(&st[FLASHER_STATUS_DONE]);
+	uint32_t done = 0;
+	bool aborted = false;
+	auto start = clock::now();
+
+	window = std::max<uint32_t>(window, step);
+
+	for (size_t off = 0; off < data.size(); off += step) {
+		size_t len = std::min(step, data.size() - off);
+
+		while (!aborted) {
+			if (st[FLASHER_STATUS_STATE] != FLASHER_STATE_STREAMING) {
+				wait_idle(phase_timeout);
+				throw error("stream aborted by device", EIO);
+			}
+			if (get_le32(&st[FLASHER_STATUS_ERROR])) {
+				aborted = true;
+				break;
+			}
+			done = get_le32(&st[FLASHER_STATUS_DONE]) - base;
+			if (!windowed || off + len - done <= window) {
+				break;
+			}
+			st = status();
+			t.window_stalls++;
+		}
+
+		std::fill(report.begin(), report.end(), 0);
+		std::copy_n(&data[off], len, report.begin());
+		transport_->write(report.data(), report.size());
+	}
+
+	t.send = us(clock::now() - start);
+
+	if (aborted) {
+		/* Reports the latched error */
+		wait_idle(phase_timeout);
+		throw error("stream aborted by device", EIO);
+	}
+}
+
+result device::do_program(const std::vector<uint8_t> &image, uint32_t addr,
+			  const program_options &opts)
+{
+	uint32_t block = caps_.block_size;
+	uint32_t window = opts.window;
+	auto start = clock::now();
+	result r;
+
+	if (image.empty()) {
+		return r;
+	}
+
+	if (opts.erase) {
+		uint32_t first = addr - addr % block;
+		uint32_t blocks = (addr % block + image.size() + block - 1) /
+				  block;
+
+		command(FLASHER_CMD_ERASE_64K, first, blocks);
+		wait_idle(opts.timeout);
+		r.timing.erase = us(clock::now() - start);
+	}
+
+	/* Leave one page buffer for the page being received */
+	if (!window) {
+		window = std::max(caps_.window - 1, 1) * caps_.page_size;
+	}
+
+	command(FLASHER_CMD_WRITE, addr, image.size(),
+		opts.verify ? FLASHER_WRITE_VERIFY : 0);
+	stream(image, window, true, r.timing);
+
+	auto drain = clock::now();
+	wait_idle(opts.timeout);
+	r.timing.drain = us(clock::now() - drain);
+
+	r.bytes = image.size();
+	r.timing.total = us(clock::now() - start);
+	return r;
+}
+
+result device::do_verify(const std::vector<uint8_t> &image, uint32_t addr)
+{
+	auto start = clock::now();
+	result r;
+
+	if (image.empty()) {
+		return r;
+	}
+
+	/* Verify jobs do not advance the programmed counter */
+	command(FLASHER_CMD_VERIFY, addr, image.size());
+	stream(image, 0, false, r.timing);
+
+	auto drain = clock::now();
+	wait_idle(phase_timeout);
+	r.timing.drain = us(clock::now() - drain);
+
+	r.bytes = image.size();
+	r.timing.total = us(clock::now() - start);
+	return r;
+}
+
+result device::do_readback(uint32_t addr, uint32_t len)
+{
+	bool rle = caps_.codecs & FLASHER_CODEC_READ_RLE;
+	auto start = clock::now();
+	auto deadline = start + phase_timeout;
+	uint32_t got = 0;
+	result r;
+
+	wait_idle(phase_timeout);
+	command(FLASHER_CMD_READ, addr, len, rle ? FLASHER_READ_RLE : 0,
+		false);
+
+	r.data.resize(len);
+	while (got < len) {
+		auto rep = status();
+
+		if (rep[FLASHER_REPLY_STATE] != FLASHER_STATE_REPLY ||
+		    rep[FLASHER_REPLY_CMD] != FLASHER_CMD_READ) {
+			if (rep[FLASHER_STATUS_STATE] == FLASHER_STATE_IDLE) {
+				int32_t err = (int32_t)get_le32(
+					&rep[FLASHER_STATUS_ERROR]);
+
+				throw error("read ended early at " +
+						    std::to_string(got) +
+						    " bytes (device error " +
+						    std::to_string(err) + ")",
+					    EIO);
+			}
+			if (clock::now() > deadline) {
+				throw error("timed out waiting for device",
+					    ETIMEDOUT);
+			}
+			std::this_thread::sleep_for(poll_interval);
+			continue;
+		}
+
+		uint32_t off = get_le32(&rep[FLASHER_REPLY_OFFSET]);
+		size_t n = get_le16(&rep[FLASHER_REPLY_LEN]);
+
+		if (FLASHER_REPLY_DATA + n > rep.size()) {
+			throw error("oversized reply", EPROTO);
+		}
+
+		const uint8_t *data = &rep[FLASHER_REPLY_DATA];
+		std::vector<uint8_t> plain;
+
+		if (rle) {
+			plain = rle_decode(data, n);
+			data = plain.data();
+			n = plain.size();
+		}
+		if (off > len || n > len - off) {
+			throw error("reply outside the requested range", EPROTO);
+		}
+
+		std::copy_n(data, n, &r.data[off]);
+		got = off + n;
+	}
+
+	r.bytes = len;
+	r.timing.read = us(clock::now() - start);
+	r.timing.total = r.timing.read;
+	return r;
+}
+
+std::future<result> device::program(std::vector<uint8_t> image,
+				    uint32_t addr,
+				    const program_options &opts,
+				    completion done)
+{
+	return submit(
+		[this, image = std::move(image), addr, opts] {
+			return do_program(image, addr, opts);
+		},
+		std::move(done));
+}
+
+std::future<result> device::verify(std::vector<uint8_t> image,
+				   uint32_t addr, completion done)
+{
+	return submit(
+		[this, image = std::move(image), addr] {
+			return do_verify(image, addr);
+		},
+		std::move(done));
+}
+
+std::future<result> device::readback(uint32_t addr, uint32_t len,
+				     completion done)
+{
+	return submit([this, addr, len] { return do_readback(addr, len); },
+		      std::move(done));
+}
+
+} // namespace flasher
@@ -0,0 +1,130 @@
+/**
+ * @file hidapi_transport.cpp
+ * @brief Portable backend on top of hidapi (0.10 or later)
+ */
+
+#include "flasher/transport.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cwchar>
+#include <mutex>
+
+#include <hidapi.h>
+
+namespace flasher {
+
+namespace {
+
+std::once_flag hidapi_once;
+
+void hidapi_init()
+{
+	std::call_once(hidapi_once, [] {
+		if (hid_init()) {
+			throw error("hid_init failed", EIO);
+		}
+	});
+}
+
+std::string narrow(const wchar_t *s)
+{
+	std::string out;
+
+	for (; s && *s; s++) {
+		out += *s < 0x80 ? (char)*s : '?';
+	}
+
+	return out;
+}
+
+class hidapi_transport : public transport {
+public:
+	explicit hidapi_transport(const std::string &path)
+	{
+		hidapi_init();
+		dev_ = hid_open_path(path.c_str());
+		if (!dev_) {
+			throw error("cannot open " + path, ENODEV);
+		}
+	}
+
+	~hidapi_transport() override
+	{
+		hid_close(dev_);
+	}
+
+	void write(const uint8_t *report, size_t len) override
+	{
+		/* Report ID 0 first */
+		buf_.assign(1, 0);
+		buf_.insert(buf_.end(), report, report + len);
+
+		if (hid_write(dev_, buf_.data(), buf_.size()) !=
+		    (int)buf_.size()) {
+			throw failure("OUT report failed");
+		}
+	}
+
+	size_t get_input(uint8_t *buf, size_t len) override
+	{
+		return get(hid_get_input_report, buf, len, "GET_REPORT");
+	}
+
+	size_t get_feature(uint8_t *buf, size_t len) override
+	{
+		return get(hid_get_feature_report, buf, len,
+			   "feature GET_REPORT");
+	}
+
+private:
+	using getter = int (*)(hid_device *, unsigned char *, size_t);
+
+	error failure(const std::string &what)
+	{
+		return error(what + ": " + narrow(hid_error(dev_)), EIO);
+	}
+
+	size_t get(getter fn, uint8_t *buf, size_t len, const char *what)
+	{
+		int n;
+
+		buf_.assign(len + 1, 0);
+		n = fn(dev_, buf_.data(), buf_.size());
+		if (n < 0) {
+			throw failure(what);
+		}
+
+		/* Skip the report ID */
+		n = n > 0 ? n - 1 : 0;
+		std::copy_n(&buf_[1], n, buf);
+		return n;
+	}
+
+	hid_device *dev_;
+	std::vector<uint8_t> buf_;
+};
+
+} // namespace
+
+std::vector<device_info> enumerate()
+{
+	std::vector<device_info> found;
+	hid_device_info *list;
+
+	hidapi_init();
+	list = hid_enumerate(usb_vid, usb_pid);
+	for (auto *d = list; d; d = d->next) {
+		found.push_back({d->path, narrow(d->serial_number)});
+	}
+	hid_free_enumeration(list);
+
+	return found;
+}
+
+std::unique_ptr<transport> open_transport(const device_info &info)
+{
+	return std::make_unique<hidapi_transport>(info.path);
+}
+
+} // namespace flasher
@@ -0,0 +1,133 @@
+/**
+ * @file hidraw_transport.cpp
+ * @brief Linux hidraw backend, no dependencies beyond the kernel headers
+ */
+
+#include "flasher/transport.hpp"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <glob.h>
+#include <linux/hidraw.h>
+#include <strings.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+namespace flasher {
+
+namespace {
+
+error os_error(const std::string &what)
+{
+	int err = errno;
+
+	return error(what + ": " + strerror(err), err);
+}
+
+class hidraw_transport : public transport {
+public:
+	explicit hidraw_transport(const std::string &path)
+	{
+		fd_ = ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+		if (fd_ < 0) {
+			throw os_error("cannot open " + path);
+		}
+	}
+
+	~hidraw_transport() override
+	{
+		::close(fd_);
+	}
+
+	void write(const uint8_t *report, size_t len) override
+	{
+		/* Report ID 0 first */
+		buf_.assign(1, 0);
+		buf_.insert(buf_.end(), report, report + len);
+
+		if (::write(fd_, buf_.data(), buf_.size()) !=
+		    (ssize_t)buf_.size()) {
+			throw os_error("OUT report failed");
+		}
+	}
+
+	size_t get_input(uint8_t *buf, size_t len) override
+	{
+		return get(HIDIOCGINPUT(len + 1), buf, len, "GET_REPORT");
+	}
+
+	size_t get_feature(uint8_t *buf, size_t len) override
+	{
+		return get(HIDIOCGFEATURE(len + 1), buf, len,
+			   "feature GET_REPORT");
+	}
+
+private:
+	size_t get(unsigned long req, uint8_t *buf, size_t len,
+		   const char *what)
+	{
+		int n;
+
+		buf_.assign(len + 1, 0);
+		n = ioctl(fd_, req, buf_.data());
+		if (n < 0) {
+			throw os_error(what);
+		}
+
+		/* Skip the report ID */
+		n = n > 0 ? n - 1 : 0;
+		memcpy(buf, &buf_[1], n);
+		return n;
+	}
+
+	int fd_;
+	std::vector<uint8_t> buf_;
+};
+
+} // namespace
+
+std::vector<device_info> enumerate()
+{
+	char hid_id[32];
+	std::vector<device_info> found;
+	glob_t nodes;
+
+	snprintf(hid_id, sizeof(hid_id), "0003:%08X:%08X", usb_vid, usb_pid);
+
+	if (glob("/sys/class/hidraw/hidraw*", 0, nullptr, &nodes)) {
+		return found;
+	}
+
+	for (size_t i = 0; i < nodes.gl_pathc; i++) {
+		std::string node = nodes.gl_pathv[i];
+		std::ifstream uevent(node + "/device/uevent");
+		std::string line, id, serial;
+
+		while (std::getline(uevent, line)) {
+			if (line.rfind("HID_ID=", 0) == 0) {
+				id = line.substr(7);
+			} else if (line.rfind("HID_UNIQ=", 0) == 0) {
+				serial = line.substr(9);
+			}
+		}
+
+		if (strcasecmp(id.c_str(), hid_id) == 0) {
+			found.push_back({"/dev/" + node.substr(node.rfind('/') + 1),
+					 serial});
+		}
+	}
+
+	globfree(&nodes);
+	return found;
+}
+
+std::unique_ptr<transport> open_transport(const device_info &info)
+{
+	return std::make_unique<hidraw_transport>(info.path);
+}
+
+} // namespace flasher
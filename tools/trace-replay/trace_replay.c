@@ -0,0 +1,489 @@
+/**
+ * @file trace_replay.c
+ * @brief Replay a recorded SPI trace against a W25Q16 timing model
+ *
+ * Reads the records downloaded with "flasher.py trace" (FLASHER_TRACE_*
+ * in flasher_proto.h) and runs them through the same W25Q16 state and
+ * timing model as flasher-sim and the native_sim flash emulator: write
+ * enable latch, busy time per program and erase, and deep power-down.
+ *
+ * For every opcode it reports how long the transactions took on the
+ * board against the time needed to clock their bytes, on four lanes for
+ * the quad commands, and for every program and erase how long the
+ * firmware spent polling against the modelled busy time. Sequences the
+ * flash would have rejected, such as a program without a write enable or
+ * a command sent while busy, are listed as violations.
+ *
+ *     trace-replay [--spi-hz N] [--csv FILE] spi.trace
+ */
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "flasher_proto.h"
+
+#define TARGETS                        (FLASHER_TRACE_TARGET_MASK + 1)
+#define NO_ADDR                        UINT32_MAX
+#define MAX_REPORTED                   10
+
+/**
+ * @brief Flash timing model, in microseconds (defaults as flasher-sim)
+ */
+struct timing {
+	uint32_t spi_hz;
+	uint32_t page_us;
+	uint32_t sector_us;
+	uint32_t block_us;
+	uint32_t chip_us;
+	uint32_t status_us;
+};
+
+static struct timing timing = {
+	.spi_hz = 1000000,
+	.page_us = 700,
+	.sector_us = 45000,
+	.block_us = 150000,
+	.chip_us = 5000000,
+	.status_us = 10000,
+};
+
+/**
+ * @brief One decoded trace record, times unwrapped to 64 bits
+ */
+struct record {
+	uint64_t start;
+	uint64_t end;
+	uint32_t addr;
+	uint16_t len;
+	uint8_t opcode;
+	uint8_t target;
+	bool failed;
+};
+
+/**
+ * @brief Model state of one target flash
+ */
+struct flash_model {
+	bool wel;
+	bool powered_down;
+	uint64_t busy_until;
+
+	/* Program or erase whose busy wait is being measured */
+	bool pending;
+	uint8_t pending_op;
+	uint64_t op_end;
+	uint64_t last_poll_end;
+	uint32_t polls;
+	uint32_t busy_us;
+};
+
+static struct flash_model model[TARGETS];
+
+static struct {
+	uint32_t count;
+	uint32_t failed;
+	uint64_t bytes;
+	uint64_t recorded_us;
+	uint64_t clocked_us;
+} per_op[256];
+
+static struct {
+	uint32_t waits;
+	uint64_t polls;
+	uint64_t recorded_us;
+	uint64_t modelled_us;
+	int64_t min_slack_us;
+} per_wait[256];
+
+static uint32_t violations;
+static FILE *csv;
+
+static const char *op_name(uint8_t op)
+{
+	switch (op) {
+	case 0x01: return "write SR1";
+	case 0x02: return "page program";
+	case 0x03: return "read";
+	case 0x04: return "write disable";
+	case 0x05: return "read SR1";
+	case 0x06: return "write enable";
+	case 0x0B: return "fast read";
+	case 0x20: return "sector erase";
+	case 0x31: return "write SR2";
+	case 0x32: return "quad page program";
+	case 0x35: return "read SR2";
+	case 0x60: return "chip erase";
+	case 0x66: return "reset enable";
+	case 0x6B: return "quad output read";
+	case 0x99: return "reset";
+	case 0x9F: return "JEDEC ID";
+	case 0xAB: return "release power-down";
+	case 0xB9: return "power-down";
+	case 0xC7: return "chip erase";
+	case 0xD8: return "64K block erase";
+	case 0xEB: return "quad I/O read";
+	default: return "?";
+	}
+}
+
+/**
+ * @brief Modelled busy time after a write, 0 for other opcodes
+ */
+static uint32_t busy_time(uint8_t op)
+{
+	switch (op) {
+	case 0x01:
+	case 0x31: return timing.status_us;
+	case 0x02:
+	case 0x32: return timing.page_us;
+	case 0x20: return timing.sector_us;
+	case 0xD8: return timing.block_us;
+	case 0x60:
+	case 0xC7: return timing.chip_us;
+	default: return 0;
+	}
+}
+
+/**
+ * @brief Time to clock a transaction, with the quad data phases of the
+ *        firmware (see quad_read and flash_page_program)
+ */
+static uint64_t clocked_us(uint8_t op, uint32_t bytes)
+{
+	uint32_t single = bytes;
+	uint64_t clocks;
+
+	switch (op) {
+	case 0x32:
+		single = 4;
+		break;
+	case 0x6B:
+		single = 5;
+		break;
+	case 0xEB:
+		single = 1;
+		break;
+	}
+	single = single < bytes ? single : bytes;
+	clocks = (uint64_t)single * 8 + (uint64_t)(bytes - single) * 2;
+
+	return (clocks * 1000000 + timing.spi_hz - 1) / timing.spi_hz;
+}
+
+static void violation(uint32_t seq, const struct record *r, const char *what)
+{
+	if (violations++ < MAX_REPORTED) {
+		printf("  #%u target %u %02X (%s) at %llu us: %s\n", seq,
+		       r->target, r->opcode, op_name(r->opcode),
+		       (unsigned long long)r->start, what);
+	}
+}
+
+/**
+ * @brief Account the busy wait after a program or erase once it is over
+ */
+static void close_wait(struct flash_model *m)
+{
+	uint64_t recorded;
+	int64_t slack;
+
+	if (!m->pending) {
+		return;
+	}
+	m->pending = false;
+
+	recorded = m->polls ? m->last_poll_end - m->op_end : 0;
+	slack = (int64_t)recorded - m->busy_us;
+
+	per_wait[m->pending_op].waits++;
+	per_wait[m->pending_op].polls += m->polls;
+	per_wait[m->pending_op].recorded_us += recorded;
+	per_wait[m->pending_op].modelled_us += m->busy_us;
+	if (per_wait[m->pending_op].waits == 1 ||
+	    slack < per_wait[m->pending_op].min_slack_us) {
+		per_wait[m->pending_op].min_slack_us = slack;
+	}
+}
+
+static void replay(uint32_t seq, const struct record *r)
+{
+	struct flash_model *m = &model[r->target];
+	const char *note = "";
+
+	per_op[r->opcode].count++;
+	per_op[r->opcode].bytes += r->len;
+	per_op[r->opcode].recorded_us += r->end - r->start;
+	per_op[r->opcode].clocked_us += clocked_us(r->opcode, r->len);
+	if (r->failed) {
+		per_op[r->opcode].failed++;
+		note = "failed";
+	}
+
+	if (m->powered_down && r->opcode != 0xAB) {
+		violation(seq, r, "sent while in deep power-down");
+		note = "powered down";
+	} else if (r->opcode != 0x05 && r->start < m->busy_until) {
+		violation(seq, r, "sent while busy (flash faster than model?)");
+		note = "busy";
+	}
+
+	if (r->opcode == 0x05) {
+		if (m->pending) {
+			m->polls++;
+			m->last_poll_end = r->end;
+		}
+	} else {
+		if (m->pending && m->polls == 0) {
+			violation(seq, r, "previous program or erase not polled");
+		}
+		close_wait(m);
+	}
+
+	switch (r->opcode) {
+	case 0x06:
+		m->wel = true;
+		break;
+	case 0x04:
+		m->wel = false;
+		break;
+	case 0xB9:
+		m->powered_down = true;
+		break;
+	case 0xAB:
+		m->powered_down = false;
+		break;
+	case 0x66:
+	case 0x99:
+		m->wel = false;
+		break;
+	default:
+		if (!busy_time(r->opcode)) {
+			break;
+		}
+		if (!m->wel) {
+			violation(seq, r, "no write enable, ignored by flash");
+			note = "no WEL";
+			break;
+		}
+		m->wel = false;
+		m->busy_until = r->end + busy_time(r->opcode);
+		m->pending = true;
+		m->pending_op = r->opcode;
+		m->op_end = r->end;
+		m->polls = 0;
+		m->busy_us = busy_time(r->opcode);
+		break;
+	}
+
+	if (csv) {
+		fprintf(csv, "%u,%u,0x%02X,", seq, r->target, r->opcode);
+		if (r->addr != NO_ADDR) {
+			fprintf(csv, "0x%06X", r->addr);
+		}
+		fprintf(csv, ",%u,%llu,%llu,%llu,%s\n", r->len,
+			(unsigned long long)r->start,
+			(unsigned long long)(r->end - r->start),
+			(unsigned long long)clocked_us(r->opcode, r->len),
+			note);
+	}
+}
+
+static uint32_t get_le32(const uint8_t *p)
+{
+	return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static void report(uint32_t records, uint64_t span_us)
+{
+	uint64_t busy_total = 0;
+	uint64_t spi_total = 0;
+	uint64_t wait_total = 0;
+	int op;
+
+	printf("\n%u transactions over %llu us at %u Hz\n\n", records,
+	       (unsigned long long)span_us, timing.spi_hz);
+
+	printf("opcode                      count    bytes  avg us  clocked  "
+	       "overhead  failed\n");
+	for (op = 0; op < 256; op++) {
+		uint32_t n = per_op[op].count;
+
+		if (!n) {
+			continue;
+		}
+		printf("%02X %-22s %8u %8llu %7llu %8llu %9lld %7u\n", op,
+		       op_name(op), n, (unsigned long long)per_op[op].bytes,
+		       (unsigned long long)(per_op[op].recorded_us / n),
+		       (unsigned long long)(per_op[op].clocked_us / n),
+		       (long long)(per_op[op].recorded_us -
+				   per_op[op].clocked_us) / n,
+		       per_op[op].failed);
+		spi_total += per_op[op].recorded_us;
+	}
+
+	printf("\nbusy wait                   count  polls  avg us  modelled  "
+	       "avg slack  min slack\n");
+	for (op = 0; op < 256; op++) {
+		uint32_t n = per_wait[op].waits;
+
+		if (!n) {
+			continue;
+		}
+		printf("%02X %-22s %8u %6.1f %7llu %9llu %10lld %10lld\n", op,
+		       op_name(op), n, (double)per_wait[op].polls / n,
+		       (unsigned long long)(per_wait[op].recorded_us / n),
+		       (unsigned long long)(per_wait[op].modelled_us / n),
+		       ((long long)per_wait[op].recorded_us -
+			(long long)per_wait[op].modelled_us) / n,
+		       (long long)per_wait[op].min_slack_us);
+		busy_total += per_wait[op].modelled_us;
+		wait_total += per_wait[op].recorded_us;
+	}
+
+	printf("\nflash busy (model)  %10llu us\n"
+	       "busy waiting        %10llu us\n"
+	       "polling overshoot   %10lld us\n"
+	       "in SPI transfers    %10llu us\n"
+	       "violations          %10u\n",
+	       (unsigned long long)busy_total, (unsigned long long)wait_total,
+	       (long long)wait_total - (long long)busy_total,
+	       (unsigned long long)spi_total, violations);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [options] TRACE\n"
+		"  --spi-hz N      SPI clock (default %u)\n"
+		"  --page-us N     page program time (default %u)\n"
+		"  --sector-us N   4KB sector erase time (default %u)\n"
+		"  --block-us N    64KB block erase time (default %u)\n"
+		"  --chip-us N     chip erase time (default %u)\n"
+		"  --status-us N   status register write time (default %u)\n"
+		"  --csv FILE      write one line per transaction\n",
+		prog, timing.spi_hz, timing.page_us, timing.sector_us,
+		timing.block_us, timing.chip_us, timing.status_us);
+}
+
+int main(int argc, char **argv)
+{
+	static const struct option opts[] = {
+		{"spi-hz", required_argument, NULL, 's'},
+		{"page-us", required_argument, NULL, 'p'},
+		{"sector-us", required_argument, NULL, 'e'},
+		{"block-us", required_argument, NULL, 'b'},
+		{"chip-us", required_argument, NULL, 'c'},
+		{"status-us", required_argument, NULL, 'w'},
+		{"csv", required_argument, NULL, 'o'},
+		{"help", no_argument, NULL, 'h'},
+		{0},
+	};
+	uint8_t raw[FLASHER_TRACE_RECORD_SIZE];
+	uint32_t prev_start = 0;
+	uint32_t prev_end = 0;
+	uint64_t first = 0;
+	uint64_t now = 0;
+	uint64_t last = 0;
+	uint32_t seq = 0;
+	FILE *in;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "h", opts, NULL)) != -1) {
+		switch (opt) {
+		case 's':
+			timing.spi_hz = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			timing.page_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			timing.sector_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			timing.block_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			timing.chip_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			timing.status_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			csv = fopen(optarg, "w");
+			if (!csv) {
+				perror(optarg);
+				return 1;
+			}
+			fprintf(csv, "seq,target,opcode,addr,len,start_us,"
+				"duration_us,clocked_us,note\n");
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (timing.spi_hz == 0 || optind != argc - 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	in = fopen(argv[optind], "rb");
+	if (!in) {
+		perror(argv[optind]);
+		return 1;
+	}
+
+	printf("violations:\n");
+	while (fread(raw, sizeof(raw), 1, in) == 1) {
+		struct record r;
+		uint32_t start = get_le32(&raw[FLASHER_TRACE_START]);
+		uint32_t end = get_le32(&raw[FLASHER_TRACE_END]);
+
+		/* The firmware clock is 32-bit microseconds; unwrap it */
+		now += seq ? (uint32_t)(start - prev_start) : 0;
+		r.start = now;
+		r.end = now + (uint32_t)(end - start);
+		if (seq == 0) {
+			first = r.start;
+		} else if ((uint32_t)(start - prev_end) > UINT32_MAX / 2) {
+			fprintf(stderr, "#%u starts before #%u ended\n", seq,
+				seq - 1);
+		}
+		prev_start = start;
+		prev_end = end;
+
+		r.addr = get_le32(&raw[FLASHER_TRACE_ADDR]);
+		r.len = raw[FLASHER_TRACE_LEN] |
+			raw[FLASHER_TRACE_LEN + 1] << 8;
+		r.opcode = raw[FLASHER_TRACE_OPCODE];
+		r.target = raw[FLASHER_TRACE_FLAGS] & FLASHER_TRACE_TARGET_MASK;
+		r.failed = raw[FLASHER_TRACE_FLAGS] & FLASHER_TRACE_FAILED;
+
+		replay(seq++, &r);
+		if (r.end > last) {
+			last = r.end;
+		}
+	}
+	fclose(in);
+
+	for (int t = 0; t < TARGETS; t++) {
+		close_wait(&model[t]);
+	}
+	if (violations > MAX_REPORTED) {
+		printf("  ... %u more\n", violations - MAX_REPORTED);
+	} else if (violations == 0) {
+		printf("  none\n");
+	}
+
+	report(seq, last - first);
+
+	if (csv) {
+		fclose(csv);
+	}
+	return 0;
+}